@@ -3,6 +3,7 @@
 
 #include <argp.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef enum {
     CMD_NONE,
@@ -31,6 +32,15 @@ typedef struct {
     CommandOutputType output_type;
     CommandType type;
     bool inline_code;
+    // Garbage collector settings, 0 when not given on the command line
+    size_t gc_initial;
+    double gc_growth;
+    size_t gc_max_heap;
+    double gc_target;
+    // Arena mode budget, only used when executing a file
+    size_t arena_budget;
+    // Run the optimizing tier over the code before running or writing it
+    bool optimize;
 } Command;
 
 Command parseArgs(const int argc, char* argv[]);
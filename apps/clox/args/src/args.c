@@ -6,6 +6,17 @@
 
 #include <args.h>
 
+#include <common/util.h>
+
+enum {
+    OPT_GC_INITIAL = 0x100,
+    OPT_GC_GROWTH,
+    OPT_GC_MAX_HEAP,
+    OPT_GC_TARGET,
+    OPT_ARENA,
+    OPT_OPTIMIZE,
+};
+
 static void printVersion(FILE *stream, struct argp_state *state) {
     (void) state;
     fprintf(stream, "%s\n", argp_program_version);
@@ -40,8 +51,31 @@ typedef struct{
         OUT_BYTECODE,
     } output_type;
     bool inline_code;
+    size_t gc_initial;
+    double gc_growth;
+    size_t gc_max_heap;
+    double gc_target;
+    size_t arena_budget;
+    bool optimize;
 } ParsingOptions;
 
+static size_t parseSizeOption(struct argp_state* state, const char* arg) {
+    size_t size;
+    if (!parseByteSize(arg, &size) || size == 0) {
+        argp_error(state, "Invalid size '%s'. Expected a positive byte count like 512K or 64M.", arg);
+    }
+    return size;
+}
+
+static double parseNumberOption(struct argp_state* state, const char* arg, double min, double max) {
+    char* end;
+    const double value = strtod(arg, &end);
+    if (end == arg || *end != '\0' || value <= min || value > max) {
+        argp_error(state, "Invalid value '%s'.", arg);
+    }
+    return value;
+}
+
 static error_t argpParser (int key, char *arg, struct argp_state *state) {
     ParsingOptions* options = state->input;
 
@@ -67,6 +101,24 @@ static error_t argpParser (int key, char *arg, struct argp_state *state) {
         case 'i':
             options->inline_code = true;
             break;
+        case OPT_GC_INITIAL:
+            options->gc_initial = parseSizeOption(state, arg);
+            break;
+        case OPT_GC_GROWTH:
+            options->gc_growth = parseNumberOption(state, arg, 1, 1e6);
+            break;
+        case OPT_GC_MAX_HEAP:
+            options->gc_max_heap = parseSizeOption(state, arg);
+            break;
+        case OPT_GC_TARGET:
+            options->gc_target = parseNumberOption(state, arg, 0, 1);
+            break;
+        case OPT_ARENA:
+            options->arena_budget = parseSizeOption(state, arg);
+            break;
+        case OPT_OPTIMIZE:
+            options->optimize = true;
+            break;
         case ARGP_KEY_ARG:
             if (state->arg_num == 0)
                 options->input_file = arg;
@@ -147,6 +199,43 @@ Command parseArgs(const int argc, char *argv[]) {
                 .key='i',
                 .doc="Inline code in bytecode output",
             },
+            {.doc="Garbage collector options:"},
+            {
+                .name="gc-initial",
+                .key=OPT_GC_INITIAL,
+                .arg="SIZE",
+                .doc="Heap size that triggers the first collection (default 1M)",
+            },
+            {
+                .name="gc-growth",
+                .key=OPT_GC_GROWTH,
+                .arg="FACTOR",
+                .doc="Heap growth between collections (default 2)",
+            },
+            {
+                .name="gc-max-heap",
+                .key=OPT_GC_MAX_HEAP,
+                .arg="SIZE",
+                .doc="Throw an out of memory exception past this heap size",
+            },
+            {
+                .name="gc-target",
+                .key=OPT_GC_TARGET,
+                .arg="FRACTION",
+                .doc="Adapt heap growth to spend this fraction of time in GC",
+            },
+            {
+                .name="arena",
+                .key=OPT_ARENA,
+                .arg="SIZE",
+                .doc="Allocate a run's objects from an arena, collecting only past SIZE",
+            },
+            {.doc="Optimizer options:"},
+            {
+                .name="optimize",
+                .key=OPT_OPTIMIZE,
+                .doc="Run the optimizing tier over the code before running or writing it",
+            },
             {
                 .name = NULL,
                 .key = 0,
@@ -164,13 +253,24 @@ Command parseArgs(const int argc, char *argv[]) {
         .input_file = NULL,
         .output_file = NULL,
         .input_type = IN_UNSET,
-        .output_type = OUT_UNSET
+        .output_type = OUT_UNSET,
+        .gc_initial = 0,
+        .gc_growth = 0,
+        .gc_max_heap = 0,
+        .gc_target = 0,
+        .arena_budget = 0,
+        .optimize = false,
     };
     argp_parse (&state, argc, argv,ARGP_IN_ORDER, &parsedArgs, &options);
 
-    if (parsedArgs <= 1) {
+    // Only garbage collector options given
+    if (parsedArgs <= 1 || (options.input_file == NULL && options.output_type == OUT_UNSET)) {
         return (Command){
             .type = CMD_REPL,
+            .gc_initial = options.gc_initial,
+            .gc_growth = options.gc_growth,
+            .gc_max_heap = options.gc_max_heap,
+            .gc_target = options.gc_target,
         };
     }
 
@@ -183,6 +283,12 @@ Command parseArgs(const int argc, char *argv[]) {
                 .input_type = (options.input_type == IN_SOURCE) 
                                 ? CMD_EXEC_SOURCE
                                 : CMD_EXEC_BINARY,
+                .gc_initial = options.gc_initial,
+                .gc_growth = options.gc_growth,
+                .gc_max_heap = options.gc_max_heap,
+                .gc_target = options.gc_target,
+                .arena_budget = options.arena_budget,
+                .optimize = options.optimize,
             };
         case OUT_BINARY:
             return (Command){
@@ -190,6 +296,7 @@ Command parseArgs(const int argc, char *argv[]) {
                 .input_file = options.input_file,
                 .output_file = options.output_file,
                 .inline_code = options.inline_code,
+                .optimize = options.optimize,
                 .input_type = (options.input_type == IN_SOURCE) 
                                 ? CMD_EXEC_SOURCE
                                 : CMD_EXEC_BINARY,
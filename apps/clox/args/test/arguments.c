@@ -88,6 +88,12 @@ void test(void** state) {
     assert_int_equal(expected.output_type, cmd->output_type);
     assert_int_equal(expected.inline_code, cmd->inline_code);
     assert_int_equal(expected.type, cmd->type);
+    assert_int_equal(expected.gc_initial, cmd->gc_initial);
+    assert_true(expected.gc_growth == cmd->gc_growth);
+    assert_int_equal(expected.gc_max_heap, cmd->gc_max_heap);
+    assert_true(expected.gc_target == cmd->gc_target);
+    assert_int_equal(expected.arena_budget, cmd->arena_budget);
+    assert_int_equal(expected.optimize, cmd->optimize);
 }
 
 #define named_test(test_name, state) { \
@@ -177,6 +183,80 @@ int main(void) {
                 .type = CMD_DISASSEMBLE
             }
             )
+        ),
+        named_test("test_args_gc_options",
+            makeTestState(
+                makeMainArgs(6, "./clox", "--gc-initial=4M", "--gc-growth=1.5",
+                             "--gc-max-heap=512K", "--gc-target=0.05", "input.lox"),
+                (Command) {
+                .input_file = "input.lox",
+                .output_file = NULL,
+                .input_type = CMD_EXEC_SOURCE,
+                .output_type = CMD_COMPILE_UNSET,
+                .inline_code = false,
+                .type = CMD_EXECUTE,
+                .gc_initial = 4 * 1024 * 1024,
+                .gc_growth = 1.5,
+                .gc_max_heap = 512 * 1024,
+                .gc_target = 0.05
+            }
+            )
+        ),
+        named_test("test_args_arena",
+            makeTestState(
+                makeMainArgs(3, "./clox", "--arena=64M", "input.lox"),
+                (Command) {
+                .input_file = "input.lox",
+                .output_file = NULL,
+                .input_type = CMD_EXEC_SOURCE,
+                .output_type = CMD_COMPILE_UNSET,
+                .inline_code = false,
+                .type = CMD_EXECUTE,
+                .arena_budget = 64 * 1024 * 1024
+            }
+            )
+        ),
+        named_test("test_args_optimize_binary",
+            makeTestState(
+                makeMainArgs(6, "./clox", "--optimize", "-cb", "input.lox.bin", "-o", "output.lox.bin"),
+                (Command) {
+                .input_file = "input.lox.bin",
+                .output_file = "output.lox.bin",
+                .input_type = CMD_EXEC_BINARY,
+                .output_type = CMD_COMPILE_BINARY,
+                .inline_code = false,
+                .type = CMD_COMPILE,
+                .optimize = true
+            }
+            )
+        ),
+        named_test("test_args_optimize_source",
+            makeTestState(
+                makeMainArgs(3, "./clox", "--optimize", "input.lox"),
+                (Command) {
+                .input_file = "input.lox",
+                .output_file = NULL,
+                .input_type = CMD_EXEC_SOURCE,
+                .output_type = CMD_COMPILE_UNSET,
+                .inline_code = false,
+                .type = CMD_EXECUTE,
+                .optimize = true
+            }
+            )
+        ),
+        named_test("test_args_gc_options_repl",
+            makeTestState(
+                makeMainArgs(2, "./clox", "--gc-max-heap=1G"),
+                (Command) {
+                .input_file = NULL,
+                .output_file = NULL,
+                .input_type = CMD_EXEC_UNSET,
+                .output_type = CMD_COMPILE_UNSET,
+                .inline_code = false,
+                .type = CMD_REPL,
+                .gc_max_heap = 1024 * 1024 * 1024
+            }
+            )
         )
     };
  
@@ -3,6 +3,7 @@
 
 #include <impl/binary.h>
 #include <impl/compiler.h>
+#include <impl/optimizer.h>
 #include <impl/vm.h>
 
 #include "exitcode.h"
@@ -49,7 +50,7 @@ static int handlerInputFileException(InputFileErrorCode code, const char* path)
     return EXIT_CODE_FAILED_TO_READ_FILE;
 }
 
-static int runSourceFile(const char* path) {
+static int runSourceFile(const char* path, const bool optimize) {
     const clock_t start = clock();
 
     InputFile source;
@@ -57,7 +58,14 @@ static int runSourceFile(const char* path) {
     if (ret != INPUT_FILE_SUCCESS) {
         return handlerInputFileException(ret, path);
     }
-    InterpretResult result = interpret(source);
+    InterpretResult result;
+    if (optimize) {
+        ObjFunction* compiled = compile(source);
+        if (compiled != NULL) optimizeFunction(compiled);
+        result = interpretCompiled(compiled);
+    } else {
+        result = interpret(source);
+    }
 
     const clock_t end = clock();
     displayTime(start, end);
@@ -74,10 +82,11 @@ static int runSourceFile(const char* path) {
     return 0;
 }
 
-static int runBinaryFile(const char* path) {
+static int runBinaryFile(const char* path, const bool optimize) {
     clock_t start = clock();
 
     ObjFunction* compiled = loadBinary(path);
+    if (optimize) optimizeFunction(compiled);
     InterpretResult result = interpretCompiled(compiled);
     
     clock_t end = clock();
@@ -102,18 +111,36 @@ int runFile(const Command* cmd) {
     }
 
     if (cmd->input_type == CMD_EXEC_SOURCE) {
-        return runSourceFile(cmd->input_file);
+        return runSourceFile(cmd->input_file, cmd->optimize);
     }
 
     if (cmd->input_type == CMD_EXEC_BINARY) {
-        return runBinaryFile(cmd->input_file);
+        return runBinaryFile(cmd->input_file, cmd->optimize);
     }
 
     fprintf(stderr, "Unknown input type for execution.\n");
     return EXIT_CODE_BAD_ARGS;
 }
 
+// Rewrites an existing binary with its bytecode optimized
+static int optimizeBinaryFile(const Command* cmd) {
+    clock_t start = clock();
+
+    ObjFunction* compiled = loadBinary(cmd->input_file);
+    optimizeFunction(compiled);
+    writeBinary(cmd->input_file, compiled, cmd->output_file);
+
+    clock_t end = clock();
+    displayTime(start, end);
+
+    return EXIT_SUCCESS;
+}
+
 int compileFile(const Command* cmd) {
+    if (cmd->input_type == CMD_EXEC_BINARY && cmd->optimize
+        && cmd->output_type == CMD_COMPILE_BINARY && cmd->output_file != NULL) {
+        return optimizeBinaryFile(cmd);
+    }
     if (cmd->input_type != CMD_EXEC_SOURCE) {
         fprintf(stderr, "Compilation only supported for source input.\n");
         return EXIT_CODE_BAD_ARGS;
@@ -139,6 +166,7 @@ int compileFile(const Command* cmd) {
     if (bytecode == NULL) {
         code = INTERPRET_COMPILE_ERROR;
     } else {
+        if (cmd->optimize) optimizeFunction(bytecode);
         writeBinary(cmd->input_file, bytecode, cmd->output_file);
     }
 
@@ -25,7 +25,17 @@ int executeCommand(const Command* cmd) {
 
 int main(const int argc, char* argv[]) {
     Command cmd = parseArgs(argc, argv);
-    
+
+    GCConfig gc = defaultGCConfig();
+    if (cmd.gc_initial != 0) gc.initialThreshold = cmd.gc_initial;
+    if (cmd.gc_growth != 0) gc.growthFactor = cmd.gc_growth;
+    if (cmd.gc_max_heap != 0) gc.maxHeap = cmd.gc_max_heap;
+    if (cmd.gc_target != 0) gc.targetGCFraction = cmd.gc_target;
+    if (cmd.arena_budget != 0) gc.arenaBudget = cmd.arena_budget;
+    // An arena run drops the globals it defined, which the next REPL line needs
+    if (cmd.type == CMD_REPL) gc.arenaBudget = 0;
+    configureGC(&gc);
+
     initVM();
     int exitCode = executeCommand(&cmd);
     freeVM();
@@ -0,0 +1,26 @@
+# Runs SCRIPT with CLOX and FLAGS and compares what it prints with
+# EXPECTED, leaving out the timing line. With EXPECTED_ERRORS the script
+# has to fail, reporting what that file holds
+execute_process(
+  COMMAND ${CLOX} ${FLAGS} ${SCRIPT}
+  OUTPUT_VARIABLE OUTPUT
+  ERROR_VARIABLE ERRORS
+  RESULT_VARIABLE RESULT
+)
+string(REGEX REPLACE "Execution time: [^\n]*\n" "" OUTPUT "${OUTPUT}")
+file(READ ${EXPECTED} EXPECTED_OUTPUT)
+
+if(EXPECTED_ERRORS)
+  file(READ ${EXPECTED_ERRORS} EXPECTED_ERROR_OUTPUT)
+  if(RESULT EQUAL 0)
+    message(FATAL_ERROR "${SCRIPT} succeeded, expected it to fail")
+  endif()
+  if(NOT ERRORS STREQUAL EXPECTED_ERROR_OUTPUT)
+    message(FATAL_ERROR "${SCRIPT} reported:\n${ERRORS}\nexpected:\n${EXPECTED_ERROR_OUTPUT}")
+  endif()
+elseif(NOT RESULT EQUAL 0)
+  message(FATAL_ERROR "${SCRIPT} exited with ${RESULT}:\n${ERRORS}")
+endif()
+if(NOT OUTPUT STREQUAL EXPECTED_OUTPUT)
+  message(FATAL_ERROR "${SCRIPT} printed:\n${OUTPUT}\nexpected:\n${EXPECTED_OUTPUT}")
+endif()
@@ -24,6 +24,9 @@ static_assert(
 
 arena_t *arena_create(size_t capacity);
 
+// Sets up an arena at the start of capacity bytes of caller owned memory
+arena_t *arena_init(void *memory, size_t capacity);
+
 void arena_destroy(arena_t *arena);
 
 void* arena_alloc(arena_t *arena, size_t size);
@@ -40,6 +43,11 @@ size_t arena_save(arena_t *arena);
 
 void arena_rewind(arena_t *arena, size_t checkpoint);
 
+// Walks the allocations in address order, NULL past the last one
+void* arena_first(arena_t *arena);
+
+void* arena_next(arena_t *arena, void *ptr);
+
 void* sbuff_alloc(size_t size);
 
 void* sbuff_calloc(size_t count, size_t size);
@@ -2,6 +2,8 @@
 #define __CLOX2_COMMON_UTIL_H__
 
 #include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -13,4 +15,23 @@
 
 #define massert(cond, msg) assert((cond) && msg)
 
+// Parses a byte count with an optional K, M or G suffix, e.g. "64M"
+static inline bool parseByteSize(const char* text, size_t* size) {
+    char* end;
+    const unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) return false;
+
+    unsigned long long scale = 1;
+    switch (*end) {
+        case 'k': case 'K': scale = 1ull << 10; end++; break;
+        case 'm': case 'M': scale = 1ull << 20; end++; break;
+        case 'g': case 'G': scale = 1ull << 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0') return false;
+
+    *size = (size_t) (value * scale);
+    return true;
+}
+
 #endif // __CLOX2_COMMON_UTIL_H__
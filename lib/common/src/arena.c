@@ -70,6 +70,13 @@ arena_t *arena_create(size_t capacity) {
     return arena;
 }
 
+arena_t *arena_init(void *memory, size_t capacity) {
+    massert(IS_ALIGNED(memory), "unaligned arena memory");
+    arena_t* arena = memory;
+    init_arena(arena, capacity);
+    return arena;
+}
+
 void arena_destroy(arena_t *arena) {
     free(arena);
 }
@@ -187,6 +194,17 @@ void arena_rewind(arena_t *arena, size_t checkpoint) {
     arena->position = checkpoint;
 }
 
+void* arena_first(arena_t *arena) {
+    if (arena->position == sizeof(arena_t)) return NULL;
+    return ((uint8_t*)arena) + sizeof(arena_t) + sizeof(block_header_t);
+}
+
+void* arena_next(arena_t *arena, void *ptr) {
+    uint8_t* next = ((uint8_t*) BLOCK_BASE(ptr)) + BLOCK_SIZE(ptr);
+    if (next >= ((uint8_t*)arena) + arena->position) return NULL;
+    return next + sizeof(block_header_t);
+}
+
 void* sbuff_alloc(size_t size) {
     return arena_alloc(temp_arena, size);
 }
@@ -41,6 +41,8 @@
 #define RESET() arena_reset(TEMP_ARENA_NAME)
 #define SAVE() arena_save(TEMP_ARENA_NAME)
 #define REWIND(checkpoint) arena_rewind(TEMP_ARENA_NAME, checkpoint)
+#define FIRST() arena_first(TEMP_ARENA_NAME)
+#define NEXT(ptr) arena_next(TEMP_ARENA_NAME, ptr)
 
 #endif
 
@@ -55,6 +57,8 @@
 #undef RESET
 #undef SAVE
 #undef REWIND
+#undef FIRST
+#undef NEXT
 
 #endif
 
@@ -161,6 +161,38 @@ static void TEST_NAME(free)(void**) {
     assert_uint_equal(SAVE(), before2);
 }
 
+#ifdef USE_ARENA
+
+static void TEST_NAME(walk)(void**) {
+    assert_null(FIRST());
+
+    void* ptr0 = ALLOC(20);
+    void* ptr1 = ALLOC(100);
+    void* ptr2 = ALLOC(8);
+    assert_ptr_equal(FIRST(), ptr0);
+    assert_ptr_equal(NEXT(ptr0), ptr1);
+    assert_ptr_equal(NEXT(ptr1), ptr2);
+    assert_null(NEXT(ptr2));
+
+    // Freeing the last allocation ends the walk before it
+    FREE(ptr2);
+    assert_null(NEXT(ptr1));
+}
+
+static void TEST_NAME(init)(void**) {
+    alignas(max_align_t) uint8_t memory[256];
+    arena_t* arena = arena_init(memory, sizeof(memory));
+    assert_ptr_equal(arena, memory);
+    assert_uint_equal(arena_save(arena), sizeof(arena_t));
+
+    void* ptr = arena_alloc(arena, 64);
+    assert_non_null(ptr);
+    assert_ptr_equal(arena_first(arena), ptr);
+    assert_null(arena_alloc(arena, 256));
+}
+
+#endif // USE_ARENA
+
 static int TEST_NAME(verify)(void**) {
     assert_uint_equal(SAVE(), sizeof(arena_t));
     return 0;
@@ -206,6 +238,10 @@ int TEST_SUITE_FUNCTION()(void) {
         TEST_CASE(TEST_NAME(realloc_increase)),
         TEST_CASE(TEST_NAME(reuse)),
         TEST_CASE(TEST_NAME(free)),
+#ifdef USE_ARENA
+        TEST_CASE(TEST_NAME(walk)),
+        TEST_CASE(TEST_NAME(init)),
+#endif // USE_ARENA
     };
 
     return cmocka_run_group_tests(sbuff_tests, TEST_NAME(init_suite), TEST_NAME(teardown_suite));
@@ -4,6 +4,7 @@
 #include <clox/value.h>
 #include <clox/valarray.h>
 
+// Opcodes are stored in binaries by number, new ones go at the end
 #define OPCODE_ENUM_LIST \
     ENUM_OPCODE_DEF(OP_ARRAY) \
     ENUM_OPCODE_DEF(OP_CONSTANT) \
@@ -56,7 +57,50 @@
     ENUM_OPCODE_DEF(OP_THROW) \
     ENUM_OPCODE_DEF(OP_PUSH_EXCEPTION_HANDLER) \
     ENUM_OPCODE_DEF(OP_POP_EXCEPTION_HANDLER) \
-    ENUM_OPCODE_DEF(OP_PROPAGATE_EXCEPTION)
+    ENUM_OPCODE_DEF(OP_PROPAGATE_EXCEPTION) \
+    ENUM_OPCODE_DEF(OP_JUMP_IF_TRUE) \
+    ENUM_OPCODE_DEF(OP_SET_LOCAL_POP) \
+    ENUM_OPCODE_DEF(OP_REG_MOVE) \
+    ENUM_OPCODE_DEF(OP_REG_LOAD_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_ADD) \
+    ENUM_OPCODE_DEF(OP_REG_SUBTRACT) \
+    ENUM_OPCODE_DEF(OP_REG_MULTIPLY) \
+    ENUM_OPCODE_DEF(OP_REG_DIVIDE) \
+    ENUM_OPCODE_DEF(OP_REG_MODULUS) \
+    ENUM_OPCODE_DEF(OP_REG_ADD_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_SUBTRACT_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_MULTIPLY_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_DIVIDE_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_MODULUS_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_ADD) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_SUBTRACT) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_MULTIPLY) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_DIVIDE) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_MODULUS) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_EQUAL) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_GREATER) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_LESS) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_ADD_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_SUBTRACT_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_MULTIPLY_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_DIVIDE_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_MODULUS_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_EQUAL_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_GREATER_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_REG_PUSH_LESS_CONSTANT) \
+    ENUM_OPCODE_DEF(OP_INLINE_CALL) \
+    ENUM_OPCODE_DEF(OP_INLINE_INVOKE) \
+    ENUM_OPCODE_DEF(OP_INLINE_RETURN) \
+    ENUM_OPCODE_DEF(OP_DUP_PAIR) \
+    ENUM_OPCODE_DEF(OP_UPDATE_PROPERTY) \
+    ENUM_OPCODE_DEF(OP_UPDATE_INDEX) \
+    ENUM_OPCODE_DEF(OP_UPDATE_GLOBAL) \
+    ENUM_OPCODE_DEF(OP_UPDATE_UPVALUE) \
+    ENUM_OPCODE_DEF(OP_SWITCH_DENSE) \
+    ENUM_OPCODE_DEF(OP_SWITCH_HASHED) \
+    ENUM_OPCODE_DEF(OP_FOR_PREP) \
+    ENUM_OPCODE_DEF(OP_FOR_LOOP) \
+    ENUM_OPCODE_DEF(OP_DEFINE_CONSTANT)
 
 typedef enum {
 #define ENUM_OPCODE_DEF(name) name,
@@ -65,6 +109,92 @@ typedef enum {
     OP_LAST
 } OpCode;
 
+// Register instructions take frame slots and constants as operands
+// instead of the stack. The ones doing arithmetic or comparisons are
+// followed by the stack instructions they stand for, which run on the
+// pushed operands whenever those aren't both numbers:
+//   OP_REG_MOVE dst src
+//   OP_REG_LOAD_CONSTANT dst constant
+//   OP_REG_ADD a b OP_ADD OP_SET_LOCAL_POP dst, likewise the others
+//   OP_REG_ADD_CONSTANT a constant OP_ADD OP_SET_LOCAL_POP dst
+//   OP_REG_PUSH_ADD a b OP_ADD, pushing the result
+//   OP_REG_PUSH_ADD_CONSTANT a constant OP_ADD
+#define REGISTER_STORE_LENGTH 6
+#define REGISTER_PUSH_LENGTH 4
+
+// Flags of each capture following OP_CLOSURE. Without CAPTURE_LOCAL the
+// index is one of the enclosing closure's upvalues, which is taken over
+// as is. Locals that are never assigned are copied into the closure
+// with CAPTURE_VALUE instead of being shared through an ObjUpvalue
+#define CAPTURE_LOCAL 0x01
+#define CAPTURE_VALUE 0x02
+
+// A call with the callee's code inlined. The guard checks the call goes
+// to the function the code came from, jumping to the call left behind
+// the inlined code otherwise:
+//   OP_INLINE_CALL function argCount fallback(2) code
+//       OP_INLINE_RETURN depth skip(2) OP_CALL argCount
+//   OP_INLINE_INVOKE name function argCount fallback(2) code
+//       OP_INLINE_RETURN depth skip(2) OP_INVOKE name argCount
+// The inlined code addresses the callee's slots from the one holding the
+// callee or receiver. OP_INLINE_RETURN leaves its result in that slot,
+// dropping the depth values above it, and skips the call
+#define INLINE_CALL_LENGTH 5
+#define INLINE_INVOKE_LENGTH 6
+#define INLINE_RETURN_LENGTH 4
+
+// A compound assignment done in place, with the target located once.
+// The operand is pushed first and the arithmetic opcode is an operand.
+// When the target or the values don't allow it, the operand is popped
+// and the stack code that follows does the assignment instead:
+//   object operand OP_UPDATE_PROPERTY name operator skip(2)
+//       OP_DUP OP_GET_PROPERTY name operand operator OP_SET_PROPERTY name
+//   array index operand OP_UPDATE_INDEX operator skip(2)
+//       OP_DUP_PAIR OP_GET_INDEX operand operator OP_SET_INDEX
+//   operand OP_UPDATE_GLOBAL name operator skip(2)
+//       OP_GET_GLOBAL name operand operator OP_SET_GLOBAL name
+//   operand OP_UPDATE_UPVALUE index operator skip(2)
+//       OP_GET_UPVALUE index operand operator OP_SET_UPVALUE index
+// Done in place, the result replaces the values locating the target and
+// the stack code is skipped
+#define UPDATE_LENGTH 5
+#define UPDATE_INDEX_LENGTH 4
+
+// Table dispatch of a switch on its literal cases. The switched value
+// stays on the stack, a matching case jumps to the address of its body
+// and anything else continues with the next instruction:
+//   OP_SWITCH_DENSE low count(2) address(2)...
+//       one address for each int from the constant low on
+//   OP_SWITCH_HASHED capacity(2) {key address(2)}...
+//       capacity slots, a power of two, probed linearly from the one the
+//       value's switchHash() picks. Keys are constants
+// Addresses are offsets into the code, NO_CASE where no case matches
+#define SWITCH_DENSE_HEADER 4
+#define SWITCH_DENSE_ENTRY 2
+#define SWITCH_HASHED_HEADER 3
+#define SWITCH_HASHED_ENTRY 3
+#define NO_CASE 0xFFFF
+
+// A for loop counting a local up or down by an int step towards a local
+// or constant limit. Each guards the generic code that follows it, which
+// runs whenever the counter or the limit isn't an int:
+//   OP_FOR_PREP counter flags limit body(2)
+//       the condition
+//   OP_FOR_LOOP counter flags limit step body(2)
+//       the increment, then the loop back to the condition
+// OP_FOR_PREP jumps to the body when the condition holds. OP_FOR_LOOP
+// adds the signed byte step to the counter and jumps to the body when
+// the condition holds for the result, leaving the counter as it was
+// otherwise, so that the generic code ends the loop
+#define FOR_PREP_LENGTH 6
+#define FOR_LOOP_LENGTH 7
+// The counter is compared with > instead of <
+#define FOR_GREATER 0x01
+// The comparison is negated, making it >= or <=
+#define FOR_NEGATED 0x02
+// The limit is a constant instead of a slot
+#define FOR_LIMIT_CONSTANT 0x04
+
 static_assert(
     OP_CONSTANT_ZERO + 1 == OP_CONSTANT_ONE &&
     OP_CONSTANT_ZERO + 2 == OP_CONSTANT_TWO,
@@ -94,8 +224,25 @@ void freeChunk(Chunk* chunk);
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 
+// Drops the code from offset count onwards, with its line information
+void truncateChunk(Chunk* chunk, int count);
+
+// Bytes taken by the instruction at offset, operands included
+int instructionLength(const Chunk* chunk, int offset);
+
+// Offset of the inline guard whose inlined code the instruction belongs
+// to, -1 for an instruction of the function's own
+int inlinedCallAt(const Chunk* chunk, int instruction);
+
 int getLine(Chunk* chunk, int instruction);
 
+// Hash of a value that can equal a literal, the same for numbers equal
+// as ints and as doubles
+uint32_t switchHash(Value value);
+
+// Index of a constant identical to the value, -1 when there's none
+int findConstant(const Chunk* chunk, Value value);
+
 int addConstant(Chunk* chunk, Value value);
 
 #endif //__CLOX2_CHUNK_H__
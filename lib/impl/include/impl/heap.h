@@ -0,0 +1,84 @@
+#ifndef __CLOX2_HEAP_H__
+#define __CLOX2_HEAP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Pages are aligned to their size, so the page owning a block can be
+// found by masking the block address.
+#define HEAP_PAGE_SIZE ((size_t) 64 * 1024)
+
+// Requests up to this size are served from size-class pages.
+#define HEAP_SMALL_MAX ((size_t) 512)
+
+// Requests of at least this size are mapped directly. Everything in
+// between goes through libc.
+#define HEAP_LARGE_MIN ((size_t) 128 * 1024)
+
+// Empty pages kept committed after a sweep, and for how many sweeps.
+// Anything beyond that is returned to the OS with madvise.
+#define HEAP_RETAIN_BYTES ((size_t) 4 * 1024 * 1024)
+#define HEAP_RETAIN_SWEEPS 4
+
+// Address space reserved for objects when references are compressed,
+// the most 32-bit references scaled by 8 can reach
+#define HEAP_REGION_SIZE ((size_t) 32 * 1024 * 1024 * 1024)
+
+void* heapAllocate(size_t size);
+
+void heapFree(void* pointer, size_t size);
+
+void* heapReallocate(void* pointer, size_t oldSize, size_t newSize);
+
+typedef void (*HeapFreeFn)(void* object);
+
+// Objects get pages of their own, with mark and allocation bits kept
+// in side bitmaps instead of the object headers. Objects larger than
+// HEAP_SMALL_MAX are mapped one per page run.
+void* heapAllocateObject(size_t size);
+
+void heapFreeObject(void* pointer, size_t size);
+
+// Immortal objects are bump allocated into pages that are never swept.
+// They count as marked, and freeing one leaves its memory in place.
+void* heapAllocateImmortal(size_t size);
+
+bool heapIsImmortal(const void* object);
+
+// Objects of a run in arena mode are bump allocated from arenas laid
+// out in object pages and all released together. Until then they are
+// never swept and count as marked. Returns NULL once the arena would
+// grow past budget bytes.
+void* heapAllocateArena(size_t size, size_t budget);
+
+bool heapIsArena(const void* object);
+
+// Calls visitFn on every allocation of the arena, in address order
+void heapWalkArena(HeapFreeFn visitFn);
+
+// Empties the arena, its pages are kept for the next run
+void heapResetArena();
+
+bool heapIsMarked(const void* object);
+
+void heapMark(const void* object);
+
+// Frees unmarked large objects, small object pages are swept lazily
+void heapStartSweep(HeapFreeFn freeFn);
+
+bool heapSweeping();
+
+// Sweeps at most pageCount object pages, returns true once the sweep is done
+bool heapSweepObjects(size_t pageCount, HeapFreeFn freeFn);
+
+void heapFreeObjects(HeapFreeFn freeFn);
+
+void heapReleaseEmptyPages();
+
+size_t heapMappedBytes();
+
+size_t heapCommittedBytes();
+
+void freeHeap();
+
+#endif //__CLOX2_HEAP_H__
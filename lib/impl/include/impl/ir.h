@@ -0,0 +1,17 @@
+#ifndef __CLOX2_IR_H__
+#define __CLOX2_IR_H__
+
+#include <impl/object.h>
+
+// Optimizing tier. Lifts the function's bytecode into basic blocks over
+// SSA values, eliminates repeated property loads, hoists loop invariant
+// loads and lowers the result back into the chunk. Code the analysis
+// can't follow is left as it was
+void optimizeIR(ObjFunction* function);
+
+// Replaces calls of small global functions and methods anywhere in the
+// script by their code, behind a guard falling back to the call when
+// the callee isn't the function seen at compile time
+void inlineCalls(ObjFunction* script);
+
+#endif //__CLOX2_IR_H__
@@ -9,6 +9,14 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+#define FREE_OBJ(type, pointer) reallocateObject(pointer, sizeof(type), 0)
+
+#define FLEX_OBJ_SIZE(type, elementType, count) \
+    (sizeof(type) + sizeof(elementType) * (size_t) (count))
+
+#define FREE_FLEX_OBJ(type, elementType, count, pointer) \
+    reallocateObject(pointer, FLEX_OBJ_SIZE(type, elementType, count), 0)
+
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
@@ -20,6 +28,21 @@
 
 void* reallocate(void* previous, size_t oldSize, size_t newSize);
 
+void* reallocateObject(void* previous, size_t oldSize, size_t newSize);
+
+// Objects allocated between these live until freeVM and are never
+// marked or swept. Used for runtime-owned and loaded bytecode objects.
+void beginImmortal();
+
+void endImmortal();
+
+// Starts allocating from the arena if arena mode is configured
+void beginArena();
+
+// Frees every arena object and drops what may still point at them:
+// non-builtin globals, static fields of builtin classes, interned strings
+void releaseArena();
+
 void markObject(Obj* object);
 
 void markValue(Value value);
@@ -28,6 +51,12 @@ void markArray(ValueArray* array);
 
 void collectGarbage();
 
+void sweepStep();
+
+// Collects again before an exceeded heap limit is raised, as the values
+// holding the memory may have been dropped since. True if it still is
+bool heapStillExhausted();
+
 void freeObjects();
 
 #endif //__CLOX2_MEMORY_H__
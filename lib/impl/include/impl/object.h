@@ -8,7 +8,12 @@
 
 #include <impl/chunk.h>
 
-#define CALL_OBJ(callee, argCount) AS_OBJ(callee)->vtp->call(AS_OBJ(callee), argCount)
+#define OBJ_VT(object) (&vtList[(object)->type])
+
+#define CALL_OBJ(callee, argCount) OBJ_VT(AS_OBJ(callee))->call(AS_OBJ(callee), argCount)
+
+#define IS_UPVALUE(value) isObjType(value, OBJ_UPVALUE)
+#define AS_UPVALUE(value) ((ObjUpvalue*) AS_OBJ(value))
 
 typedef bool (*CallableFn)(Obj*, int);
 
@@ -25,26 +30,30 @@ typedef struct ObjVT {
     PrintFn print;
 } ObjVT;
 
+extern ObjVT vtList[OBJ_LAST];
+
 typedef struct ObjFunction {
     Obj obj;
     int arity;
     int upvalueCount;
     Chunk chunk;
-    ObjString* name;
+    REF(ObjString) name;
 } ObjFunction;
 
 typedef struct ObjUpvalue {
     Obj obj;
+    REF(struct ObjUpvalue) next;
     Value* location;
     Value closed;
-    struct ObjUpvalue* next;
 } ObjUpvalue;
 
 typedef struct ObjClosure {
     Obj obj;
-    ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalueCount;
+    REF(ObjFunction) function;
+    // Copies of captured variables that are never assigned, an
+    // ObjUpvalue shared with the enclosing function for the others
+    Value upvalues[];
 } ObjClosure;
 
 typedef struct ObjNative {
@@ -56,8 +65,16 @@ typedef struct ObjNative {
 
 typedef struct ObjBoundMethod {
     Obj obj;
+    REF(Obj) method;
     Value receiver;
-    Obj* method;
 } ObjBoundMethod;
 
+// Allocates a string with room for length characters, which the caller
+// fills in before handing it to internString
+ObjString* allocateString(int length);
+
+// Returns the interned copy of the string, freeing the string if
+// an equal one was interned already
+ObjString* internString(ObjString* string);
+
 #endif //__CLOX2_OBJECT_H__
@@ -0,0 +1,24 @@
+#ifndef __CLOX2_OPTIMIZER_H__
+#define __CLOX2_OPTIMIZER_H__
+
+#include <clox/export.h>
+
+#include <impl/chunk.h>
+#include <impl/object.h>
+
+// Peephole pass over finished bytecode. Jumps, exception handler
+// addresses and line information are rewritten to match the new code
+void optimizeChunk(Chunk* chunk);
+
+// Runs the optimizing tier and the peephole pass over the function and
+// every function among its constants, then inlines small functions
+CLOX_EXPORT void optimizeFunction(ObjFunction* function);
+
+#ifdef REGISTER_VM
+// Rewrites the stack code of the function and its nested functions into
+// register instructions where it can. Done last, right before the code
+// is run or written, the other passes only understand stack code
+void lowerToRegisters(ObjFunction* function);
+#endif
+
+#endif //__CLOX2_OPTIMIZER_H__
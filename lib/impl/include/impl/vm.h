@@ -23,6 +23,8 @@ typedef struct {
     Value klass;
     uint16_t handlerAddress;
     uint16_t finallyAddress;
+    // Stack top when the try block was entered
+    Value* stackTop;
 } ExceptionHandler;
 
 typedef struct {
@@ -55,6 +57,37 @@ typedef struct {
 
 extern NativeLibraryState nativeState;
 
+typedef struct {
+    // Bytes allocated before the first collection
+    size_t initialThreshold;
+    // The next collection starts once the heap grows by this factor
+    double growthFactor;
+    // Upper bound on the heap, 0 for no limit
+    size_t maxHeap;
+    // Share of run time the adaptive pacer aims to spend collecting,
+    // 0 keeps the growth factor fixed
+    double targetGCFraction;
+    // Bytes a run may bump allocate from an arena without collecting,
+    // 0 disables arena mode. The arena is released when interpret returns,
+    // along with the globals the run defined, so it suits one-shot runs.
+    // Past the budget, collection resumes as usual.
+    size_t arenaBudget;
+} GCConfig;
+
+typedef enum {
+    ARENA_OFF,
+    // Objects come from the arena and nothing is collected
+    ARENA_ALLOCATING,
+    // The budget ran out, the arena objects are traced as roots
+    ARENA_SPENT,
+} ArenaState;
+
+typedef struct {
+    Obj** objects;
+    int count;
+    int capacity;
+} ObjList;
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
@@ -64,17 +97,31 @@ typedef struct {
     
     Value* stackTop;
     Table globals;
+    // Names of the globals declared const, which can't be assigned
+    Table constantGlobals;
     Table strings;
     ObjString* initString;
     ObjUpvalue* openUpvalues;
 
     size_t bytesAllocated;
     size_t nextGC;
-    Obj* objects;
+    GCConfig gc;
+    bool gcConfigured;
+    double gcGrowth;
+    double gcLastEnd;
+    bool heapExhausted;
 
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+
+    // Objects allocated into the immortal space, for freeVM to release
+    ObjList immortals;
+    // Immortal objects that may point to collectable ones, traced as roots
+    ObjList rememberedImmortals;
+    // Index of the first object of the open immortal section, -1 if none
+    int immortalSection;
+    ArenaState arena;
     jmp_buf exit_state;
     bool exit_state_ready;
     int exit_code;
@@ -89,6 +136,10 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
+CLOX_EXPORT GCConfig defaultGCConfig();
+
+CLOX_EXPORT void configureGC(const GCConfig* config);
+
 CLOX_EXPORT void initVM();
 
 CLOX_EXPORT void freeVM();
@@ -7,6 +7,7 @@
 #include <clox/export.h>
 
 #include <clox/native.h>
+#include <clox/ref.h>
 #include <clox/value.h>
 #include <clox/valarray.h>
 
@@ -62,11 +63,10 @@ static inline const char* objTypeToString(const ObjType type) {
 
 typedef struct ObjVT ObjVT;
 
+// Mark bits live in the heap's side bitmaps and the heap needs no object
+// list, so the type is all the header holds. The vtable is looked up by it.
 typedef struct Obj {
-    ObjType type;
-    bool isMarked;
-    ObjVT* vtp;
-    struct Obj* next;
+    uint8_t type;
 } Obj;
 
 typedef struct ObjArray ObjArray;
@@ -136,7 +136,7 @@ typedef struct ObjArray{
 
 typedef struct ObjClass {
     Obj obj;
-    ObjString* name;
+    REF(ObjString) name;
     Value initializer;
     Table fields;
     Table methods;
@@ -145,16 +145,17 @@ typedef struct ObjClass {
 
 typedef struct ObjInstance {
     Obj obj;
+    REF(ObjClass) klass;
     Value this_;
-    ObjClass* klass;
     Table fields;
 } ObjInstance;
 
+// The characters are stored inline, right after the header
 typedef struct ObjString {
     Obj obj;
     int length;
     uint32_t hash;
-    char* chars;
+    char chars[];
 } ObjString;
 
 
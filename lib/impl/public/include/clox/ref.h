@@ -0,0 +1,53 @@
+#ifndef __CLOX_LIB_REF_H__
+#define __CLOX_LIB_REF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <clox/export.h>
+
+/**
+ * References from one heap object to another.
+ *
+ * With COMPRESSED_REFS every object lives in a single reserved region
+ * and such references are stored as 32-bit offsets into it, scaled by
+ * the 8 byte object alignment, which covers a region of up to 32GB.
+ * Otherwise they are plain pointers.
+ *
+ * Fields declared with REF(type) are read with DEREF and written
+ * with MAKE_REF, NULL_REF stands for a NULL pointer.
+**/
+
+#ifdef COMPRESSED_REFS
+
+#define REF_SHIFT 3
+
+typedef uint32_t ObjRef;
+
+CLOX_EXPORT extern uint8_t* heapRegionBase;
+
+#define REF(type) ObjRef
+#define NULL_REF ((ObjRef) 0)
+#define MAKE_REF(pointer) pointerToRef(pointer)
+#define DEREF(type, ref) ((type*) refToPointer(ref))
+
+// Offset zero is the header of the first page, never an object
+static inline ObjRef pointerToRef(const void* pointer) {
+    if (pointer == NULL) return NULL_REF;
+    return (ObjRef) (((const uint8_t*) pointer - heapRegionBase) >> REF_SHIFT);
+}
+
+static inline void* refToPointer(const ObjRef ref) {
+    return ref == NULL_REF ? NULL : heapRegionBase + ((size_t) ref << REF_SHIFT);
+}
+
+#else
+
+#define REF(type) type*
+#define NULL_REF NULL
+#define MAKE_REF(pointer) (pointer)
+#define DEREF(type, ref) ((type*) (ref))
+
+#endif
+
+#endif // __CLOX_LIB_REF_H__
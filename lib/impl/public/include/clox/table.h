@@ -2,21 +2,57 @@
 #define __CLOX2_TABLE_H__
 
 #include <clox/export.h>
+#include <clox/ref.h>
 #include <clox/value.h>
 
 typedef struct ObjString ObjString;
 
-#define TABLE_MAX_LOAD 0.75
+// Probing stops at the first group holding an empty slot, which
+// keeps working well up to a high load factor
+#define TABLE_MAX_LOAD 0.875
 
+#ifdef COMPRESSED_REFS
+// A 4 byte key next to an 8 byte value, packed to 12 bytes per entry
+#pragma pack(push, 4)
+#endif
 typedef struct {
-    ObjString* key;
+    REF(ObjString) key;
     Value value;
 } Entry;
+#ifdef COMPRESSED_REFS
+#pragma pack(pop)
+#endif
+
+// Tables up to this size keep their entries inline, without hashing
+#define TABLE_INLINE_CAPACITY 8
 
 typedef struct {
-    Entry* entries;
     int count;
+    // Zero while the entries are inline
     int capacity;
+    union {
+        struct {
+            Entry* entries;
+            // One byte per slot holding 7 bits of the key hash, or marking it
+            // empty or deleted, so lookups scan a whole group of slots at once
+            uint8_t* control;
+            // Empty slots that can be filled before the table is rehashed
+            int growthLeft;
+            // Slots of the previous storage already moved over while a
+            // large table is resized incrementally
+            int migrated;
+            // The previous storage, NULL once everything has been moved
+            Entry* oldEntries;
+            uint8_t* oldControl;
+            int oldCapacity;
+        };
+        // The first count slots are taken, keys are kept apart from the
+        // values so they can be compared all at once
+        struct {
+            REF(ObjString) keys[TABLE_INLINE_CAPACITY];
+            Value values[TABLE_INLINE_CAPACITY];
+        } small;
+    };
 } Table;
 
 typedef struct {
@@ -47,6 +83,20 @@ CLOX_NO_EXPORT ObjString* tableFindOrAddString(
     int length, uint32_t hash
 );
 
+// Slot holding the key's value, -1 when the key is missing. Reading and
+// replacing the value through the slot looks the key up only once, the
+// slot stays valid until the table is next changed
+CLOX_NO_EXPORT int tableFindSlot(Table* table, ObjString* key);
+
+CLOX_NO_EXPORT Value tableGetSlot(const Table* table, int slot);
+
+CLOX_NO_EXPORT void tableSetSlot(Table* table, int slot, Value value);
+
+typedef bool (*TableEntryPredicate)(ObjString* key, Value value);
+
+// Removes the entries the predicate holds for, without allocating
+CLOX_NO_EXPORT void tableRemoveIf(Table* table, TableEntryPredicate remove);
+
 CLOX_NO_EXPORT void tableRemoveWhite(Table* table);
 
 CLOX_NO_EXPORT void markTable(Table* table);
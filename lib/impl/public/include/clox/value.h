@@ -16,16 +16,21 @@ typedef struct ObjString ObjString;
 #define TAG_NIL 1 // 01
 #define TAG_FALSE  2 // 10
 #define TAG_TRUE 3 // 11
+// Set on quiet NaNs carrying an int32 in their low 32 bits
+#define TAG_INT ((uint64_t)0x0001000000000000)
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN || IS_INT(value))
 #define IS_OBJ(value) \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value) (value == TRUE_VAL)
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
 #define AS_NUMBER(value) valueToNum(value)
 #define AS_OBJ(value) \
     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
@@ -34,11 +39,13 @@ typedef uint64_t Value;
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define INT_VAL(num) ((Value)(QNAN | TAG_INT | (uint64_t)(uint32_t)(int32_t)(num)))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) \
     ((Value) (SIGN_BIT | QNAN | (uint64_t)(uintptr_t)((Obj*) obj)))
 
 static inline double valueToNum(const Value value) {
+    if (IS_INT(value)) return AS_INT(value);
     double num;
     memcpy(&num, &value, sizeof(double));
     return num;
@@ -55,6 +62,8 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    // A number that is an int32, stored as one so integer math stays cheap
+    VAL_INT,
     VAL_OBJ,
 } ValueType;
 
@@ -64,28 +73,40 @@ typedef struct Value {
     union {
         bool boolean;
         double number;
+        int32_t integer;
         Obj* obj;
     } as;
 } Value;
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER || (value).type == VAL_INT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_OBJ(value) ((value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+#define AS_NUMBER(value) valueToNum(value)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define TRUE_VAL BOOL_VAL(true)
 #define FALSE_VAL BOOL_VAL(false)
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(value) ((Value) {VAL_OBJ, {.obj = (Obj*) value}})
 
+static inline double valueToNum(const Value value) {
+    return IS_INT(value) ? AS_INT(value) : value.as.number;
+}
+
 #endif
 
+// Stores number as an int when that doesn't change its value,
+// so literals and loaded constants take the integer fast paths
+Value canonicalNumber(double number);
+
 bool valuesEqual(Value a, Value b);
 
 #endif // __CLOX_LIB_VALUE_H__
@@ -7,6 +7,8 @@
 #include <impl/vm.h>
 
 #include <impl/binary.h>
+#include <impl/memory.h>
+#include <impl/optimizer.h>
 
 #define SAVE_FAILURE 44
 #define LOAD_FAILURE 33
@@ -25,7 +27,7 @@
 
 typedef enum {
     SEG_FILE_START = 0x0000020B, // ZERO ZERO ('C'-'A') ('L'-'A')
-    SEG_LOX_ID = 0x0E170000, // ('O' - 'A') ('X' - 'A') ZERO ZERO
+    SEG_LOX_ID = 0x0E170000, // ('O' - 'A') ('X' - 'A') CHUNK_FORMAT
     SEG_LOX_NAME = 0x636C6F78, // c l o x
     SEG_FUNCTIONS = 0xBEEF,
     SEG_FUNCTION,
@@ -41,10 +43,28 @@ typedef enum {
     SEG_FILE_END = 0x7CADBEEF
 } SegmentSequence;
 
+// Versions of the code inside the chunks, taking the low half of the
+// SEG_LOX_ID word. Each build runs one kind of code only
+typedef enum {
+    CHUNK_FORMAT_STACK = 0x0000,
+    CHUNK_FORMAT_REGISTER = 0x0001,
+} ChunkFormat;
+
+#ifdef REGISTER_VM
+#define CHUNK_FORMAT CHUNK_FORMAT_REGISTER
+#else
+#define CHUNK_FORMAT CHUNK_FORMAT_STACK
+#endif
+
+#define CHUNK_FORMAT_MASK 0xFFFF
+
 typedef enum {
     OUT_TAG_NUMBER,
     OUT_TAG_STRING,
-    OUT_TAG_FUNCTION
+    OUT_TAG_FUNCTION,
+    // Keys of switch tables
+    OUT_TAG_NIL,
+    OUT_TAG_BOOL,
 } ValueTag;
 
 typedef struct {
@@ -230,9 +250,9 @@ static void write_string(FILE* out, const char* string) {
 }
 
 static void writeFunctionHeader(FILE* file, const ObjFunction* function) {
-    if (function->name) {
+    if (function->name != NULL_REF) {
         write_int(file, SEG_FUNCTION_NAME);
-        write_string(file, function->name->chars);
+        write_string(file, DEREF(ObjString, function->name)->chars);
     } else {
         write_int(file, SEG_FUNCTION_SCRIPT);
     }
@@ -276,6 +296,11 @@ static void writeFunctionConstants(
                     .position = ftell(file)
                 });
             write_int(file, 0x7FFFFFFF);
+        } else if (IS_NIL(value)) {
+            write_byte(file, OUT_TAG_NIL);
+        } else if (IS_BOOL(value)) {
+            write_byte(file, OUT_TAG_BOOL);
+            write_byte(file, AS_BOOL(value));
         } else if (IS_FUNCTION(value)) {
             if (!findInQueue(functionQueue, value)) {
                 enqueueValue(functionQueue, value);
@@ -339,6 +364,9 @@ static void writeStrings(FILE* file, ValueQueue* strings) {
 
 void writeBinary(const char* source_file, ObjFunction* compiled, const char* path) {
    push(OBJ_VAL(compiled));
+#ifdef REGISTER_VM
+    lowerToRegisters(compiled);
+#endif
     FILE* file = fopen(path, "w+b");
     setbuf(file, NULL);
 
@@ -347,7 +375,7 @@ void writeBinary(const char* source_file, ObjFunction* compiled, const char* pat
         exit(SAVE_FAILURE);
     }
     write_int(file, SEG_FILE_START);
-    write_int(file, SEG_LOX_ID);
+    write_int(file, SEG_LOX_ID | CHUNK_FORMAT);
     write_int(file, SEG_LOX_NAME);
     write_string(file, source_file);
 
@@ -442,6 +470,20 @@ static void checkSegment(FILE* file, const SegmentSequence seg) {
     }
 }
 
+static void checkChunkFormat(FILE* file) {
+    const int read = read_int(file);
+    if ((read & ~CHUNK_FORMAT_MASK) != SEG_LOX_ID) {
+        fprintf(stderr, "Invalid file format. Read: %08X; Expected: %08X\n", read, SEG_LOX_ID | CHUNK_FORMAT);
+        exit(LOAD_FAILURE);
+    }
+    if ((read & CHUNK_FORMAT_MASK) != CHUNK_FORMAT) {
+        fprintf(stderr, "Binary holds %s code, this build runs %s code.\n",
+                (read & CHUNK_FORMAT_MASK) == CHUNK_FORMAT_REGISTER ? "register" : "stack",
+                CHUNK_FORMAT == CHUNK_FORMAT_REGISTER ? "register" : "stack");
+        exit(LOAD_FAILURE);
+    }
+}
+
 typedef struct String {
     char* chars;
     size_t length;
@@ -458,10 +500,10 @@ static String read_string(FILE* file) {
 static void loadFunctionHeader(FILE* file, ObjFunction* function) {
     const SegmentSequence seq = read_int(file);
     if (seq == SEG_FUNCTION_SCRIPT) {
-        function->name = NULL;
+        function->name = NULL_REF;
     } else if (seq == SEG_FUNCTION_NAME) {
         String string = read_string(file);
-        function->name = copyString(string.chars, string.length);
+        function->name = MAKE_REF(copyString(string.chars, string.length));
         free(string.chars);        
     } else {
         fprintf(stderr, "Unexpected sequence before function name.");
@@ -476,12 +518,12 @@ static void loadFunctionCode(FILE* file, ObjFunction* function) {
 
     chunk->count = read_int(file);
     chunk->capacity = read_int(file);
-    chunk->code = calloc(chunk->capacity, sizeof(uint8_t));
+    chunk->code = ALLOCATE(uint8_t, chunk->capacity);
     LOAD_ARRAY(uint8_t, file, chunk->code, chunk->count);
 
     chunk->lineCount = read_int(file);
     chunk->lineCapacity = read_int(file);
-    chunk->lines = calloc(chunk->lineCapacity, sizeof(LineStart));
+    chunk->lines = ALLOCATE(LineStart, chunk->lineCapacity);
     LOAD_ARRAY(LineStart, file, chunk->lines, chunk->lineCount);
 }
 
@@ -500,9 +542,13 @@ static void loadFunctionConstants(
         switch (tag) {
         case OUT_TAG_NUMBER: {
             const double number = read_double(file);
-            writeValueArray(constants, NUMBER_VAL(number));
+            writeValueArray(constants, canonicalNumber(number));
             break;
         }
+        case OUT_TAG_NIL: writeValueArray(constants, NIL_VAL);
+            break;
+        case OUT_TAG_BOOL: writeValueArray(constants, BOOL_VAL(read_byte(file)));
+            break;
         case OUT_TAG_STRING:
         case OUT_TAG_FUNCTION: {
             const int missingValue = read_int(file);
@@ -626,7 +672,7 @@ ObjFunction* loadBinary(const char* path) {
     }
 
     checkSegment(file, SEG_FILE_START);
-    checkSegment(file, SEG_LOX_ID);
+    checkChunkFormat(file);
 
     checkSegment(file, SEG_LOX_NAME);
     String fileName = read_string(file);
@@ -642,10 +688,13 @@ ObjFunction* loadBinary(const char* path) {
     GenericArray patchList;
     GENERIC_INIT(FunctionPatch, &patchList);
 
+    // The loaded program's functions and constants are needed until exit
+    beginImmortal();
     loadSegmentFunctions(file, functions, &patchList);
     loadSegmentStrings(file, strings);
 
     patchFunctionRefs(&patchList, functions, strings);
+    endImmortal();
 
     fclose(file);
     
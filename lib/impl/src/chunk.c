@@ -1,8 +1,11 @@
+#include <string.h>
+
 #include <clox/value.h>
 #include <clox/vm.h>
 
 #include <impl/chunk.h>
 #include <impl/memory.h>
+#include <impl/object.h>
 #include <impl/vm.h>
 
 void initChunk(Chunk* chunk) {
@@ -50,7 +53,109 @@ void writeChunk(Chunk* chunk, const uint8_t byte, const int line) {
     lineStart->line = line;
 }
 
+void truncateChunk(Chunk* chunk, const int count) {
+    chunk->count = count;
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count) {
+        chunk->lineCount--;
+    }
+}
+
+int instructionLength(const Chunk* chunk, const int offset) {
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_CONSTANT:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_STATIC_FIELD:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_STATIC_METHOD: return 2;
+    case OP_ARRAY:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE: return 3;
+    case OP_CLOSURE: {
+        const Value function = chunk->constants.values[chunk->code[offset + 1]];
+        return 2 + 2 * AS_FUNCTION(function)->upvalueCount;
+    }
+    case OP_PUSH_EXCEPTION_HANDLER: return 6;
+    case OP_REG_MOVE:
+    case OP_REG_LOAD_CONSTANT: return 3;
+    case OP_REG_ADD:
+    case OP_REG_SUBTRACT:
+    case OP_REG_MULTIPLY:
+    case OP_REG_DIVIDE:
+    case OP_REG_MODULUS:
+    case OP_REG_ADD_CONSTANT:
+    case OP_REG_SUBTRACT_CONSTANT:
+    case OP_REG_MULTIPLY_CONSTANT:
+    case OP_REG_DIVIDE_CONSTANT:
+    case OP_REG_MODULUS_CONSTANT: return REGISTER_STORE_LENGTH;
+    case OP_REG_PUSH_ADD:
+    case OP_REG_PUSH_SUBTRACT:
+    case OP_REG_PUSH_MULTIPLY:
+    case OP_REG_PUSH_DIVIDE:
+    case OP_REG_PUSH_MODULUS:
+    case OP_REG_PUSH_EQUAL:
+    case OP_REG_PUSH_GREATER:
+    case OP_REG_PUSH_LESS:
+    case OP_REG_PUSH_ADD_CONSTANT:
+    case OP_REG_PUSH_SUBTRACT_CONSTANT:
+    case OP_REG_PUSH_MULTIPLY_CONSTANT:
+    case OP_REG_PUSH_DIVIDE_CONSTANT:
+    case OP_REG_PUSH_MODULUS_CONSTANT:
+    case OP_REG_PUSH_EQUAL_CONSTANT:
+    case OP_REG_PUSH_GREATER_CONSTANT:
+    case OP_REG_PUSH_LESS_CONSTANT: return REGISTER_PUSH_LENGTH;
+    case OP_INLINE_CALL: return INLINE_CALL_LENGTH;
+    case OP_INLINE_INVOKE: return INLINE_INVOKE_LENGTH;
+    case OP_INLINE_RETURN: return INLINE_RETURN_LENGTH;
+    case OP_UPDATE_PROPERTY:
+    case OP_UPDATE_GLOBAL:
+    case OP_UPDATE_UPVALUE: return UPDATE_LENGTH;
+    case OP_UPDATE_INDEX: return UPDATE_INDEX_LENGTH;
+    case OP_SWITCH_DENSE:
+        return SWITCH_DENSE_HEADER
+               + SWITCH_DENSE_ENTRY * (chunk->code[offset + 2] << 8 | chunk->code[offset + 3]);
+    case OP_SWITCH_HASHED:
+        return SWITCH_HASHED_HEADER
+               + SWITCH_HASHED_ENTRY * (chunk->code[offset + 1] << 8 | chunk->code[offset + 2]);
+    case OP_FOR_PREP: return FOR_PREP_LENGTH;
+    case OP_FOR_LOOP: return FOR_LOOP_LENGTH;
+    default: return 1;
+    }
+}
+
+int inlinedCallAt(const Chunk* chunk, const int instruction) {
+    for (int offset = 0; offset <= instruction && offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        const uint8_t opcode = chunk->code[offset];
+        if (opcode != OP_INLINE_CALL && opcode != OP_INLINE_INVOKE) continue;
+
+        const int next = offset + instructionLength(chunk, offset);
+        const int fallback = next + (chunk->code[next - 2] << 8 | chunk->code[next - 1]);
+        if (instruction >= next && instruction < fallback - INLINE_RETURN_LENGTH) return offset;
+    }
+    return -1;
+}
+
 int getLine(Chunk* chunk, const int instruction) {
+    // A frame that hasn't executed anything yet reports its first line
+    if (instruction < chunk->lines[0].offset) return chunk->lines[0].line;
+
     int start = 0;
     int end = chunk->lineCount - 1;
     while (true) {
@@ -68,6 +173,38 @@ int getLine(Chunk* chunk, const int instruction) {
     }
 }
 
+uint32_t switchHash(const Value value) {
+    if (IS_STRING(value)) return AS_STRING(value)->hash;
+    if (IS_NUMBER(value)) {
+        // Adding zero turns -0 into 0, which it equals
+        const double number = AS_NUMBER(value) + 0.0;
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return (uint32_t) (bits ^ bits >> 32);
+    }
+    return IS_NIL(value) ? 0 : AS_BOOL(value) ? 1 : 2;
+}
+
+// Numbers are compared by their bits, so an integer or a negative zero
+// only matches itself
+static bool sameConstant(const Value a, const Value b) {
+    if (IS_INT(a) || IS_INT(b)) return IS_INT(a) && IS_INT(b) && AS_INT(a) == AS_INT(b);
+    if (IS_NUMBER(a) || IS_NUMBER(b)) {
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+        const double x = AS_NUMBER(a);
+        const double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b);
+}
+
+int findConstant(const Chunk* chunk, const Value value) {
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (sameConstant(chunk->constants.values[i], value)) return i;
+    }
+    return -1;
+}
+
 int addConstant(Chunk* chunk, const Value value) {
     push(value);
     writeValueArray(&chunk->constants, value);
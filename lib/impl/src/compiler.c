@@ -8,6 +8,7 @@
 #include <impl/common.h>
 #include <impl/compiler.h>
 #include <impl/memory.h>
+#include <impl/optimizer.h>
 
 #include <scanner/scanner.h>
 
@@ -48,8 +49,21 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    bool isAssigned;
+    // Declared with const, so only its initializer assigns it
+    bool isConstant;
+    // A const initialized with a literal, which reading it compiles to
+    bool isLiteral;
+    Value literal;
 } Local;
 
+// Flags of a closure's capture of a local, patched once the local goes
+// out of scope and it is known whether it is ever assigned
+typedef struct {
+    int local;
+    int offset;
+} Capture;
+
 typedef struct {
     uint8_t index;
     bool isLocal;
@@ -69,6 +83,21 @@ typedef enum LoopType {
     LOOP_LOOP,
 } LoopType;
 
+// Where a literal was emitted, so that an operator applied only to
+// literals can take their code back out and emit its result instead
+typedef struct {
+    int start;
+    int end;
+    int constantCount;
+    Value value;
+} Literal;
+
+// Code compiled only to be checked and taken back out of the chunk
+typedef struct {
+    int start;
+    int breakCount;
+} DeadCode;
+
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
@@ -79,11 +108,22 @@ typedef struct Compiler {
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
 
+    Capture* captures;
+    int captureCount;
+    int captureCapacity;
+
     LoopType loopType;
     int innermostLoopStart;
     int innermostLoopScopeDepth;
 
     Table stringConstants;
+    // Constants below this one may be cached in stringConstants, so
+    // taking code back out never drops them
+    int cachedConstants;
+
+    Literal lastLiteral;
+    // Start of the left operand of the infix rule being compiled
+    int operandStart;
 } Compiler;
 
 static bool* compilerReplMode() {
@@ -122,6 +162,19 @@ Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 
+// A const declared at the top level, known to the code compiled after it
+typedef struct {
+    Token name;
+    bool isLiteral;
+    Value literal;
+} GlobalConstant;
+
+static struct {
+    GlobalConstant* constants;
+    int count;
+    int capacity;
+} globalConstants;
+
 static Chunk* currentChunk() {
     return &current->function->chunk;
 }
@@ -239,25 +292,173 @@ static const OpCode constantInstructions[] = {
     [2] = OP_CONSTANT_TWO
 };
 
+static bool isSmallConstant(const Value value) {
+    return IS_INT(value) && AS_INT(value) >= 0 && AS_INT(value) <= 2;
+}
+
 static void emitConstant(const Value value) {
-    if (IS_NUMBER(value)) {
-        long val = (long) round(AS_NUMBER(value));
-        if (val >= -1 && val <= 2) {
-            emitByte(constantInstructions[val]);
-            return;
-        }
+    if (isSmallConstant(value)) {
+        emitByte(constantInstructions[AS_INT(value)]);
+        return;
     }
-    
+
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
+static void emitLiteral(const Value value) {
+    Literal* literal = &current->lastLiteral;
+    literal->start = currentChunk()->count;
+    literal->constantCount = currentChunk()->constants.count;
+    literal->value = value;
+
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+    literal->end = currentChunk()->count;
+}
+
+// Emits the value of a literal constant, loading it from an identical
+// constant in the pool when there is one so that every read of the
+// constant doesn't add another
+static void emitSharedLiteral(const Value value) {
+    const bool pooled = !IS_NIL(value) && !IS_BOOL(value) && !isSmallConstant(value);
+    const int constant = pooled ? findConstant(currentChunk(), value) : -1;
+    if (constant == -1) {
+        emitLiteral(value);
+        return;
+    }
+
+    Literal* literal = &current->lastLiteral;
+    literal->start = currentChunk()->count;
+    literal->constantCount = currentChunk()->constants.count;
+    literal->value = value;
+    emitBytes(OP_CONSTANT, constant);
+    literal->end = currentChunk()->count;
+
+    // Taking an earlier literal back out mustn't drop the shared constant
+    if (constant >= current->cachedConstants) current->cachedConstants = constant + 1;
+}
+
+// Whether the code from start on is a single literal
+static bool isLiteral(const int start) {
+    return current->lastLiteral.start == start
+           && current->lastLiteral.end == currentChunk()->count;
+}
+
+// Takes the constants from count on back out, keeping the cached ones.
+// Code compiled after a literal may have added some of those
+static void dropConstants(const int count) {
+    currentChunk()->constants.count = count > current->cachedConstants ? count : current->cachedConstants;
+}
+
+// Takes a literal at the end of the chunk back out, with its constant
+static void removeLiteral(const Literal* literal) {
+    truncateChunk(currentChunk(), literal->start);
+    dropConstants(literal->constantCount);
+    current->lastLiteral.end = -1;
+}
+
+static bool isFalsyLiteral(const Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static ObjString* concatenateLiterals(const ObjString* a, const ObjString* b) {
+    ObjString* result = allocateString(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+    return internString(result);
+}
+
+// Computes what the operator gives at run time, for the operands it
+// can't fail on. Anything else is left for the VM to report
+static bool foldBinary(const TokenType operatorType, const Value a, const Value b, Value* result) {
+    switch (operatorType) {
+    case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    case TOKEN_BANG_EQUAL: *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    case TOKEN_PLUS:
+        if (IS_STRING(a) && IS_STRING(b)) {
+            *result = OBJ_VAL(concatenateLiterals(AS_STRING(a), AS_STRING(b)));
+            return true;
+        }
+        break;
+    default: break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    const double x = AS_NUMBER(a);
+    const double y = AS_NUMBER(b);
+    switch (operatorType) {
+    case TOKEN_PLUS: *result = canonicalNumber(x + y);
+        break;
+    case TOKEN_MINUS: *result = canonicalNumber(x - y);
+        break;
+    case TOKEN_STAR: *result = canonicalNumber(x * y);
+        break;
+    case TOKEN_STAR_STAR: *result = canonicalNumber(pow(x, y));
+        break;
+    case TOKEN_SLASH: *result = canonicalNumber(x / y);
+        break;
+    case TOKEN_PERCENT: *result = canonicalNumber(fmod(x, y));
+        break;
+    case TOKEN_GREATER: *result = BOOL_VAL(x > y);
+        break;
+    // Compiled as the negated opposite comparison, which differs for NaN
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y));
+        break;
+    case TOKEN_LESS: *result = BOOL_VAL(x < y);
+        break;
+    case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y));
+        break;
+    default: return false;
+    }
+    return true;
+}
+
+static void addCapture(const int local) {
+    if (current->captureCapacity < current->captureCount + 1) {
+        const int oldCapacity = current->captureCapacity;
+        current->captureCapacity = GROW_CAPACITY(oldCapacity);
+        current->captures = GROW_ARRAY(Capture, current->captures, oldCapacity, current->captureCapacity);
+    }
+    current->captures[current->captureCount++] = (Capture) {
+        .local = local,
+        .offset = currentChunk()->count,
+    };
+}
+
+// Patches the captures of the locals from first on, which are going out
+// of scope. Those never assigned hold their value for good by now
+static void resolveCaptures(const int first) {
+    int kept = 0;
+    for (int i = 0; i < current->captureCount; i++) {
+        const Capture capture = current->captures[i];
+        if (capture.local < first) {
+            current->captures[kept++] = capture;
+        } else if (!current->locals[capture.local].isAssigned) {
+            currentChunk()->code[capture.offset] |= CAPTURE_VALUE;
+        }
+    }
+    current->captureCount = kept;
+}
+
 static void emitFunction(const Compiler* compiler, ObjFunction* function) {
     const uint8_t constant = makeConstant(OBJ_VAL(function));
     if (function->upvalueCount > 0) {
         emitBytes(OP_CLOSURE, constant);
 
         for (int i = 0; i < function->upvalueCount; i++) {
-            emitByte(compiler->upvalues[i].isLocal ? 1 : 0);
+            if (compiler->upvalues[i].isLocal) {
+                addCapture(compiler->upvalues[i].index);
+                emitByte(CAPTURE_LOCAL);
+            } else {
+                emitByte(0);
+            }
             emitByte(compiler->upvalues[i].index);
         }
     } else {
@@ -280,12 +481,74 @@ static void patchAddress(const int offset) {
     currentChunk()->code[offset + 1] = currentChunk()->count & 0xff;
 }
 
+#define MAX_BREAK_LOCATIONS 255
+
+typedef struct BreakLocations {
+    struct BreakLocations* prev;
+    int count;
+    int locations[MAX_BREAK_LOCATIONS];
+} BreakLocations;
+
+BreakLocations* currentBreakLocations = NULL;
+
+void initBreakLocations(BreakLocations* locations) {
+    locations->count = 0;
+    locations->prev = currentBreakLocations;
+    currentBreakLocations = locations;
+}
+
+void leaveBreakLocations(const BreakLocations* locations) {
+    // Patch locations for break statement
+    for (int i = 0; i < locations->count; i++) {
+        patchJump(locations->locations[i]);
+    }
+    currentBreakLocations = locations->prev;
+}
+
+void addBreakLocation(const int location) {
+    BreakLocations* loc = currentBreakLocations;
+    if (loc == NULL || loc->count >= MAX_BREAK_LOCATIONS) return;
+    loc->locations[loc->count] = location;
+    loc->count++;
+}
+
+static DeadCode beginDeadCode() {
+    return (DeadCode) {
+        .start = currentChunk()->count,
+        .breakCount = currentBreakLocations != NULL ? currentBreakLocations->count : 0,
+    };
+}
+
+// Jumps patched inside the dead code have already been written,
+// only breaks out of it are still waiting to be patched
+static void endDeadCode(const DeadCode* dead) {
+    truncateChunk(currentChunk(), dead->start);
+    if (currentBreakLocations != NULL) {
+        currentBreakLocations->count = dead->breakCount;
+    }
+    int kept = 0;
+    for (int i = 0; i < current->captureCount; i++) {
+        if (current->captures[i].offset < dead->start) {
+            current->captures[kept++] = current->captures[i];
+        }
+    }
+    current->captureCount = kept;
+    // A literal ending before the dead code is at the end of the chunk again
+    if (current->lastLiteral.end > dead->start) {
+        current->lastLiteral.end = -1;
+    }
+}
+
 static void initCompiler(Compiler* compiler, const FunctionType type) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->captures = NULL;
+    compiler->cachedConstants = 0;
+    compiler->captureCount = 0;
+    compiler->captureCapacity = 0;
     compiler->function = newFunction();
     current = compiler;
 
@@ -295,31 +558,35 @@ static void initCompiler(Compiler* compiler, const FunctionType type) {
     int line = parser.previous.loc.line;
     if (type == TYPE_LAMBDA) {
         const char* template = "lambda %s[%d]";
+        const ObjString* enclosingName = DEREF(ObjString, compiler->enclosing->function->name);
         const int nameLength = snprintf(
             NULL, 0, template,
-            compiler->enclosing->function->name != NULL
-                ? compiler->enclosing->function->name->chars
+            enclosingName != NULL
+                ? enclosingName->chars
                 : "script",
             line);
         char* buffer = ALLOCATE(char, nameLength + 1);
         memset(buffer, 0, nameLength + 1);
         snprintf(
             buffer, nameLength + 1, template,
-            compiler->enclosing->function->name != NULL
-                ? compiler->enclosing->function->name->chars
+            enclosingName != NULL
+                ? enclosingName->chars
                 : "script",
             line);
 
-        current->function->name = takeString(buffer, nameLength);
+        current->function->name = MAKE_REF(takeString(buffer, nameLength));
     } else if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(
+        current->function->name = MAKE_REF(copyString(
             parser.previous.start,
-            parser.previous.length);
+            parser.previous.length));
     }
 
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->isConstant = false;
+    local->isLiteral = false;
     if (type == TYPE_INITIALIZER || type == TYPE_METHOD) {
         local->name.start = "this";
         local->name.length = 4;
@@ -332,15 +599,23 @@ static void initCompiler(Compiler* compiler, const FunctionType type) {
     compiler->innermostLoopStart = -1;
     compiler->innermostLoopScopeDepth = 0;
 
+    compiler->lastLiteral.start = -1;
+    compiler->lastLiteral.end = -1;
+    compiler->operandStart = -1;
+
 }
 
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    resolveCaptures(0);
+    FREE_ARRAY(Capture, current->captures, current->captureCapacity);
+    // Code with errors may have jumps that were never patched
+    if (!parser.hadError) optimizeChunk(currentChunk());
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
-        disassembleChunk(stdout ,currentChunk(), function->name != NULL
-                                         ? function->name->chars
+        disassembleChunk(stdout ,currentChunk(), function->name != NULL_REF
+                                         ? DEREF(ObjString, function->name)->chars
                                          : "<script>");
     }
 #endif
@@ -356,10 +631,16 @@ static void beginScope() {
 
 static void endScope() {
     current->scopeDepth--;
-    while (current->localCount > 0 &&
-           current->locals[current->localCount - 1].depth > current->scopeDepth) {
+    int first = current->localCount;
+    while (first > 0 && current->locals[first - 1].depth > current->scopeDepth) {
+        first--;
+    }
+    resolveCaptures(first);
 
-        if (current->locals[current->localCount - 1].isCaptured) {
+    while (current->localCount > first) {
+        // Closures hold a copy of a local that is never assigned
+        const Local* local = &current->locals[current->localCount - 1];
+        if (local->isCaptured && local->isAssigned) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
@@ -388,6 +669,7 @@ static uint8_t identifierConstant(const Token* name) {
     }
     const uint8_t index = makeConstant(OBJ_VAL(string));
     tableSet(&current->stringConstants, string, NUMBER_VAL((double) index));
+    current->cachedConstants = currentChunk()->constants.count;
     return index;
 }
 
@@ -447,6 +729,19 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     return -1;
 }
 
+// Marks the local the name resolves to, in this function or in the one
+// it is captured from
+static void markAssigned(Compiler* compiler, const Token* name) {
+    for (; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            if (identifiersEqual(name, &compiler->locals[i].name)) {
+                compiler->locals[i].isAssigned = true;
+                return;
+            }
+        }
+    }
+}
+
 static void addLocal(const Token name) {
     if (current->localCount == UINT8_COUNT) {
         error("Too many local variables in function.");
@@ -456,12 +751,45 @@ static void addLocal(const Token name) {
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->isConstant = false;
+    local->isLiteral = false;
 }
 
-static void declareVariable() {
-    if (current->scopeDepth == 0) return;
+static const GlobalConstant* findGlobalConstant(const Token* name) {
+    for (int i = globalConstants.count - 1; i >= 0; i--) {
+        if (identifiersEqual(name, &globalConstants.constants[i].name)) return &globalConstants.constants[i];
+    }
+    return NULL;
+}
+
+// Whether the name refers to a const, giving the literal it was
+// initialized with if there is one. Locals of this function or of the
+// enclosing ones shadow the top-level consts
+static bool resolveConstant(const Token* name, const Value** literal) {
+    *literal = NULL;
+    for (const Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            const Local* local = &compiler->locals[i];
+            if (!identifiersEqual(name, &local->name)) continue;
+            if (local->isLiteral) *literal = &local->literal;
+            return local->isConstant;
+        }
+    }
 
+    const GlobalConstant* constant = findGlobalConstant(name);
+    if (constant == NULL) return false;
+    if (constant->isLiteral) *literal = &constant->literal;
+    return true;
+}
+
+static void declareVariable() {
     const Token* name = &parser.previous;
+    if (current->scopeDepth == 0) {
+        if (findGlobalConstant(name) != NULL) error("Already a constant with this name.");
+        return;
+    }
+
     for (int i = current->localCount - 1; i >= 0; i--) {
         const Local* local = &current->locals[i];
         if (local->depth != -1 && local->depth < current->scopeDepth) {
@@ -551,7 +879,27 @@ static void super_([[maybe_unused]] bool canAssign) {
     // emitBytes(OP_GET_SUPER, name);
 }
 
+// With a literal left operand, the right one is either the result or
+// never evaluated
+static void constantLogical(const Precedence precedence, const bool rightTaken) {
+    const Literal left = current->lastLiteral;
+    if (rightTaken) {
+        removeLiteral(&left);
+        parsePrecedence(precedence);
+        return;
+    }
+
+    const DeadCode dead = beginDeadCode();
+    parsePrecedence(precedence);
+    endDeadCode(&dead);
+    current->lastLiteral = left;
+}
+
 static void and_([[maybe_unused]] bool canAssign) {
+    if (isLiteral(current->operandStart)) {
+        constantLogical(PREC_AND, !isFalsyLiteral(current->lastLiteral.value));
+        return;
+    }
 
     const int endJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
@@ -590,7 +938,18 @@ static void expression() {
 
 static void block() {
     while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        const bool leavesBlock = check(TOKEN_RETURN) || check(TOKEN_THROW)
+                                 || check(TOKEN_BREAK) || check(TOKEN_CONTINUE);
         declaration();
+
+        if (leavesBlock && !check(TOKEN_RIGHT_BRACE)) {
+            // Nothing after it in the block can run
+            const DeadCode dead = beginDeadCode();
+            while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+                declaration();
+            }
+            endDeadCode(&dead);
+        }
     }
 
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
@@ -750,6 +1109,48 @@ static void varDeclaration() {
     defineVariable(global);
 }
 
+// Compiles a const, which has to be initialized. Reads of one whose
+// initializer is a literal are compiled to the literal. A top-level one
+// is still defined as a global, for the code compiled before it
+static void constDeclaration() {
+    const uint8_t global = parseVariable("Expect constant name");
+    const Token name = parser.previous;
+
+    consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+    const int initializerStart = currentChunk()->count;
+    expression();
+    const bool literal = isLiteral(initializerStart);
+    consumeReplOptional(
+        TOKEN_SEMICOLON,
+        "Expect ';' after constant declaration.");
+
+    if (current->scopeDepth > 0) {
+        Local* local = &current->locals[current->localCount - 1];
+        local->isConstant = true;
+        local->isLiteral = literal;
+        local->literal = current->lastLiteral.value;
+    } else {
+        if (globalConstants.capacity < globalConstants.count + 1) {
+            const int oldCapacity = globalConstants.capacity;
+            globalConstants.capacity = GROW_CAPACITY(oldCapacity);
+            globalConstants.constants = GROW_ARRAY(GlobalConstant, globalConstants.constants,
+                                                   oldCapacity, globalConstants.capacity);
+        }
+        globalConstants.constants[globalConstants.count++] = (GlobalConstant){
+            .name = name,
+            .isLiteral = literal,
+            .literal = current->lastLiteral.value,
+        };
+    }
+
+    if (current->scopeDepth > 0) {
+        markInitialized();
+    } else {
+        // Code compiled before the declaration may still try to assign it
+        emitBytes(OP_DEFINE_CONSTANT, global);
+    }
+}
+
 static void expressionStatement() {
     expression();
     consumeReplOptional(TOKEN_SEMICOLON, "Expect ';' after expression.");
@@ -760,37 +1161,6 @@ static void expressionStatement() {
     }
 }
 
-#define MAX_BREAK_LOCATIONS 255
-
-typedef struct BreakLocations {
-    struct BreakLocations* prev;
-    int count;
-    int locations[MAX_BREAK_LOCATIONS];
-} BreakLocations;
-
-BreakLocations* currentBreakLocations = NULL;
-
-void initBreakLocations(BreakLocations* locations) {
-    locations->count = 0;
-    locations->prev = currentBreakLocations;
-    currentBreakLocations = locations;
-}
-
-void leaveBreakLocations(const BreakLocations* locations) {
-    // Patch locations for break statement
-    for (int i = 0; i < locations->count; i++) {
-        patchJump(locations->locations[i]);
-    }
-    currentBreakLocations = locations->prev;
-}
-
-void addBreakLocation(const int location) {
-    BreakLocations* loc = currentBreakLocations;
-    if (loc == NULL || loc->count >= MAX_BREAK_LOCATIONS) return;
-    loc->locations[loc->count] = location;
-    loc->count++;
-}
-
 static void breakStatement() {
     if (current->loopType == LOOP_NONE && currentBreakLocations == NULL) {
         error("Can't use 'break' outside a loop/switch statements.");
@@ -817,6 +1187,127 @@ static void breakStatement() {
     addBreakLocation(breakJump);
 }
 
+// A for loop counting its variable up or down by an int step towards a
+// local or an int literal, with the operands of OP_FOR_PREP and OP_FOR_LOOP
+typedef struct {
+    uint8_t counter;
+    uint8_t flags;
+    uint8_t limit;
+    int8_t step;
+} CountingLoop;
+
+// Whether the instruction at the offset pushes an int literal, and which
+static bool intLiteralAt(const int offset, const int end, int32_t* value) {
+    const Chunk* chunk = currentChunk();
+    const uint8_t opcode = chunk->code[offset];
+    if (opcode >= OP_CONSTANT_ZERO && opcode <= OP_CONSTANT_TWO) {
+        *value = opcode - OP_CONSTANT_ZERO;
+        return true;
+    }
+    if (opcode != OP_CONSTANT || offset + 1 >= end) return false;
+    const Value constant = chunk->constants.values[chunk->code[offset + 1]];
+    if (!IS_INT(constant)) return false;
+    *value = AS_INT(constant);
+    return true;
+}
+
+// Whether the increment from start on adds an int literal to the loop
+// variable or subtracts one from it, as in `i = i + 1` or `i -= 2`
+static bool countingIncrement(const int start, CountingLoop* loop) {
+    const Chunk* chunk = currentChunk();
+    const uint8_t* code = &chunk->code[start];
+    const int length = chunk->count - start;
+    if (length < 7 || code[0] != OP_GET_LOCAL || code[1] != loop->counter) return false;
+
+    int32_t literal;
+    if (!intLiteralAt(start + 2, chunk->count, &literal)) return false;
+    const int next = code[2] == OP_CONSTANT ? 4 : 3;
+    if (length != next + 4 || code[next + 1] != OP_SET_LOCAL || code[next + 2] != loop->counter
+        || code[next + 3] != OP_POP) {
+        return false;
+    }
+
+    int64_t step;
+    if (code[next] == OP_ADD) {
+        step = literal;
+    } else if (code[next] == OP_SUBTRACT) {
+        step = -(int64_t) literal;
+    } else {
+        return false;
+    }
+    if (step < INT8_MIN || step > INT8_MAX) return false;
+    loop->step = (int8_t) step;
+    return true;
+}
+
+// Whether the condition from start to end compares the loop variable
+// with a local or an int literal, as in `i < n` or `i >= 0`
+static bool countingCondition(const int start, const int end, CountingLoop* loop) {
+    const Chunk* chunk = currentChunk();
+    const uint8_t* code = &chunk->code[start];
+    const int length = end - start;
+    if (length < 4 || code[0] != OP_GET_LOCAL || code[1] != loop->counter) return false;
+
+    int next;
+    int32_t literal = 0;
+    if (code[2] == OP_GET_LOCAL) {
+        loop->flags = 0;
+        next = 4;
+    } else if (intLiteralAt(start + 2, end, &literal)) {
+        loop->flags = FOR_LIMIT_CONSTANT;
+        next = code[2] == OP_CONSTANT ? 4 : 3;
+    } else {
+        return false;
+    }
+
+    if (next >= length) return false;
+    if (code[next] == OP_GREATER) {
+        loop->flags |= FOR_GREATER;
+    } else if (code[next] != OP_LESS) {
+        return false;
+    }
+    next++;
+    if (next < length && code[next] == OP_NOT) {
+        loop->flags |= FOR_NEGATED;
+        next++;
+    }
+    if (next != length) return false;
+
+    // OP_CONSTANT_ZERO and the like have no constant to refer to
+    if (code[2] == OP_GET_LOCAL || code[2] == OP_CONSTANT) {
+        loop->limit = code[3];
+    } else {
+        loop->limit = makeConstant(INT_VAL(literal));
+    }
+    return true;
+}
+
+// Puts OP_FOR_PREP in front of the condition and OP_FOR_LOOP in front of
+// the increment, both compiled from conditionStart on, which stay behind
+// them as the generic code. Returns where the body offsets of the two go
+static void emitCountingLoop(const CountingLoop* loop, const int conditionStart, const int incrementStart,
+                             int* prepJump, int* loopJump) {
+    uint8_t code[32];
+    const int length = currentChunk()->count - conditionStart;
+    const int conditionLength = incrementStart - conditionStart;
+    memcpy(code, &currentChunk()->code[conditionStart], length);
+    truncateChunk(currentChunk(), conditionStart);
+    current->lastLiteral.end = -1;
+
+    emitBytes(OP_FOR_PREP, loop->counter);
+    emitBytes(loop->flags, loop->limit);
+    *prepJump = currentChunk()->count;
+    emitBytes(0xFF, 0xFF);
+    for (int i = 0; i < conditionLength; i++) emitByte(code[i]);
+
+    emitBytes(OP_FOR_LOOP, loop->counter);
+    emitBytes(loop->flags, loop->limit);
+    emitByte((uint8_t) loop->step);
+    *loopJump = currentChunk()->count;
+    emitBytes(0xFF, 0xFF);
+    for (int i = conditionLength; i < length; i++) emitByte(code[i]);
+}
+
 static void forStatement() {
     beginScope();
 
@@ -849,10 +1340,13 @@ static void forStatement() {
     BreakLocations locations;
     initBreakLocations(&locations);
 
+    const int conditionStart = currentChunk()->count;
+    int conditionEnd = -1;
     int exitJump = -1;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        conditionEnd = currentChunk()->count;
 
         // Jump out of the loop if the condition is false
         exitJump = emitJump(OP_JUMP_IF_FALSE);
@@ -860,16 +1354,35 @@ static void forStatement() {
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
-        const int bodyJump = emitJump(OP_JUMP);
+        int bodyJump = emitJump(OP_JUMP);
 
-        const int incrementStart = currentChunk()->count;
+        int incrementStart = currentChunk()->count;
         expression();
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expected ')' after for clauses.");
 
+        // A loop counting its variable gets the instructions doing the
+        // increment, the condition and the jump to the body at once
+        CountingLoop loop = {.counter = (uint8_t) loopVariable};
+        const bool counting = loopVariable != -1 && conditionEnd != -1
+                              && countingIncrement(incrementStart, &loop)
+                              && countingCondition(conditionStart, conditionEnd, &loop);
+        int prepJump = -1;
+        int loopJump = -1;
+        if (counting) {
+            emitCountingLoop(&loop, conditionStart, incrementStart, &prepJump, &loopJump);
+            exitJump += FOR_PREP_LENGTH;
+            bodyJump += FOR_PREP_LENGTH;
+            incrementStart += FOR_PREP_LENGTH;
+        }
+
         emitLoop(current->innermostLoopStart);
         current->innermostLoopStart = incrementStart;
         patchJump(bodyJump);
+        if (counting) {
+            patchJump(prepJump);
+            patchJump(loopJump);
+        }
     }
 
     int innerVariable = -1;
@@ -892,6 +1405,7 @@ static void forStatement() {
     if (loopVariable != -1) {
         emitBytes(OP_GET_LOCAL, (uint8_t) innerVariable);
         emitBytes(OP_SET_LOCAL, (uint8_t) loopVariable);
+        current->locals[loopVariable].isAssigned = true;
         emitByte(OP_POP);
 
         // 4: Close  the temporary scope for the copy of loop variable
@@ -935,11 +1449,32 @@ static void continueStatement() {
     emitLoop(current->innermostLoopStart);
 }
 
+// Only keeps the branch a literal condition picks
+static void constantIfStatement(const bool taken) {
+    DeadCode dead = beginDeadCode();
+    statement();
+    if (!taken) endDeadCode(&dead);
+
+    if (match(TOKEN_ELSE)) {
+        dead = beginDeadCode();
+        statement();
+        if (taken) endDeadCode(&dead);
+    }
+}
+
 static void ifStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after if.");
+    const int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    if (isLiteral(conditionStart)) {
+        const Literal condition = current->lastLiteral;
+        removeLiteral(&condition);
+        constantIfStatement(!isFalsyLiteral(condition.value));
+        return;
+    }
+
     const int thenJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
     statement();
@@ -974,6 +1509,114 @@ static void returnStatement() {
     }
 }
 
+#define MAX_SWITCH_CASES 256
+
+// The literal cases of a switch up to the first one that has to be
+// compared at run time. Their labels take no code, the table emitted
+// after the bodies jumps straight to the matching one
+typedef struct {
+    Value values[MAX_SWITCH_CASES];
+    // Constant holding the value, -1 if it isn't one yet
+    int constants[MAX_SWITCH_CASES];
+    int addresses[MAX_SWITCH_CASES];
+    int count;
+    // Jump from the switched value to the table, -1 before any case
+    int dispatchJump;
+    // Where to go when no case in the table matches, -1 for past the end
+    int miss;
+    // Later cases are compared one by one
+    bool closed;
+} SwitchTable;
+
+// Takes the case literal back out of the chunk, along with the code in
+// front of it from labelStart on, and adds it to the table
+static void addSwitchCase(SwitchTable* table, const Literal* literal, const int labelStart) {
+    int constant = -1;
+    if (IS_OBJ(literal->value)) {
+        // Staying among the constants keeps the string alive
+        constant = currentChunk()->code[literal->start + 1];
+    } else {
+        dropConstants(literal->constantCount);
+    }
+    truncateChunk(currentChunk(), labelStart);
+    current->lastLiteral.end = -1;
+
+    if (table->dispatchJump == -1) table->dispatchJump = emitJump(OP_JUMP);
+
+    // Nothing equals NaN, and of equal cases the first one is taken
+    if (IS_NUMBER(literal->value) && isnan(AS_NUMBER(literal->value))) return;
+    for (int i = 0; i < table->count; i++) {
+        if (valuesEqual(table->values[i], literal->value)) return;
+    }
+
+    table->values[table->count] = literal->value;
+    table->constants[table->count] = constant;
+    table->addresses[table->count] = currentChunk()->count;
+    table->count++;
+}
+
+static void writeCaseAddress(const int offset, const int address) {
+    if (address >= NO_CASE) error("Too much code to jump over");
+    currentChunk()->code[offset] = (address >> 8) & 0xFF;
+    currentChunk()->code[offset + 1] = address & 0xFF;
+}
+
+static void emitCaseTable(const int count, const int entryLength) {
+    emitByte((count >> 8) & 0xFF);
+    emitByte(count & 0xFF);
+    for (int i = 0; i < count; i++) {
+        for (int byte = 0; byte < entryLength - 2; byte++) emitByte(0);
+        emitByte((NO_CASE >> 8) & 0xFF);
+        emitByte(NO_CASE & 0xFF);
+    }
+}
+
+// Ints spread over no more than twice as many values as there are cases
+// get a slot for each value in the range, anything else a hash table
+static void emitSwitchTable(const SwitchTable* table) {
+    bool ints = true;
+    int64_t low = INT32_MAX;
+    int64_t high = INT32_MIN;
+    for (int i = 0; i < table->count; i++) {
+        if (!IS_INT(table->values[i])) {
+            ints = false;
+            break;
+        }
+        const int64_t value = AS_INT(table->values[i]);
+        if (value < low) low = value;
+        if (value > high) high = value;
+    }
+
+    if (ints && high - low < 2 * (int64_t) table->count) {
+        emitBytes(OP_SWITCH_DENSE, makeConstant(INT_VAL(low)));
+        const int entries = currentChunk()->count + 2;
+        emitCaseTable((int) (high - low + 1), SWITCH_DENSE_ENTRY);
+        for (int i = 0; i < table->count; i++) {
+            const int index = (int) (AS_INT(table->values[i]) - low);
+            writeCaseAddress(entries + index * SWITCH_DENSE_ENTRY, table->addresses[i]);
+        }
+        return;
+    }
+
+    int capacity = 2;
+    while (capacity < 2 * table->count) capacity *= 2;
+    emitByte(OP_SWITCH_HASHED);
+    const int entries = currentChunk()->count + 2;
+    emitCaseTable(capacity, SWITCH_HASHED_ENTRY);
+    for (int i = 0; i < table->count; i++) {
+        const Value value = table->values[i];
+        const uint8_t key = table->constants[i] != -1 ? table->constants[i] : makeConstant(value);
+        uint32_t slot = switchHash(value) & (capacity - 1);
+        uint8_t* entry = &currentChunk()->code[entries + slot * SWITCH_HASHED_ENTRY];
+        while ((entry[1] << 8 | entry[2]) != NO_CASE) {
+            slot = (slot + 1) & (capacity - 1);
+            entry = &currentChunk()->code[entries + slot * SWITCH_HASHED_ENTRY];
+        }
+        entry[0] = key;
+        writeCaseAddress(entries + slot * SWITCH_HASHED_ENTRY + 1, table->addresses[i]);
+    }
+}
+
 static void switchStatement() {
     consume(TOKEN_LEFT_PAREN, "Expected '(' after switch");
     expression();
@@ -986,14 +1629,20 @@ static void switchStatement() {
     int state = 0;
     int previousCaseSkip = -1;
     int previousFallthroughLocation = -1;
+    SwitchTable table = {.count = 0, .dispatchJump = -1, .miss = -1, .closed = false};
 
     // Reserve a stack space for the switch helper position
-    // That is used to save the switched expression result
-    current->localCount++;
+    // That is used to save the switched expression result.
+    // Without a name no variable resolves to it
+    addLocal(syntheticToken(NULL));
+    markInitialized();
 
     BreakLocations locations;
     const LoopType surroundingLoopType = current->loopType;
+    const int surroundingLoopScopeDepth = current->innermostLoopScopeDepth;
     current->loopType = LOOP_NONE;
+    // A break leaves the locals outside the switch to the code after it
+    current->innermostLoopScopeDepth = current->scopeDepth;
     initBreakLocations(&locations);
 
     while (!match(TOKEN_RIGHT_BRACE) && !match(TOKEN_EOF)) {
@@ -1005,22 +1654,38 @@ static void switchStatement() {
                 error("Can't have another case or default after default case ");
             }
 
+            const int labelStart = currentChunk()->count;
+            previousFallthroughLocation = -1;
             if (state == 1) {
                 // Prepare fallthrough jump for previous case (to this one)
                 previousFallthroughLocation = emitJump(OP_JUMP);
-                // Patch where previous case skips on unmatched value
-                patchJump(previousCaseSkip);
-                emitByte(OP_POP); // Pop old check
+                if (previousCaseSkip != -1) {
+                    // Patch where previous case skips on unmatched value
+                    patchJump(previousCaseSkip);
+                    emitByte(OP_POP); // Pop old check
+                }
             }
 
             if (caseType == TOKEN_CASE) {
                 state = 1;
+                const int testStart = currentChunk()->count;
                 // Duplicate expression result for consecutive comparisons
                 emitByte(OP_DUP);
                 expression();
 
                 consume(TOKEN_COLON, "Expect ':' after case value");
 
+                if (!table.closed && table.count < MAX_SWITCH_CASES && isLiteral(testStart + 1)) {
+                    const Literal literal = current->lastLiteral;
+                    addSwitchCase(&table, &literal, labelStart);
+                    previousCaseSkip = -1;
+                    continue;
+                }
+                if (!table.closed) {
+                    table.closed = true;
+                    table.miss = testStart;
+                }
+
                 emitByte(OP_EQUAL);
                 // Prepare jump to next case if this one fails
                 previousCaseSkip = emitJump(OP_JUMP_IF_FALSE);
@@ -1029,6 +1694,15 @@ static void switchStatement() {
             } else {
                 state = 2;
                 consume(TOKEN_COLON, "Expect ':' after default.");
+                if (previousCaseSkip == -1 && previousFallthroughLocation != -1) {
+                    // A body in the table runs right on into the default
+                    truncateChunk(currentChunk(), labelStart);
+                    previousFallthroughLocation = -1;
+                }
+                if (!table.closed) {
+                    table.closed = true;
+                    table.miss = currentChunk()->count;
+                }
                 previousCaseSkip = -1;
             }
             // Patch where previous case falls through after it's body is done
@@ -1044,8 +1718,12 @@ static void switchStatement() {
     }
     // If there was no default case
     previousFallthroughLocation = emitJump(OP_JUMP);
-    if (state == 1) {
-        emitByte(OP_POP);
+    if (table.dispatchJump != -1) {
+        patchJump(table.dispatchJump);
+        emitSwitchTable(&table);
+        if (table.miss != -1) emitLoop(table.miss);
+    }
+    if (previousCaseSkip != -1) {
         patchJump(previousCaseSkip);
         emitByte(OP_POP);
     }
@@ -1053,6 +1731,7 @@ static void switchStatement() {
 
     leaveBreakLocations(&locations);
     current->loopType = surroundingLoopType;
+    current->innermostLoopScopeDepth = surroundingLoopScopeDepth;
     current->localCount--;
 
     emitByte(OP_POP);
@@ -1071,16 +1750,30 @@ static void whileStatement() {
     initBreakLocations(&locations);
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after while.");
+    const int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(current->innermostLoopStart);
+    if (isLiteral(conditionStart)) {
+        const Literal condition = current->lastLiteral;
+        removeLiteral(&condition);
+        if (isFalsyLiteral(condition.value)) {
+            const DeadCode dead = beginDeadCode();
+            statement();
+            endDeadCode(&dead);
+        } else {
+            statement();
+            emitLoop(current->innermostLoopStart);
+        }
+    } else {
+        const int exitJump = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+        statement();
+        emitLoop(current->innermostLoopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+        patchJump(exitJump);
+        emitByte(OP_POP);
+    }
 
     leaveBreakLocations(&locations);
 
@@ -1106,7 +1799,7 @@ static void tryCatchStatement() {
 
     bool tryOnly = true;
 
-    const uint8_t successJump = emitJump(OP_JUMP);
+    const int successJump = emitJump(OP_JUMP);
     if (match(TOKEN_CATCH)) {
         tryOnly = false;
 
@@ -1164,6 +1857,7 @@ static void synchronize() {
         case TOKEN_CLASS:
         case TOKEN_FUN:
         case TOKEN_VAR:
+        case TOKEN_CONST:
         case TOKEN_FOR:
         case TOKEN_IF:
         case TOKEN_WHILE:
@@ -1189,6 +1883,8 @@ static void declaration() {
         funDeclaration();
     } else if (match(TOKEN_VAR)) {
         varDeclaration();
+    } else if (match(TOKEN_CONST)) {
+        constDeclaration();
     } else {
         statement();
     }
@@ -1227,10 +1923,26 @@ static void statement() {
 }
 
 static void conditional([[maybe_unused]] bool canAssign) {
-    const uint8_t condition = emitJump(OP_JUMP_IF_FALSE);
+    if (isLiteral(current->operandStart)) {
+        const Literal condition = current->lastLiteral;
+        removeLiteral(&condition);
+        const bool taken = !isFalsyLiteral(condition.value);
+
+        DeadCode dead = beginDeadCode();
+        parsePrecedence(PREC_ASSIGNMENT);
+        if (!taken) endDeadCode(&dead);
+        consume(TOKEN_COLON, "Expect ':' after then branch of conditional operator.");
+
+        dead = beginDeadCode();
+        parsePrecedence(PREC_CONDITIONAL);
+        if (taken) endDeadCode(&dead);
+        return;
+    }
+
+    const int condition = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
     parsePrecedence(PREC_ASSIGNMENT);
-    const uint8_t was_true = emitJump(OP_JUMP);
+    const int was_true = emitJump(OP_JUMP);
     consume(TOKEN_COLON, "Expect ':' after then branch of conditional operator.");
 
     patchJump(condition);
@@ -1242,12 +1954,24 @@ static void conditional([[maybe_unused]] bool canAssign) {
 static void binary([[maybe_unused]] bool canAssign) {
     const TokenType operatorType = parser.previous.type;
     const ParseRule* rule = getRule(operatorType);
+    const bool literalLeft = isLiteral(current->operandStart);
+    const Literal left = current->lastLiteral;
+    const int rightStart = currentChunk()->count;
     if (operatorType == TOKEN_STAR_STAR) {
         parsePrecedence((Precedence) rule->precedence);
     } else {
         parsePrecedence((Precedence) (rule->precedence + 1));
     }
 
+    Value result;
+    if (literalLeft && isLiteral(rightStart)
+        && foldBinary(operatorType, left.value, current->lastLiteral.value, &result)) {
+        // The operands are only dropped once the result holds what it needs
+        removeLiteral(&left);
+        emitLiteral(result);
+        return;
+    }
+
     switch (operatorType) {
     case TOKEN_PLUS: emitByte(OP_ADD);
         break;
@@ -1282,42 +2006,80 @@ static void call([[maybe_unused]] bool canAssign) {
     emitBytes(OP_CALL, argCount);
 }
 
+// The arithmetic opcode of a compound assignment, OP_LAST for any other
+// token
+static uint8_t compoundOperator(const TokenType type) {
+    switch (type) {
+    case TOKEN_PLUS_EQUAL: return OP_ADD;
+    case TOKEN_MINUS_EQUAL: return OP_SUBTRACT;
+    case TOKEN_STAR_EQUAL: return OP_MULTIPLY;
+    case TOKEN_SLASH_EQUAL: return OP_DIVIDE;
+    case TOKEN_PERCENT_EQUAL: return OP_MODULUS;
+    default: return OP_LAST;
+    }
+}
+
+// A literal or a load of a local or an upvalue, code that can neither
+// fail nor change anything, so it may run before the target is read
+static bool isSimpleOperand(const int start) {
+    const Chunk* chunk = currentChunk();
+    if (isLiteral(start)) return true;
+    return chunk->count == start + 2
+           && (chunk->code[start] == OP_GET_LOCAL || chunk->code[start] == OP_GET_UPVALUE);
+}
+
+// Compiles the operand and the store of a compound assignment, whose
+// target has been read by the code from readStart on. A simple operand
+// moves in front of an in-place update, given by its opcode and its
+// operand, if it has one, and the stack code reading the target follows
+// as the fallback
+static void compoundAssignment(const int readStart, const uint8_t operator,
+                               const uint8_t update, const int updateOperand,
+                               const uint8_t* store, const int storeLength) {
+    const int operandStart = currentChunk()->count;
+    expression();
+
+    if (update != OP_LAST && isSimpleOperand(operandStart)) {
+        uint8_t read[3];
+        uint8_t operand[2];
+        const int readLength = operandStart - readStart;
+        const int operandLength = currentChunk()->count - operandStart;
+        memcpy(read, &currentChunk()->code[readStart], readLength);
+        memcpy(operand, &currentChunk()->code[operandStart], operandLength);
+        truncateChunk(currentChunk(), readStart);
+        current->lastLiteral.end = -1;
+
+        for (int i = 0; i < operandLength; i++) emitByte(operand[i]);
+        emitByte(update);
+        if (updateOperand != -1) emitByte((uint8_t) updateOperand);
+        // The operator goes right before the skip over the fallback
+        const int skip = emitJump(operator);
+        for (int i = 0; i < readLength; i++) emitByte(read[i]);
+        for (int i = 0; i < operandLength; i++) emitByte(operand[i]);
+        emitByte(operator);
+        for (int i = 0; i < storeLength; i++) emitByte(store[i]);
+        patchJump(skip);
+        return;
+    }
+
+    emitByte(operator);
+    for (int i = 0; i < storeLength; i++) emitByte(store[i]);
+}
+
 static void dot(const bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'");
     const uint8_t name = identifierConstant(&parser.previous);
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitBytes(OP_SET_PROPERTY, name);
-    } else if (canAssign && match(TOKEN_PLUS_EQUAL)) {
-        emitByte(OP_DUP);
-        emitBytes(OP_GET_PROPERTY, name);
-        expression();
-        emitByte(OP_ADD);
-        emitBytes(OP_SET_PROPERTY, name);
-    } else if (canAssign && match(TOKEN_MINUS_EQUAL)) {
-        emitByte(OP_DUP);
-        emitBytes(OP_GET_PROPERTY, name);
-        expression();
-        emitByte(OP_SUBTRACT);
-        emitBytes(OP_SET_PROPERTY, name);
-    } else if (canAssign && match(TOKEN_STAR_EQUAL)) {
-        emitByte(OP_DUP);
-        emitBytes(OP_GET_PROPERTY, name);
-        expression();
-        emitByte(OP_MULTIPLY);
-        emitBytes(OP_SET_PROPERTY, name);
-    } else if (canAssign && match(TOKEN_SLASH_EQUAL)) {
-        emitByte(OP_DUP);
-        emitBytes(OP_GET_PROPERTY, name);
-        expression();
-        emitByte(OP_DIVIDE);
-        emitBytes(OP_SET_PROPERTY, name);
-    } else if (canAssign && match(TOKEN_PERCENT_EQUAL)) {
+    } else if (canAssign && compoundOperator(parser.current.type) != OP_LAST) {
+        advance();
+        const int readStart = currentChunk()->count;
         emitByte(OP_DUP);
         emitBytes(OP_GET_PROPERTY, name);
-        expression();
-        emitByte(OP_MODULUS);
-        emitBytes(OP_SET_PROPERTY, name);
+        const uint8_t store[] = {OP_SET_PROPERTY, name};
+        compoundAssignment(readStart, compoundOperator(parser.previous.type),
+                           OP_UPDATE_PROPERTY, name, store, 2);
     } else if (match(TOKEN_LEFT_PAREN)) {
         const uint8_t argCount = argumentList();
         emitBytes(OP_INVOKE, name);
@@ -1333,26 +2095,13 @@ static void element(const bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitByte(OP_SET_INDEX);
-    } else if (canAssign && match(TOKEN_PLUS_EQUAL)) {
-        emitBytes(OP_DUP, OP_GET_INDEX);
-        expression();
-        emitBytes(OP_ADD, OP_SET_INDEX);
-    } else if (canAssign && match(TOKEN_MINUS_EQUAL)) {
-        emitBytes(OP_DUP, OP_GET_INDEX);
-        expression();
-        emitBytes(OP_SUBTRACT, OP_SET_INDEX);
-    } else if (canAssign && match(TOKEN_STAR_EQUAL)) {
-        emitBytes(OP_DUP, OP_GET_INDEX);
-        expression();
-        emitBytes(OP_MULTIPLY, OP_SET_INDEX);
-    } else if (canAssign && match(TOKEN_SLASH_EQUAL)) {
-        emitBytes(OP_DUP, OP_GET_INDEX);
-        expression();
-        emitBytes(OP_DIVIDE, OP_SET_INDEX);
-    } else if (canAssign && match(TOKEN_PERCENT_EQUAL)) {
-        emitBytes(OP_DUP, OP_GET_INDEX);
-        expression();
-        emitBytes(OP_MODULUS, OP_SET_INDEX);
+    } else if (canAssign && compoundOperator(parser.current.type) != OP_LAST) {
+        advance();
+        const int readStart = currentChunk()->count;
+        emitBytes(OP_DUP_PAIR, OP_GET_INDEX);
+        const uint8_t store[] = {OP_SET_INDEX};
+        compoundAssignment(readStart, compoundOperator(parser.previous.type),
+                           OP_UPDATE_INDEX, -1, store, 1);
     } else {
         emitByte(OP_GET_INDEX);
     }
@@ -1360,11 +2109,11 @@ static void element(const bool canAssign) {
 
 static void literal([[maybe_unused]] bool canAssign) {
     switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE);
+    case TOKEN_FALSE: emitLiteral(FALSE_VAL);
         break;
-    case TOKEN_NIL: emitByte(OP_NIL);
+    case TOKEN_NIL: emitLiteral(NIL_VAL);
         break;
-    case TOKEN_TRUE: emitByte(OP_TRUE);
+    case TOKEN_TRUE: emitLiteral(TRUE_VAL);
         break;
     default: return; // Unreachable
     }
@@ -1377,10 +2126,15 @@ static void grouping([[maybe_unused]] bool canAssign) {
 
 static void number([[maybe_unused]] bool canAssign) {
     const double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    emitLiteral(canonicalNumber(value));
 }
 
 static void or_([[maybe_unused]] bool canAssign) {
+    if (isLiteral(current->operandStart)) {
+        constantLogical(PREC_OR, isFalsyLiteral(current->lastLiteral.value));
+        return;
+    }
+
     const int elseJump = emitJump(OP_JUMP_IF_FALSE);
     const int endJump = emitJump(OP_JUMP);
     patchJump(elseJump);
@@ -1391,13 +2145,23 @@ static void or_([[maybe_unused]] bool canAssign) {
 }
 
 static void string([[maybe_unused]] bool canAssign) {
-    emitConstant(
+    emitLiteral(
         OBJ_VAL(
             (Obj*) escapedString(parser.previous.start + 1,
                 parser.previous.length - 2)));
 }
 
 static void namedVariable(Token name, const bool canAssign) {
+    const Value* literal;
+    if (resolveConstant(&name, &literal)) {
+        if (canAssign && (check(TOKEN_EQUAL) || compoundOperator(parser.current.type) != OP_LAST)) {
+            error("Can't assign to a constant.");
+        } else if (literal != NULL) {
+            emitSharedLiteral(*literal);
+            return;
+        }
+    }
+
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
 
@@ -1413,34 +2177,32 @@ static void namedVariable(Token name, const bool canAssign) {
         setOp = OP_SET_GLOBAL;
     }
 
+    if (canAssign && setOp != OP_SET_GLOBAL) {
+        switch (parser.current.type) {
+        case TOKEN_EQUAL:
+        case TOKEN_PLUS_EQUAL:
+        case TOKEN_MINUS_EQUAL:
+        case TOKEN_STAR_EQUAL:
+        case TOKEN_SLASH_EQUAL:
+        case TOKEN_PERCENT_EQUAL: markAssigned(current, &name);
+            break;
+        default: break;
+        }
+    }
+
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitBytes(setOp, (uint8_t) arg);
-    } else if (canAssign && match(TOKEN_PLUS_EQUAL)) {
-        emitBytes(getOp, (uint8_t) arg);
-        expression();
-        emitByte(OP_ADD);
-        emitBytes(setOp, (uint8_t) arg);
-    } else if (canAssign && match(TOKEN_MINUS_EQUAL)) {
-        emitBytes(getOp, (uint8_t) arg);
-        expression();
-        emitByte(OP_SUBTRACT);
-        emitBytes(setOp, (uint8_t) arg);
-    } else if (canAssign && match(TOKEN_STAR_EQUAL)) {
-        emitBytes(getOp, (uint8_t) arg);
-        expression();
-        emitByte(OP_MULTIPLY);
-        emitBytes(setOp, (uint8_t) arg);
-    } else if (canAssign && match(TOKEN_SLASH_EQUAL)) {
-        emitBytes(getOp, (uint8_t) arg);
-        expression();
-        emitByte(OP_DIVIDE);
-        emitBytes(setOp, (uint8_t) arg);
-    } else if (canAssign && match(TOKEN_PERCENT_EQUAL)) {
+    } else if (canAssign && compoundOperator(parser.current.type) != OP_LAST) {
+        advance();
+        const int readStart = currentChunk()->count;
         emitBytes(getOp, (uint8_t) arg);
-        expression();
-        emitByte(OP_MODULUS);
-        emitBytes(setOp, (uint8_t) arg);
+        // Locals are slots of the frame already
+        const uint8_t update = getOp == OP_GET_GLOBAL ? OP_UPDATE_GLOBAL
+                               : getOp == OP_GET_UPVALUE ? OP_UPDATE_UPVALUE
+                               : OP_LAST;
+        const uint8_t store[] = {setOp, (uint8_t) arg};
+        compoundAssignment(readStart, compoundOperator(parser.previous.type), update, arg, store, 2);
     } else {
         emitBytes(getOp, (uint8_t) arg);
     }
@@ -1461,10 +2223,25 @@ static void this_([[maybe_unused]] bool canAssign) {
 
 static void unary([[maybe_unused]] bool canAssign) {
     const TokenType operatorType = parser.previous.type;
+    const int operandStart = currentChunk()->count;
 
     // Compile the operand.
     parsePrecedence(PREC_UNARY);
 
+    if (isLiteral(operandStart)) {
+        const Literal operand = current->lastLiteral;
+        if (operatorType == TOKEN_BANG) {
+            removeLiteral(&operand);
+            emitLiteral(BOOL_VAL(isFalsyLiteral(operand.value)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand.value)) {
+            removeLiteral(&operand);
+            emitLiteral(canonicalNumber(-AS_NUMBER(operand.value)));
+            return;
+        }
+    }
+
     // Emit the operand instruction
     switch (operatorType) {
     case TOKEN_BANG: emitByte(OP_NOT);
@@ -1561,12 +2338,14 @@ static void parsePrecedence(const Precedence precedence) {
         return;
     }
 
+    const int start = currentChunk()->count;
     const bool canAssign = precedence <= PREC_ASSIGNMENT;
     prefixRule(canAssign);
 
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
         const ParseFn infixRule = getRule(parser.previous.type)->infix;
+        current->operandStart = start;
         infixRule(canAssign);
     }
 
@@ -1603,6 +2382,10 @@ ObjFunction* compile(InputFile source)
 
     ObjFunction* function = endCompiler();
     freeScanner(parser.scanner);
+    FREE_ARRAY(GlobalConstant, globalConstants.constants, globalConstants.capacity);
+    globalConstants.constants = NULL;
+    globalConstants.count = 0;
+    globalConstants.capacity = 0;
     return parser.hadError ? NULL : function;
 }
 
@@ -1611,7 +2394,13 @@ void markCompilerRoots() {
     while (compiler != NULL) {
         markObject((Obj*) compiler->function);
         markTable(&compiler->stringConstants);
+        for (int i = 0; i < compiler->localCount; i++) {
+            if (compiler->locals[i].isLiteral) markValue(compiler->locals[i].literal);
+        }
         
         compiler = compiler->enclosing;
     }
+    for (int i = 0; i < globalConstants.count; i++) {
+        if (globalConstants.constants[i].isLiteral) markValue(globalConstants.constants[i].literal);
+    }
 }
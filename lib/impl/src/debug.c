@@ -80,12 +80,14 @@ static int closureInstruction(FILE* file, const char* name, const Chunk* chunk,
 
     const ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
     for (int j = 0; j < function->upvalueCount; j++) {
-        const int isLocal = read_byte(chunk, offset++);
+        const int flags = read_byte(chunk, offset++);
         const int index = read_byte(chunk, offset++);
         fprintf(
             file,
             "%04d\t|\t\t\t%s %d\n",
-            offset - 2, isLocal ? "local" : "upvalue", index);
+            offset - 2,
+            flags & CAPTURE_VALUE ? "value" : flags & CAPTURE_LOCAL ? "local" : "upvalue",
+            index);
     }
     return offset;
 }
@@ -104,6 +106,132 @@ static int exceptionHandlerInstruction(FILE* file, const char* name, const Chunk
     return offset + 6;
 }
 
+static int moveInstruction(FILE* file, const char* name, const Chunk* chunk, const int offset) {
+    const uint8_t target = read_byte(chunk, offset + 1);
+    const uint8_t source = read_byte(chunk, offset + 2);
+    fprintf(file, "%-29s %4d <- %d\n", name, target, source);
+    return offset + 3;
+}
+
+static int loadConstantInstruction(FILE* file, const char* name, const Chunk* chunk, const int offset) {
+    const uint8_t target = read_byte(chunk, offset + 1);
+    const uint8_t constant = read_byte(chunk, offset + 2);
+    fprintf(file, "%-29s %4d <- %d '", name, target, constant);
+    printValue(file, chunk->constants.values[constant]);
+    fprintf(file, "'\n");
+    return offset + 3;
+}
+
+// The stack instructions following a register instruction are only its
+// fallback, so they are not listed separately
+static int registerInstruction(
+    FILE* file, const char* name, const Chunk* chunk, const int offset,
+    const bool constant, const bool store
+) {
+    const uint8_t first = read_byte(chunk, offset + 1);
+    const uint8_t second = read_byte(chunk, offset + 2);
+    if (store) {
+        fprintf(file, "%-29s %4d <- %d, ", name, read_byte(chunk, offset + 5), first);
+    } else {
+        fprintf(file, "%-29s %4d, ", name, first);
+    }
+    if (constant) {
+        fprintf(file, "'");
+        printValue(file, chunk->constants.values[second]);
+        fprintf(file, "'\n");
+    } else {
+        fprintf(file, "%d\n", second);
+    }
+    return offset + (store ? REGISTER_STORE_LENGTH : REGISTER_PUSH_LENGTH);
+}
+
+static int inlineGuardInstruction(FILE* file, const char* name, const Chunk* chunk, const int offset) {
+    const bool invoke = chunk->code[offset] == OP_INLINE_INVOKE;
+    const int length = invoke ? INLINE_INVOKE_LENGTH : INLINE_CALL_LENGTH;
+    const uint8_t constant = read_byte(chunk, offset + (invoke ? 2 : 1));
+    const uint8_t argCount = read_byte(chunk, offset + length - 3);
+    const uint16_t fallback = read_short(chunk, offset + length - 2);
+    fprintf(file, "%-29s (%d args) %4d '", name, argCount, constant);
+    printValue(file, chunk->constants.values[constant]);
+    fprintf(file, "' else -> %d\n", offset + length + fallback);
+    return offset + length;
+}
+
+static int inlineReturnInstruction(FILE* file, const char* name, const Chunk* chunk, const int offset) {
+    const uint8_t depth = read_byte(chunk, offset + 1);
+    const uint16_t skip = read_short(chunk, offset + 2);
+    fprintf(file, "%-29s %4d -> %d\n", name, depth, offset + INLINE_RETURN_LENGTH + skip);
+    return offset + INLINE_RETURN_LENGTH;
+}
+
+static int updateInstruction(FILE* file, const char* name, const Chunk* chunk, const int offset) {
+    const uint8_t instruction = chunk->code[offset];
+    const int length = instruction == OP_UPDATE_INDEX ? UPDATE_INDEX_LENGTH : UPDATE_LENGTH;
+    const uint8_t operator = read_byte(chunk, offset + length - 3);
+    const uint16_t skip = read_short(chunk, offset + length - 2);
+    fprintf(file, "%-29s ", name);
+    if (instruction == OP_UPDATE_PROPERTY || instruction == OP_UPDATE_GLOBAL) {
+        const uint8_t constant = read_byte(chunk, offset + 1);
+        fprintf(file, "%4d '", constant);
+        printValue(file, chunk->constants.values[constant]);
+        fprintf(file, "' ");
+    } else if (instruction == OP_UPDATE_UPVALUE) {
+        fprintf(file, "%4d ", read_byte(chunk, offset + 1));
+    }
+    fprintf(file, "%s -> %d\n", opcodeToString(operator), offset + length + skip);
+    return offset + length;
+}
+
+// Lists the cases of the table below the instruction, each with the
+// address of its body
+static int switchInstruction(FILE* file, const char* name, const Chunk* chunk, const int offset) {
+    const bool dense = chunk->code[offset] == OP_SWITCH_DENSE;
+    const int header = dense ? SWITCH_DENSE_HEADER : SWITCH_HASHED_HEADER;
+    const int entryLength = dense ? SWITCH_DENSE_ENTRY : SWITCH_HASHED_ENTRY;
+    const uint16_t count = read_short(chunk, offset + header - 2);
+    fprintf(file, "%-29s %4d\n", name, count);
+
+    for (int i = 0; i < count; i++) {
+        const int entry = offset + header + i * entryLength;
+        const uint16_t address = read_short(chunk, entry + entryLength - 2);
+        if (address == NO_CASE) continue;
+        fprintf(file, "%04d\t|\t\t\t", entry);
+        if (dense) {
+            fprintf(file, "%d", AS_INT(chunk->constants.values[read_byte(chunk, offset + 1)]) + i);
+        } else {
+            printValue(file, chunk->constants.values[read_byte(chunk, entry)]);
+        }
+        fprintf(file, " -> %d\n", address);
+    }
+    return offset + header + count * entryLength;
+}
+
+// Shows the condition a counting loop instruction checks, like
+// "slot 1 < slot 2" or "slot 1 + 2 >= 10"
+static int forInstruction(FILE* file, const char* name, const Chunk* chunk, const int offset) {
+    const bool loop = chunk->code[offset] == OP_FOR_LOOP;
+    const int length = loop ? FOR_LOOP_LENGTH : FOR_PREP_LENGTH;
+    const uint8_t counter = read_byte(chunk, offset + 1);
+    const uint8_t flags = read_byte(chunk, offset + 2);
+    const uint8_t limit = read_byte(chunk, offset + 3);
+    const uint16_t body = read_short(chunk, offset + length - 2);
+
+    fprintf(file, "%-29s slot %d", name, counter);
+    if (loop) {
+        const int8_t step = (int8_t) read_byte(chunk, offset + 4);
+        fprintf(file, " %c %d", step < 0 ? '-' : '+', step < 0 ? -step : step);
+    }
+    const char* comparisons[] = {"<", ">", ">=", "<="};
+    fprintf(file, " %s ", comparisons[flags & (FOR_GREATER | FOR_NEGATED)]);
+    if (flags & FOR_LIMIT_CONSTANT) {
+        printValue(file, chunk->constants.values[limit]);
+    } else {
+        fprintf(file, "slot %d", limit);
+    }
+    fprintf(file, " -> %d\n", offset + length + body);
+    return offset + length;
+}
+
 int disassembleInstruction(FILE* file, Chunk* chunk, const int offset) {
     fprintf(file, "%04d ", offset);
     const int line = getLine(chunk, offset);
@@ -130,6 +258,7 @@ int disassembleInstruction(FILE* file, Chunk* chunk, const int offset) {
     case OP_SET_LOCAL: return byteInstruction(file, desc, chunk, offset);
     case OP_GET_GLOBAL: return constantInstruction(file, desc, chunk, offset);
     case OP_DEFINE_GLOBAL: return constantInstruction(file, desc, chunk, offset);
+    case OP_DEFINE_CONSTANT: return constantInstruction(file, desc, chunk, offset);
     case OP_SET_GLOBAL: return constantInstruction(file, desc, chunk, offset);
     case OP_GET_UPVALUE: return byteInstruction(file, desc, chunk, offset);
     case OP_SET_UPVALUE: return byteInstruction(file, desc, chunk, offset);
@@ -169,6 +298,48 @@ int disassembleInstruction(FILE* file, Chunk* chunk, const int offset) {
         return exceptionHandlerInstruction(file, desc, chunk, offset);
     case OP_POP_EXCEPTION_HANDLER: return simpleInstruction(file, desc, offset);
     case OP_PROPAGATE_EXCEPTION: return simpleInstruction(file, desc, offset);
+    case OP_JUMP_IF_TRUE: return jumpInstruction(file, desc, 1, chunk, offset);
+    case OP_SET_LOCAL_POP: return byteInstruction(file, desc, chunk, offset);
+    case OP_REG_MOVE: return moveInstruction(file, desc, chunk, offset);
+    case OP_REG_LOAD_CONSTANT: return loadConstantInstruction(file, desc, chunk, offset);
+    case OP_REG_ADD:
+    case OP_REG_SUBTRACT:
+    case OP_REG_MULTIPLY:
+    case OP_REG_DIVIDE:
+    case OP_REG_MODULUS: return registerInstruction(file, desc, chunk, offset, false, true);
+    case OP_REG_ADD_CONSTANT:
+    case OP_REG_SUBTRACT_CONSTANT:
+    case OP_REG_MULTIPLY_CONSTANT:
+    case OP_REG_DIVIDE_CONSTANT:
+    case OP_REG_MODULUS_CONSTANT: return registerInstruction(file, desc, chunk, offset, true, true);
+    case OP_REG_PUSH_ADD:
+    case OP_REG_PUSH_SUBTRACT:
+    case OP_REG_PUSH_MULTIPLY:
+    case OP_REG_PUSH_DIVIDE:
+    case OP_REG_PUSH_MODULUS:
+    case OP_REG_PUSH_EQUAL:
+    case OP_REG_PUSH_GREATER:
+    case OP_REG_PUSH_LESS: return registerInstruction(file, desc, chunk, offset, false, false);
+    case OP_REG_PUSH_ADD_CONSTANT:
+    case OP_REG_PUSH_SUBTRACT_CONSTANT:
+    case OP_REG_PUSH_MULTIPLY_CONSTANT:
+    case OP_REG_PUSH_DIVIDE_CONSTANT:
+    case OP_REG_PUSH_MODULUS_CONSTANT:
+    case OP_REG_PUSH_EQUAL_CONSTANT:
+    case OP_REG_PUSH_GREATER_CONSTANT:
+    case OP_REG_PUSH_LESS_CONSTANT: return registerInstruction(file, desc, chunk, offset, true, false);
+    case OP_INLINE_CALL:
+    case OP_INLINE_INVOKE: return inlineGuardInstruction(file, desc, chunk, offset);
+    case OP_INLINE_RETURN: return inlineReturnInstruction(file, desc, chunk, offset);
+    case OP_DUP_PAIR: return simpleInstruction(file, desc, offset);
+    case OP_UPDATE_PROPERTY:
+    case OP_UPDATE_INDEX:
+    case OP_UPDATE_GLOBAL:
+    case OP_UPDATE_UPVALUE: return updateInstruction(file, desc, chunk, offset);
+    case OP_SWITCH_DENSE:
+    case OP_SWITCH_HASHED: return switchInstruction(file, desc, chunk, offset);
+    case OP_FOR_PREP:
+    case OP_FOR_LOOP: return forInstruction(file, desc, chunk, offset);
     default: fprintf(file, "Unknown opcode %d\n", instruction);
         return offset + 1;
     }
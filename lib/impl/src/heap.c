@@ -0,0 +1,879 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <common/arena.h>
+
+#include <impl/heap.h>
+
+#define SIZE_CLASS_COUNT 16
+
+static const uint32_t sizeClasses[SIZE_CLASS_COUNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+};
+
+// Bitmaps have one bit per 16 byte granule of a page
+#define GRANULE_SHIFT 4
+#define BITMAP_WORDS (HEAP_PAGE_SIZE >> GRANULE_SHIFT >> 6)
+
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+} FreeBlock;
+
+// Page bookkeeping lives outside the page. The page itself only starts
+// with a pointer back to it, which is written once, so a collection in a
+// forked child dirties the bitmaps and the pages holding garbage only.
+typedef struct HeapPage {
+    struct HeapPage* next;
+    // Large object pages are unlinked one by one when their object dies
+    struct HeapPage* prev;
+    // Pages of the same size class with at least one free block
+    struct HeapPage* nextPartial;
+    uint8_t* base;
+    FreeBlock* freeList;
+    // Blocks past this point were never handed out
+    uint8_t* bump;
+    uint32_t blockSize;
+    uint32_t liveCount;
+    bool isPartial;
+    bool isSwept;
+    // Set once the page memory has been handed back to the OS
+    bool isDecommitted;
+    // Arena pages hold an arena_t right after the page header
+    bool isArena;
+    // Consecutive completed sweeps the page has been empty for
+    uint32_t emptySweeps;
+    // Only object pages have bitmaps, immortal pages have none
+    uint64_t* markBits;
+    uint64_t* allocBits;
+} HeapPage;
+
+#define PAGE_HEADER_SIZE ((size_t) 16)
+
+typedef struct {
+    HeapPage* pages;
+    HeapPage* partial;
+} SizeClass;
+
+static struct {
+    SizeClass classes[SIZE_CLASS_COUNT];
+    SizeClass objectClasses[SIZE_CLASS_COUNT];
+    HeapPage* objectPages;
+    HeapPage* largeObjects;
+    // The current immortal page is the first one, they are only unmapped by freeHeap
+    HeapPage* immortalPages;
+    // Arena pages are filled in list order, the current one is the last
+    // one in use. Objects bigger than a page get spans of their own.
+    HeapPage* arenaPages;
+    HeapPage* arenaCurrent;
+    HeapPage* arenaLarge;
+    size_t arenaBytes;
+    HeapPage* sweepCursor;
+    bool sweeping;
+    size_t mappedBytes;
+    size_t decommittedBytes;
+    size_t osPageSize;
+} heap;
+
+typedef enum {
+    TIER_SMALL,
+    TIER_MEDIUM,
+    TIER_LARGE,
+} HeapTier;
+
+static HeapTier tierOf(const size_t size) {
+    if (size <= HEAP_SMALL_MAX) return TIER_SMALL;
+    if (size < HEAP_LARGE_MIN) return TIER_MEDIUM;
+    return TIER_LARGE;
+}
+
+static int sizeClassOf(const size_t size) {
+    if (size <= 128) return size == 0 ? 0 : (int) ((size - 1) / 16);
+    if (size <= 256) return 8 + (int) ((size - 129) / 32);
+    return 12 + (int) ((size - 257) / 64);
+}
+
+static HeapPage* pageOf(const void* pointer) {
+    return *(HeapPage**) ((uintptr_t) pointer & ~(uintptr_t) (HEAP_PAGE_SIZE - 1));
+}
+
+// Arena pages start their arena right after the header
+static arena_t* pageArena(const HeapPage* page) {
+    return (arena_t*) (page->base + PAGE_HEADER_SIZE);
+}
+
+static size_t granuleOf(const HeapPage* page, const void* pointer) {
+    return (size_t) ((const uint8_t*) pointer - page->base) >> GRANULE_SHIFT;
+}
+
+#define BIT_WORD(bit) ((bit) >> 6)
+#define BIT_MASK(bit) ((uint64_t) 1 << ((bit) & 63))
+
+static size_t roundToOsPage(const size_t size) {
+    if (heap.osPageSize == 0) {
+        heap.osPageSize = (size_t) sysconf(_SC_PAGESIZE);
+    }
+    return (size + heap.osPageSize - 1) & ~(heap.osPageSize - 1);
+}
+
+static void* mapAligned(const size_t size, const size_t alignment) {
+    const size_t span = size + alignment;
+    uint8_t* base = mmap(
+        NULL, span, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+
+    uint8_t* aligned = (uint8_t*) (((uintptr_t) base + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    if (aligned > base) {
+        munmap(base, aligned - base);
+    }
+    const uint8_t* spanEnd = base + span;
+    if (spanEnd > aligned + size) {
+        munmap(aligned + size, spanEnd - (aligned + size));
+    }
+    return aligned;
+}
+
+#ifdef COMPRESSED_REFS
+
+uint8_t* heapRegionBase = NULL;
+
+// A released run of region pages, kept in address order so
+// neighbours can be merged
+typedef struct RegionSpan {
+    struct RegionSpan* next;
+    uint8_t* base;
+    size_t size;
+} RegionSpan;
+
+static struct {
+    uint8_t* top;
+    uint8_t* end;
+    RegionSpan* free;
+} region;
+
+static bool reserveRegion() {
+    if (heapRegionBase != NULL) return true;
+
+    // Only address space is reserved, spans are made accessible as they are used
+    uint8_t* base = mmap(
+        NULL, HEAP_REGION_SIZE + HEAP_PAGE_SIZE, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return false;
+
+    uint8_t* aligned = (uint8_t*) (((uintptr_t) base + HEAP_PAGE_SIZE - 1) & ~(uintptr_t) (HEAP_PAGE_SIZE - 1));
+    if (aligned > base) {
+        munmap(base, aligned - base);
+    }
+    munmap(aligned + HEAP_REGION_SIZE, base + HEAP_PAGE_SIZE - aligned);
+
+    heapRegionBase = aligned;
+    region.top = aligned;
+    region.end = aligned + HEAP_REGION_SIZE;
+    return true;
+}
+
+static uint8_t* takeFreeSpan(const size_t size) {
+    for (RegionSpan** link = &region.free; *link != NULL; link = &(*link)->next) {
+        RegionSpan* span = *link;
+        if (span->size < size) continue;
+
+        uint8_t* base = span->base;
+        span->base += size;
+        span->size -= size;
+        if (span->size == 0) {
+            *link = span->next;
+            free(span);
+        }
+        return base;
+    }
+    return NULL;
+}
+
+static void putFreeSpan(uint8_t* base, const size_t size) {
+    RegionSpan* prev = NULL;
+    RegionSpan* next = region.free;
+    while (next != NULL && next->base < base) {
+        prev = next;
+        next = next->next;
+    }
+
+    if (prev != NULL && prev->base + prev->size == base) {
+        prev->size += size;
+    } else {
+        RegionSpan* span = malloc(sizeof(RegionSpan));
+        // Losing track of the span only leaks address space
+        if (span == NULL) return;
+        span->base = base;
+        span->size = size;
+        span->next = next;
+        if (prev != NULL) prev->next = span;
+        else region.free = span;
+        prev = span;
+    }
+
+    if (next != NULL && prev->base + prev->size == next->base) {
+        prev->size += next->size;
+        prev->next = next->next;
+        free(next);
+    }
+
+    // A span ending at the top is handed back to the bump pointer
+    if (prev->base + prev->size == region.top && prev->next == NULL) {
+        region.top = prev->base;
+        RegionSpan** link = &region.free;
+        while (*link != prev) link = &(*link)->next;
+        *link = NULL;
+        free(prev);
+    }
+}
+
+static size_t objectSpanSize(const size_t size) {
+    return (size + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+}
+
+static void* mapObjectSpan(const size_t size) {
+    if (!reserveRegion()) return NULL;
+
+    uint8_t* base = takeFreeSpan(size);
+    if (base == NULL) {
+        if ((size_t) (region.end - region.top) < size) return NULL;
+        base = region.top;
+        region.top += size;
+    }
+    if (mprotect(base, size, PROT_READ | PROT_WRITE) != 0) {
+        putFreeSpan(base, size);
+        return NULL;
+    }
+    return base;
+}
+
+static void unmapObjectSpan(void* base, const size_t size) {
+    // Mapping over the span drops its memory and makes it inaccessible again
+    mmap(base, size, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    putFreeSpan(base, size);
+}
+
+static void releaseRegion() {
+    if (heapRegionBase == NULL) return;
+    munmap(heapRegionBase, HEAP_REGION_SIZE);
+    while (region.free != NULL) {
+        RegionSpan* next = region.free->next;
+        free(region.free);
+        region.free = next;
+    }
+    heapRegionBase = NULL;
+}
+
+#else
+
+static size_t objectSpanSize(const size_t size) {
+    return roundToOsPage(size);
+}
+
+static void* mapObjectSpan(const size_t size) {
+    return mapAligned(size, HEAP_PAGE_SIZE);
+}
+
+static void unmapObjectSpan(void* base, const size_t size) {
+    munmap(base, size);
+}
+
+#endif
+
+static HeapPage* newPage(SizeClass* class, const int sizeClass, const bool forObjects) {
+    HeapPage* page = calloc(1, sizeof(HeapPage));
+    if (page == NULL) return NULL;
+
+    if (forObjects) {
+        page->markBits = calloc(2 * BITMAP_WORDS, sizeof(uint64_t));
+        if (page->markBits == NULL) {
+            free(page);
+            return NULL;
+        }
+        page->allocBits = page->markBits + BITMAP_WORDS;
+    }
+
+    page->base = forObjects
+                     ? mapObjectSpan(HEAP_PAGE_SIZE)
+                     : mapAligned(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+    if (page->base == NULL) {
+        free(page->markBits);
+        free(page);
+        return NULL;
+    }
+    heap.mappedBytes += HEAP_PAGE_SIZE;
+    *(HeapPage**) page->base = page;
+
+    page->blockSize = sizeClasses[sizeClass];
+    page->bump = page->base + PAGE_HEADER_SIZE;
+    // Pages created during a sweep only hold objects allocated after marking
+    page->isSwept = true;
+
+    if (forObjects) {
+        page->next = heap.objectPages;
+        heap.objectPages = page;
+    } else {
+        page->next = class->pages;
+        class->pages = page;
+    }
+
+    page->isPartial = true;
+    page->nextPartial = class->partial;
+    class->partial = page;
+    return page;
+}
+
+static void* allocateFromClass(SizeClass* class, const int sizeClass, const bool forObjects) {
+    HeapPage* page = class->partial;
+    if (page == NULL && (page = newPage(class, sizeClass, forObjects)) == NULL) {
+        return NULL;
+    }
+    if (page->isDecommitted) {
+        // The back pointer was dropped along with the rest of the page
+        *(HeapPage**) page->base = page;
+        page->isDecommitted = false;
+        heap.decommittedBytes -= HEAP_PAGE_SIZE;
+    }
+
+    void* block;
+    if (page->freeList != NULL) {
+        block = page->freeList;
+        page->freeList = page->freeList->next;
+    } else {
+        block = page->bump;
+        page->bump += page->blockSize;
+    }
+    page->liveCount++;
+
+    if (page->freeList == NULL &&
+        page->bump + page->blockSize > page->base + HEAP_PAGE_SIZE) {
+        class->partial = page->nextPartial;
+        page->isPartial = false;
+    }
+    return block;
+}
+
+static void releaseToClass(SizeClass* class, void* pointer) {
+    HeapPage* page = pageOf(pointer);
+    FreeBlock* block = pointer;
+    block->next = page->freeList;
+    page->freeList = block;
+    page->liveCount--;
+
+    if (!page->isPartial) {
+        page->isPartial = true;
+        page->nextPartial = class->partial;
+        class->partial = page;
+    }
+}
+
+static void* allocateLarge(const size_t size) {
+    const size_t mapped = roundToOsPage(size);
+    void* result = mmap(
+        NULL, mapped, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) return NULL;
+    heap.mappedBytes += mapped;
+    return result;
+}
+
+static void freeLarge(void* pointer, const size_t size) {
+    const size_t mapped = roundToOsPage(size);
+    munmap(pointer, mapped);
+    heap.mappedBytes -= mapped;
+}
+
+void* heapAllocate(const size_t size) {
+    switch (tierOf(size)) {
+    case TIER_SMALL: {
+        const int sizeClass = sizeClassOf(size);
+        return allocateFromClass(&heap.classes[sizeClass], sizeClass, false);
+    }
+    case TIER_MEDIUM: return malloc(size);
+    case TIER_LARGE: return allocateLarge(size);
+    }
+    return NULL;
+}
+
+void heapFree(void* pointer, const size_t size) {
+    if (pointer == NULL) return;
+    switch (tierOf(size)) {
+    case TIER_SMALL: releaseToClass(&heap.classes[sizeClassOf(size)], pointer); break;
+    case TIER_MEDIUM: free(pointer); break;
+    case TIER_LARGE: freeLarge(pointer, size); break;
+    }
+}
+
+void* heapReallocate(void* pointer, const size_t oldSize, const size_t newSize) {
+    if (newSize == 0) {
+        heapFree(pointer, oldSize);
+        return NULL;
+    }
+    if (pointer == NULL) {
+        return heapAllocate(newSize);
+    }
+
+    const HeapTier oldTier = tierOf(oldSize);
+    const HeapTier newTier = tierOf(newSize);
+    if (oldTier == TIER_SMALL && newTier == TIER_SMALL &&
+        sizeClassOf(oldSize) == sizeClassOf(newSize)) {
+        return pointer;
+    }
+    if (oldTier == TIER_MEDIUM && newTier == TIER_MEDIUM) {
+        return realloc(pointer, newSize);
+    }
+#ifdef MREMAP_MAYMOVE
+    if (oldTier == TIER_LARGE && newTier == TIER_LARGE) {
+        const size_t oldMapped = roundToOsPage(oldSize);
+        const size_t newMapped = roundToOsPage(newSize);
+        void* result = mremap(pointer, oldMapped, newMapped, MREMAP_MAYMOVE);
+        if (result == MAP_FAILED) return NULL;
+        heap.mappedBytes += newMapped - oldMapped;
+        return result;
+    }
+#endif
+
+    void* result = heapAllocate(newSize);
+    if (result == NULL) return NULL;
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    heapFree(pointer, oldSize);
+    return result;
+}
+
+// Objects too big for a size class get a run of pages to themselves,
+// aligned like a regular page so pageOf and the bitmaps work unchanged.
+static void* allocateLargeObject(const size_t size) {
+    HeapPage* page = calloc(1, sizeof(HeapPage));
+    if (page == NULL) return NULL;
+
+    // The object always sits in the first granule after the header
+    page->markBits = calloc(2, sizeof(uint64_t));
+    if (page->markBits == NULL) {
+        free(page);
+        return NULL;
+    }
+    page->allocBits = page->markBits + 1;
+
+    const size_t mapped = objectSpanSize(PAGE_HEADER_SIZE + size);
+    page->base = mapObjectSpan(mapped);
+    if (page->base == NULL) {
+        free(page->markBits);
+        free(page);
+        return NULL;
+    }
+    heap.mappedBytes += mapped;
+    *(HeapPage**) page->base = page;
+
+    void* object = page->base + PAGE_HEADER_SIZE;
+    const size_t granule = granuleOf(page, object);
+    page->allocBits[BIT_WORD(granule)] |= BIT_MASK(granule);
+    page->liveCount = 1;
+    page->isSwept = true;
+
+    page->next = heap.largeObjects;
+    if (heap.largeObjects != NULL) {
+        heap.largeObjects->prev = page;
+    }
+    heap.largeObjects = page;
+    return object;
+}
+
+static void freeLargeObject(void* pointer, const size_t size) {
+    HeapPage* page = pageOf(pointer);
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        heap.largeObjects = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+
+    const size_t mapped = objectSpanSize(PAGE_HEADER_SIZE + size);
+    unmapObjectSpan(page->base, mapped);
+    heap.mappedBytes -= mapped;
+    free(page->markBits);
+    free(page);
+}
+
+void* heapAllocateObject(const size_t size) {
+    if (size > HEAP_SMALL_MAX) return allocateLargeObject(size);
+
+    const int sizeClass = sizeClassOf(size);
+    void* block = allocateFromClass(&heap.objectClasses[sizeClass], sizeClass, true);
+    if (block == NULL) return NULL;
+
+    HeapPage* page = pageOf(block);
+    const size_t granule = granuleOf(page, block);
+    page->allocBits[BIT_WORD(granule)] |= BIT_MASK(granule);
+    // The sweep in progress must not reclaim objects born after marking
+    if (!page->isSwept) {
+        page->markBits[BIT_WORD(granule)] |= BIT_MASK(granule);
+    }
+    return block;
+}
+
+void heapFreeObject(void* pointer, const size_t size) {
+    const HeapPage* owner = pageOf(pointer);
+    if (owner->markBits == NULL) {
+        // Immortal memory stays in place, arenas only take back their last block
+        if (owner->isArena) {
+            arena_free(pageArena(owner), pointer);
+        }
+        return;
+    }
+
+    if (size > HEAP_SMALL_MAX) {
+        freeLargeObject(pointer, size);
+        return;
+    }
+
+    HeapPage* page = pageOf(pointer);
+    const size_t granule = granuleOf(page, pointer);
+    page->allocBits[BIT_WORD(granule)] &= ~BIT_MASK(granule);
+    releaseToClass(&heap.objectClasses[sizeClassOf(size)], pointer);
+}
+
+// Immortal objects share their pages, which hold no bookkeeping beyond
+// the header, so they are handed out in granules from a bump pointer.
+// Objects that do not fit a page get a span of their own.
+static HeapPage* newImmortalPage(const size_t size) {
+    HeapPage* page = calloc(1, sizeof(HeapPage));
+    if (page == NULL) return NULL;
+
+    const size_t mapped = PAGE_HEADER_SIZE + size > HEAP_PAGE_SIZE
+                              ? objectSpanSize(PAGE_HEADER_SIZE + size)
+                              : HEAP_PAGE_SIZE;
+    page->base = mapObjectSpan(mapped);
+    if (page->base == NULL) {
+        free(page);
+        return NULL;
+    }
+    heap.mappedBytes += mapped;
+    *(HeapPage**) page->base = page;
+
+    page->bump = page->base + PAGE_HEADER_SIZE;
+    // There are no blocks, the size of the span is kept instead
+    page->blockSize = (uint32_t) mapped;
+    page->next = heap.immortalPages;
+    heap.immortalPages = page;
+    return page;
+}
+
+void* heapAllocateImmortal(const size_t size) {
+    const size_t granule = (size_t) 1 << GRANULE_SHIFT;
+    const size_t rounded = (size + granule - 1) & ~(granule - 1);
+
+    HeapPage* page = heap.immortalPages;
+    if (page == NULL || page->bump + rounded > page->base + HEAP_PAGE_SIZE) {
+        // A page is only ever replaced by one with room, so one with a
+        // single big object does not strand the rest of the current page
+        HeapPage* current = page;
+        if ((page = newImmortalPage(rounded)) == NULL) return NULL;
+        if (current != NULL && rounded > HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) {
+            heap.immortalPages = current;
+            page->next = current->next;
+            current->next = page;
+        }
+    }
+
+    void* block = page->bump;
+    page->bump += rounded;
+    return block;
+}
+
+bool heapIsImmortal(const void* object) {
+    const HeapPage* page = pageOf(object);
+    return page->markBits == NULL && !page->isArena;
+}
+
+static HeapPage* newArenaPage(const size_t mapped) {
+    HeapPage* page = calloc(1, sizeof(HeapPage));
+    if (page == NULL) return NULL;
+
+    page->base = mapObjectSpan(mapped);
+    if (page->base == NULL) {
+        free(page);
+        return NULL;
+    }
+    heap.mappedBytes += mapped;
+    *(HeapPage**) page->base = page;
+
+    page->isArena = true;
+    page->blockSize = (uint32_t) mapped;
+    arena_init(pageArena(page), mapped - PAGE_HEADER_SIZE);
+    return page;
+}
+
+static void* allocateLargeArena(const size_t size, const size_t budget) {
+    const size_t mapped = objectSpanSize(PAGE_HEADER_SIZE + sizeof(arena_t) + ARENA_ALIGN_SIZE(size) + ARENA_ALIGNMENT);
+    if (heap.arenaBytes + mapped > budget) return NULL;
+
+    HeapPage* page = newArenaPage(mapped);
+    if (page == NULL) return NULL;
+    page->next = heap.arenaLarge;
+    heap.arenaLarge = page;
+    heap.arenaBytes += mapped;
+    return arena_alloc(pageArena(page), size);
+}
+
+void* heapAllocateArena(const size_t size, const size_t budget) {
+    if (heap.arenaCurrent != NULL) {
+        void* block = arena_alloc(pageArena(heap.arenaCurrent), size);
+        if (block != NULL) return block;
+    }
+
+    const size_t pageCapacity = HEAP_PAGE_SIZE - PAGE_HEADER_SIZE - sizeof(arena_t) - ARENA_ALIGNMENT;
+    if (size > pageCapacity) return allocateLargeArena(size, budget);
+    if (heap.arenaBytes + HEAP_PAGE_SIZE > budget) return NULL;
+
+    // Pages left over from an earlier run are used before mapping new ones
+    HeapPage* next = heap.arenaCurrent != NULL ? heap.arenaCurrent->next : heap.arenaPages;
+    if (next == NULL) {
+        if ((next = newArenaPage(HEAP_PAGE_SIZE)) == NULL) return NULL;
+        if (heap.arenaCurrent != NULL) {
+            heap.arenaCurrent->next = next;
+        } else {
+            heap.arenaPages = next;
+        }
+    }
+    heap.arenaCurrent = next;
+    heap.arenaBytes += HEAP_PAGE_SIZE;
+    return arena_alloc(pageArena(next), size);
+}
+
+bool heapIsArena(const void* object) {
+    return pageOf(object)->isArena;
+}
+
+static void walkArenaPage(const HeapPage* page, const HeapFreeFn visitFn) {
+    arena_t* arena = pageArena(page);
+    for (void* block = arena_first(arena); block != NULL; block = arena_next(arena, block)) {
+        visitFn(block);
+    }
+}
+
+void heapWalkArena(const HeapFreeFn visitFn) {
+    if (heap.arenaCurrent != NULL) {
+        for (HeapPage* page = heap.arenaPages; page != heap.arenaCurrent->next; page = page->next) {
+            walkArenaPage(page, visitFn);
+        }
+    }
+    for (const HeapPage* page = heap.arenaLarge; page != NULL; page = page->next) {
+        walkArenaPage(page, visitFn);
+    }
+}
+
+void heapResetArena() {
+    if (heap.arenaCurrent != NULL) {
+        for (HeapPage* page = heap.arenaPages; page != heap.arenaCurrent->next; page = page->next) {
+            arena_reset(pageArena(page));
+        }
+    }
+    while (heap.arenaLarge != NULL) {
+        HeapPage* next = heap.arenaLarge->next;
+        unmapObjectSpan(heap.arenaLarge->base, heap.arenaLarge->blockSize);
+        heap.mappedBytes -= heap.arenaLarge->blockSize;
+        free(heap.arenaLarge);
+        heap.arenaLarge = next;
+    }
+    heap.arenaCurrent = NULL;
+    heap.arenaBytes = 0;
+}
+
+bool heapIsMarked(const void* object) {
+    const HeapPage* page = pageOf(object);
+    if (page->markBits == NULL) return true;
+
+    const size_t granule = granuleOf(page, object);
+    return (page->markBits[BIT_WORD(granule)] & BIT_MASK(granule)) != 0;
+}
+
+void heapMark(const void* object) {
+    const HeapPage* page = pageOf(object);
+    const size_t granule = granuleOf(page, object);
+    page->markBits[BIT_WORD(granule)] |= BIT_MASK(granule);
+}
+
+void heapStartSweep(const HeapFreeFn freeFn) {
+    // Large objects are few and costly to keep around, they go right away
+    HeapPage* large = heap.largeObjects;
+    while (large != NULL) {
+        HeapPage* next = large->next;
+        void* object = large->base + PAGE_HEADER_SIZE;
+        if (heapIsMarked(object)) {
+            large->markBits[0] = 0;
+        } else {
+            freeFn(object);
+        }
+        large = next;
+    }
+
+    for (HeapPage* page = heap.objectPages; page != NULL; page = page->next) {
+        page->isSwept = false;
+    }
+    heap.sweepCursor = heap.objectPages;
+    heap.sweeping = true;
+}
+
+bool heapSweeping() {
+    return heap.sweeping;
+}
+
+// Frees every allocated object of the page whose mark bit is clear
+static void sweepPage(HeapPage* page, const HeapFreeFn freeFn) {
+    for (size_t word = 0; word < BITMAP_WORDS; word++) {
+        uint64_t dead = page->allocBits[word] & ~page->markBits[word];
+        while (dead != 0) {
+            const size_t granule = (word << 6) + (size_t) __builtin_ctzll(dead);
+            dead &= dead - 1;
+            freeFn(page->base + (granule << GRANULE_SHIFT));
+        }
+    }
+    memset(page->markBits, 0, BITMAP_WORDS * sizeof(uint64_t));
+    page->isSwept = true;
+}
+
+bool heapSweepObjects(size_t pageCount, const HeapFreeFn freeFn) {
+    while (heap.sweepCursor != NULL && pageCount-- > 0) {
+        HeapPage* page = heap.sweepCursor;
+        heap.sweepCursor = page->next;
+        sweepPage(page, freeFn);
+    }
+
+    if (heap.sweeping && heap.sweepCursor == NULL) {
+        heap.sweeping = false;
+        heapReleaseEmptyPages();
+    }
+    return !heap.sweeping;
+}
+
+static void decommitPage(HeapPage* page) {
+    madvise(page->base, HEAP_PAGE_SIZE, MADV_DONTNEED);
+    page->freeList = NULL;
+    page->bump = page->base + PAGE_HEADER_SIZE;
+    page->isDecommitted = true;
+    page->emptySweeps = 0;
+    heap.decommittedBytes += HEAP_PAGE_SIZE;
+}
+
+// Empty pages stay committed up to the retention budget, and only for a
+// few sweeps, so a burst does not pin its peak footprint forever.
+static void releaseEmptyPages(HeapPage* page, size_t* retained) {
+    for (; page != NULL; page = page->next) {
+        if (page->liveCount != 0) {
+            page->emptySweeps = 0;
+            continue;
+        }
+        if (page->isDecommitted) continue;
+
+        page->emptySweeps++;
+        if (*retained + HEAP_PAGE_SIZE > HEAP_RETAIN_BYTES ||
+            page->emptySweeps > HEAP_RETAIN_SWEEPS) {
+            decommitPage(page);
+        } else {
+            *retained += HEAP_PAGE_SIZE;
+        }
+    }
+}
+
+void heapReleaseEmptyPages() {
+    const size_t decommitted = heap.decommittedBytes;
+    size_t retained = 0;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        releaseEmptyPages(heap.classes[i].pages, &retained);
+    }
+    releaseEmptyPages(heap.objectPages, &retained);
+
+#ifdef __GLIBC__
+    // Mid-sized blocks live in malloc arenas, trim them along with the pages
+    if (heap.decommittedBytes > decommitted) {
+        malloc_trim(0);
+    }
+#endif
+}
+
+void heapFreeObjects(const HeapFreeFn freeFn) {
+    while (heap.largeObjects != NULL) {
+        freeFn(heap.largeObjects->base + PAGE_HEADER_SIZE);
+    }
+    for (HeapPage* page = heap.objectPages; page != NULL; page = page->next) {
+        for (size_t word = 0; word < BITMAP_WORDS; word++) {
+            uint64_t allocated = page->allocBits[word];
+            while (allocated != 0) {
+                const size_t granule = (word << 6) + (size_t) __builtin_ctzll(allocated);
+                allocated &= allocated - 1;
+                freeFn(page->base + (granule << GRANULE_SHIFT));
+            }
+        }
+    }
+    heap.sweepCursor = NULL;
+    heap.sweeping = false;
+}
+
+size_t heapMappedBytes() {
+    return heap.mappedBytes;
+}
+
+size_t heapCommittedBytes() {
+    return heap.mappedBytes - heap.decommittedBytes;
+}
+
+// Immortal and arena pages keep the size of their span in blockSize
+static void unmapSpanPages(HeapPage* page) {
+    while (page != NULL) {
+        HeapPage* next = page->next;
+        const size_t mapped = page->blockSize;
+        unmapObjectSpan(page->base, mapped);
+        heap.mappedBytes -= mapped;
+        free(page);
+        page = next;
+    }
+}
+
+static void unmapPages(HeapPage* page) {
+    while (page != NULL) {
+        HeapPage* next = page->next;
+        munmap(page->base, HEAP_PAGE_SIZE);
+        heap.mappedBytes -= HEAP_PAGE_SIZE;
+        free(page->markBits);
+        free(page);
+        page = next;
+    }
+}
+
+void freeHeap() {
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        unmapPages(heap.classes[i].pages);
+        heap.classes[i].pages = NULL;
+        heap.classes[i].partial = NULL;
+        heap.objectClasses[i].partial = NULL;
+    }
+    unmapPages(heap.objectPages);
+    heap.objectPages = NULL;
+    unmapSpanPages(heap.immortalPages);
+    heap.immortalPages = NULL;
+    heapResetArena();
+    unmapSpanPages(heap.arenaPages);
+    heap.arenaPages = NULL;
+    heap.decommittedBytes = 0;
+#ifdef COMPRESSED_REFS
+    releaseRegion();
+#endif
+}
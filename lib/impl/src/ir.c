@@ -0,0 +1,1624 @@
+#include <string.h>
+
+#include <impl/ir.h>
+#include <impl/memory.h>
+
+// Exception handler address of a try without that clause
+#define NO_ADDRESS 0xFFFF
+
+#define NONE (-1)
+
+// Jump distances are two bytes and local slots one
+#define MAX_JUMP UINT16_MAX
+#define MAX_SLOT UINT8_MAX
+
+// Longest code in front of the return that calls are replaced by
+#define MAX_INLINE_LENGTH 32
+
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NIL,
+    TYPE_BOOL,
+    TYPE_NUMBER,
+    TYPE_STRING,
+} IrType;
+
+// An SSA value, the result of an instruction or a phi joining what
+// different paths leave in a stack slot. Loading or copying a local
+// yields the value it holds, so copies are seen through
+typedef struct {
+    // Block the value is defined in, NONE for the arguments
+    int block;
+    IrType type;
+} IrValue;
+
+// A global function or a method whose calls may be replaced by its code
+typedef struct {
+    ObjString* name;
+    ObjFunction* function;
+    bool method;
+    // Defined more than once, or from something other than a constant
+    bool ambiguous;
+    bool inlineable;
+    // Bytes of code in front of the return
+    int length;
+    // Values above the callee slot when the code returns, the result included
+    int depth;
+    // Most values above the callee slot at any point of the code
+    int maxDepth;
+} InlineCandidate;
+
+typedef struct {
+    InlineCandidate* candidates;
+    int count;
+    int capacity;
+} Inliner;
+
+typedef struct {
+    uint8_t opcode;
+    int offset;
+    int length;
+    int line;
+    int block;
+    // Instruction a jump or an exception handler leads to
+    int target;
+    int handler;
+    int finally;
+
+    // Filled in by the last analysis round. The value an instruction
+    // creates has the same index as the instruction
+    int result;
+    // First instruction of the code computing the pushed value
+    int spanStart;
+    // Instruction that pushed the object a property load reads, or the
+    // callee or receiver of a call
+    int operand;
+    // Stack slot of the callee or receiver of a call
+    int base;
+    // Instruction in the same block that pops the pushed value
+    int consumer;
+    // Load whose value is still around from an earlier one in the block
+    bool repeated;
+
+    // The span ending here is replaced by a load of this hidden slot
+    int loadSlot;
+    // The result is also kept in this hidden slot
+    int storeSlot;
+    // The span ending here is evaluated once, in front of the loop
+    bool hoisted;
+    // Part of a replaced span
+    bool dropped;
+    // The call runs this code when the callee is the expected one
+    const InlineCandidate* inlined;
+} IrInstruction;
+
+typedef struct {
+    int start;
+    int end;
+    // Stack depth on entry, NONE while no path to the block is known
+    int depth;
+    // Value in each stack slot on entry
+    int* entry;
+    // Phi of each stack slot, NONE until paths disagree on it
+    int* phis;
+    // Entered when an exception is caught
+    bool handler;
+    int successors[4];
+    int successorCount;
+    // Blocks of the loop the block heads, once code is hoisted out of it
+    bool* loop;
+} IrBlock;
+
+typedef struct {
+    ObjFunction* function;
+    Chunk* chunk;
+
+    IrInstruction* instructions;
+    int count;
+    int* blockOf;
+
+    IrBlock* blocks;
+    int blockCount;
+
+    IrValue* values;
+    int valueCount;
+    int valueCapacity;
+
+    // A closure can change a slot it captured behind the function's back
+    bool captured[MAX_SLOT + 1];
+    int maxSlot;
+    int hiddenSlots;
+
+    bool changed;
+    bool failed;
+} IrFunction;
+
+typedef struct {
+    int value;
+    // Instruction in the block that pushed the value, NONE when the value
+    // came in with the block
+    int producer;
+    int spanStart;
+} StackEntry;
+
+typedef struct {
+    uint8_t opcode;
+    // Name of a global or a property, index of an upvalue
+    uintptr_t key;
+    int object;
+    int value;
+} Available;
+
+typedef struct {
+    IrFunction* ir;
+    bool final;
+
+    StackEntry* stack;
+    int depth;
+    int capacity;
+
+    // Loads whose result is known at this point of the block
+    Available* available;
+    int availableCount;
+    int availableCapacity;
+} BlockState;
+
+typedef struct {
+    bool calls;
+    bool classes;
+    // Globals, upvalues and properties stored to, keyed like the loads
+    Available* written;
+    int writtenCount;
+    int writtenCapacity;
+} LoopEffects;
+
+static uint16_t readShort(const Chunk* chunk, const int offset) {
+    return (uint16_t) (chunk->code[offset] << 8 | chunk->code[offset + 1]);
+}
+
+static bool isJump(const uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_LOOP
+           || opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_TRUE;
+}
+
+// In-place updates skip the stack code following them when they succeed
+static bool isUpdate(const uint8_t opcode) {
+    return opcode == OP_UPDATE_PROPERTY || opcode == OP_UPDATE_INDEX
+           || opcode == OP_UPDATE_GLOBAL || opcode == OP_UPDATE_UPVALUE;
+}
+
+// Counting loops jump to the body when they succeed, skipping the
+// generic code following them
+static bool isCountingLoop(const uint8_t opcode) {
+    return opcode == OP_FOR_PREP || opcode == OP_FOR_LOOP;
+}
+
+// Values below the operand of an in-place update locating its target
+static int updateTargetDepth(const uint8_t opcode) {
+    switch (opcode) {
+    case OP_UPDATE_PROPERTY: return 1;
+    case OP_UPDATE_INDEX: return 2;
+    default: return 0;
+    }
+}
+
+// Execution never continues with the next instruction
+static bool endsFlow(const uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_LOOP || opcode == OP_RETURN
+           || opcode == OP_THROW || opcode == OP_PROPAGATE_EXCEPTION;
+}
+
+static bool isLocalAccess(const uint8_t opcode) {
+    return opcode == OP_GET_LOCAL || opcode == OP_SET_LOCAL || opcode == OP_SET_LOCAL_POP;
+}
+
+static int newValue(IrFunction* ir, const int block, const IrType type) {
+    if (ir->valueCapacity < ir->valueCount + 1) {
+        const int oldCapacity = ir->valueCapacity;
+        ir->valueCapacity = GROW_CAPACITY(oldCapacity);
+        ir->values = GROW_ARRAY(IrValue, ir->values, oldCapacity, ir->valueCapacity);
+    }
+    ir->values[ir->valueCount] = (IrValue){.block = block, .type = type};
+    return ir->valueCount++;
+}
+
+static uintptr_t nameKey(const IrFunction* ir, const int i) {
+    const IrInstruction* instruction = &ir->instructions[i];
+    const Value name = ir->chunk->constants.values[ir->chunk->code[instruction->offset + 1]];
+    return (uintptr_t) AS_OBJ(name);
+}
+
+static bool decode(IrFunction* ir) {
+    const Chunk* chunk = ir->chunk;
+
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        count++;
+    }
+
+    int* indexAt = ALLOCATE(int, chunk->count + 1);
+    for (int offset = 0; offset <= chunk->count; offset++) indexAt[offset] = NONE;
+    ir->instructions = ALLOCATE(IrInstruction, count);
+    ir->count = count;
+
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+        IrInstruction* instruction = &ir->instructions[i];
+        *instruction = (IrInstruction){
+            .opcode = chunk->code[offset],
+            .offset = offset,
+            .length = instructionLength(chunk, offset),
+            .line = getLine(ir->chunk, offset),
+            .target = NONE,
+            .handler = NONE,
+            .finally = NONE,
+            .result = NONE,
+            .spanStart = NONE,
+            .operand = NONE,
+            .base = NONE,
+            .consumer = NONE,
+            .loadSlot = NONE,
+            .storeSlot = NONE,
+        };
+        indexAt[offset] = i;
+        offset += instruction->length;
+    }
+
+    const int arity = ir->function->arity;
+    ir->maxSlot = arity;
+    for (int i = 0; i < count; i++) {
+        IrInstruction* instruction = &ir->instructions[i];
+        const int start = instruction->offset;
+        const int next = start + instruction->length;
+
+        if (instruction->opcode == OP_LOOP) {
+            instruction->target = indexAt[next - readShort(chunk, start + 1)];
+        } else if (isJump(instruction->opcode)) {
+            const int target = next + readShort(chunk, start + 1);
+            instruction->target = target < chunk->count ? indexAt[target] : NONE;
+        } else if (isUpdate(instruction->opcode) || isCountingLoop(instruction->opcode)) {
+            const int target = next + readShort(chunk, next - 2);
+            instruction->target = target < chunk->count ? indexAt[target] : NONE;
+            if (instruction->target == NONE) ir->failed = true;
+            if (isCountingLoop(instruction->opcode)) {
+                const int counter = chunk->code[start + 1];
+                const bool constant = chunk->code[start + 2] & FOR_LIMIT_CONSTANT;
+                const int limit = constant ? counter : chunk->code[start + 3];
+                if (counter > ir->maxSlot) ir->maxSlot = counter;
+                if (limit > ir->maxSlot) ir->maxSlot = limit;
+            }
+        } else if (instruction->opcode == OP_SWITCH_DENSE || instruction->opcode == OP_SWITCH_HASHED) {
+            // Blocks have room for a few successors, not a table of them
+            ir->failed = true;
+        } else if (instruction->opcode == OP_PUSH_EXCEPTION_HANDLER) {
+            const uint16_t handler = readShort(chunk, start + 2);
+            const uint16_t finally = readShort(chunk, start + 4);
+            if (handler != NO_ADDRESS) instruction->handler = handler < chunk->count ? indexAt[handler] : NONE;
+            if (finally != NO_ADDRESS) instruction->finally = finally < chunk->count ? indexAt[finally] : NONE;
+            if ((handler != NO_ADDRESS && instruction->handler == NONE)
+                || (finally != NO_ADDRESS && instruction->finally == NONE)) {
+                ir->failed = true;
+            }
+        } else if (isLocalAccess(instruction->opcode)) {
+            const int slot = chunk->code[start + 1];
+            if (slot > ir->maxSlot) ir->maxSlot = slot;
+        } else if (instruction->opcode == OP_CLOSURE) {
+            for (int operand = start + 2; operand < next; operand += 2) {
+                if (!chunk->code[operand]) continue;
+                const int slot = chunk->code[operand + 1];
+                ir->captured[slot] = true;
+                if (slot > ir->maxSlot) ir->maxSlot = slot;
+            }
+        }
+
+        if (isJump(instruction->opcode) && instruction->target == NONE) ir->failed = true;
+    }
+
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+
+    // Instruction results come first among the values
+    ir->valueCapacity = count;
+    ir->valueCount = count;
+    ir->values = ALLOCATE(IrValue, count);
+    for (int i = 0; i < count; i++) {
+        ir->values[i] = (IrValue){.block = NONE, .type = TYPE_UNKNOWN};
+    }
+
+    return !ir->failed;
+}
+
+static void addSuccessor(IrBlock* block, const int successor) {
+    for (int i = 0; i < block->successorCount; i++) {
+        if (block->successors[i] == successor) return;
+    }
+    block->successors[block->successorCount++] = successor;
+}
+
+static void findBlocks(IrFunction* ir) {
+    const int count = ir->count;
+    bool* leader = ALLOCATE(bool, count + 1);
+    for (int i = 0; i <= count; i++) leader[i] = false;
+    leader[0] = true;
+
+    for (int i = 0; i < count; i++) {
+        const IrInstruction* instruction = &ir->instructions[i];
+        if (instruction->target != NONE) leader[instruction->target] = true;
+        if (instruction->handler != NONE) leader[instruction->handler] = true;
+        if (instruction->finally != NONE) leader[instruction->finally] = true;
+        if (isJump(instruction->opcode) || isUpdate(instruction->opcode)
+            || isCountingLoop(instruction->opcode) || endsFlow(instruction->opcode)) {
+            leader[i + 1] = true;
+        }
+    }
+
+    int blockCount = 0;
+    for (int i = 0; i < count; i++) {
+        if (leader[i]) blockCount++;
+    }
+
+    ir->blocks = ALLOCATE(IrBlock, blockCount);
+    ir->blockCount = blockCount;
+    ir->blockOf = ALLOCATE(int, count);
+
+    int b = NONE;
+    for (int i = 0; i < count; i++) {
+        if (leader[i]) {
+            b++;
+            ir->blocks[b] = (IrBlock){.start = i, .depth = NONE};
+        }
+        ir->blocks[b].end = i + 1;
+        ir->blockOf[i] = b;
+        ir->instructions[i].block = b;
+        ir->values[i].block = b;
+    }
+    FREE_ARRAY(bool, leader, count + 1);
+
+    for (b = 0; b < blockCount; b++) {
+        IrBlock* block = &ir->blocks[b];
+        for (int i = block->start; i < block->end; i++) {
+            const IrInstruction* instruction = &ir->instructions[i];
+            if (instruction->handler != NONE) addSuccessor(block, ir->blockOf[instruction->handler]);
+            if (instruction->finally != NONE) addSuccessor(block, ir->blockOf[instruction->finally]);
+        }
+        const IrInstruction* last = &ir->instructions[block->end - 1];
+        if (last->target != NONE) addSuccessor(block, ir->blockOf[last->target]);
+        if (!endsFlow(last->opcode) && block->end < count) addSuccessor(block, b + 1);
+    }
+}
+
+static void setEntry(IrFunction* ir, IrBlock* block, const int depth) {
+    block->depth = depth;
+    block->entry = ALLOCATE(int, depth);
+    block->phis = ALLOCATE(int, depth);
+    for (int slot = 0; slot < depth; slot++) block->phis[slot] = NONE;
+    ir->changed = true;
+}
+
+static int phiOf(IrFunction* ir, const int b, const int slot) {
+    if (ir->blocks[b].phis[slot] == NONE) {
+        const int phi = newValue(ir, b, TYPE_UNKNOWN);
+        ir->blocks[b].phis[slot] = phi;
+    }
+    return ir->blocks[b].phis[slot];
+}
+
+static void mergeInto(IrFunction* ir, const int b, const StackEntry* stack, const int depth) {
+    IrBlock* block = &ir->blocks[b];
+    if (block->handler) {
+        ir->failed = true;
+        return;
+    }
+
+    if (block->depth == NONE) {
+        setEntry(ir, block, depth);
+        for (int slot = 0; slot < depth; slot++) block->entry[slot] = stack[slot].value;
+        return;
+    }
+
+    // The code keeps the stack balanced on every path, except where a catch
+    // without a variable or a finally clause leave the exception behind
+    if (block->depth != depth) {
+        ir->failed = true;
+        return;
+    }
+
+    for (int slot = 0; slot < depth; slot++) {
+        if (block->entry[slot] != stack[slot].value && block->entry[slot] != block->phis[slot]) {
+            block->entry[slot] = phiOf(ir, b, slot);
+            ir->changed = true;
+        }
+    }
+}
+
+// Anything could have changed before the exception was thrown, so all
+// the slots are unknown on entry
+static void enterHandler(IrFunction* ir, const int b, const int depth) {
+    IrBlock* block = &ir->blocks[b];
+    if (block->depth == NONE) {
+        setEntry(ir, block, depth);
+        block->handler = true;
+        for (int slot = 0; slot < depth; slot++) block->entry[slot] = phiOf(ir, b, slot);
+        return;
+    }
+    if (!block->handler || block->depth != depth) ir->failed = true;
+}
+
+static void pushEntry(BlockState* state, const int value, const int producer, const int spanStart) {
+    if (state->capacity < state->depth + 1) {
+        const int oldCapacity = state->capacity;
+        state->capacity = GROW_CAPACITY(oldCapacity);
+        state->stack = GROW_ARRAY(StackEntry, state->stack, oldCapacity, state->capacity);
+    }
+    state->stack[state->depth++] = (StackEntry){
+        .value = value,
+        .producer = producer,
+        .spanStart = spanStart,
+    };
+}
+
+static const StackEntry* peekEntry(const BlockState* state, const int distance) {
+    if (state->depth <= distance) {
+        state->ir->failed = true;
+        return NULL;
+    }
+    return &state->stack[state->depth - 1 - distance];
+}
+
+// Pops the operands of instruction i, returning where the code that
+// computed them starts, NONE if some of it is outside the block
+static int popOperands(BlockState* state, const int count, const int i) {
+    if (state->depth < count) {
+        state->ir->failed = true;
+        return NONE;
+    }
+
+    int spanStart = count == 0 ? i : state->stack[state->depth - count].spanStart;
+    for (int operand = 0; operand < count; operand++) {
+        const StackEntry* entry = &state->stack[--state->depth];
+        if (entry->spanStart == NONE) spanStart = NONE;
+        if (state->final && entry->producer != NONE) {
+            state->ir->instructions[entry->producer].consumer = i;
+        }
+    }
+    return spanStart;
+}
+
+static void pushResult(BlockState* state, const int i, const int value, const int spanStart) {
+    pushEntry(state, value, i, spanStart);
+    if (state->final) {
+        state->ir->instructions[i].result = value;
+        state->ir->instructions[i].spanStart = spanStart;
+    }
+}
+
+// Pushes a value the instruction creates
+static void pushNew(BlockState* state, const int i, const IrType type, const int spanStart) {
+    state->ir->values[i].type = type;
+    pushResult(state, i, i, spanStart);
+}
+
+static IrType typeOf(const BlockState* state, const StackEntry* entry) {
+    return state->ir->values[entry->value].type;
+}
+
+static int findAvailable(const BlockState* state, const uint8_t opcode, const uintptr_t key, const int object) {
+    for (int i = 0; i < state->availableCount; i++) {
+        const Available* available = &state->available[i];
+        if (available->opcode == opcode && available->key == key && available->object == object) {
+            return available->value;
+        }
+    }
+    return NONE;
+}
+
+static void addAvailable(BlockState* state, const uint8_t opcode, const uintptr_t key,
+                         const int object, const int value) {
+    if (state->availableCapacity < state->availableCount + 1) {
+        const int oldCapacity = state->availableCapacity;
+        state->availableCapacity = GROW_CAPACITY(oldCapacity);
+        state->available = GROW_ARRAY(Available, state->available, oldCapacity, state->availableCapacity);
+    }
+    state->available[state->availableCount++] = (Available){
+        .opcode = opcode,
+        .key = key,
+        .object = object,
+        .value = value,
+    };
+}
+
+// Forgets the loads a store may change, all of them when the opcode is
+// OP_LAST. Properties of strings never change
+static void killAvailable(BlockState* state, const uint8_t opcode, const bool anyKey, const uintptr_t key) {
+    int kept = 0;
+    for (int i = 0; i < state->availableCount; i++) {
+        const Available* available = &state->available[i];
+        const bool matches = (opcode == OP_LAST || available->opcode == opcode)
+                             && (anyKey || available->key == key);
+        const bool immutable = available->opcode == OP_GET_PROPERTY
+                               && state->ir->values[available->object].type == TYPE_STRING;
+        if (!matches || immutable) state->available[kept++] = *available;
+    }
+    state->availableCount = kept;
+}
+
+// A load of a global, upvalue or property, reusing the value of an
+// earlier load of the same thing
+static void pushLoad(BlockState* state, const int i, const uintptr_t key,
+                     const int object, const int spanStart) {
+    const uint8_t opcode = state->ir->instructions[i].opcode;
+    const int value = findAvailable(state, opcode, key, object);
+    if (state->final) state->ir->instructions[i].repeated = value != NONE;
+
+    if (value != NONE) {
+        pushResult(state, i, value, spanStart);
+    } else {
+        addAvailable(state, opcode, key, object, i);
+        pushNew(state, i, TYPE_UNKNOWN, spanStart);
+    }
+}
+
+static IrType constantType(const Value constant) {
+    if (IS_STRING(constant)) return TYPE_STRING;
+    if (IS_NUMBER(constant)) return TYPE_NUMBER;
+    if (IS_BOOL(constant)) return TYPE_BOOL;
+    if (IS_NIL(constant)) return TYPE_NIL;
+    return TYPE_UNKNOWN;
+}
+
+static void simulateInstruction(BlockState* state, const int i) {
+    IrFunction* ir = state->ir;
+    IrInstruction* instruction = &ir->instructions[i];
+    const uint8_t* operands = &ir->chunk->code[instruction->offset + 1];
+
+    switch (instruction->opcode) {
+    case OP_CONSTANT:
+        pushNew(state, i, constantType(ir->chunk->constants.values[operands[0]]), i);
+        break;
+    case OP_CONSTANT_ZERO:
+    case OP_CONSTANT_ONE:
+    case OP_CONSTANT_TWO: pushNew(state, i, TYPE_NUMBER, i);
+        break;
+    case OP_NIL: pushNew(state, i, TYPE_NIL, i);
+        break;
+    case OP_TRUE:
+    case OP_FALSE: pushNew(state, i, TYPE_BOOL, i);
+        break;
+    case OP_POP:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE: popOperands(state, 1, i);
+        break;
+    case OP_DUP: {
+        const StackEntry* top = peekEntry(state, 0);
+        if (top != NULL) pushResult(state, i, top->value, i);
+        break;
+    }
+    case OP_DUP_PAIR: {
+        const StackEntry* second = peekEntry(state, 0);
+        const StackEntry* first = peekEntry(state, 1);
+        if (first == NULL || second == NULL) break;
+        const int firstValue = first->value;
+        const int secondValue = second->value;
+        pushEntry(state, firstValue, NONE, NONE);
+        pushEntry(state, secondValue, NONE, NONE);
+        break;
+    }
+    case OP_GET_LOCAL: {
+        const int slot = operands[0];
+        if (slot >= state->depth) {
+            ir->failed = true;
+        } else if (ir->captured[slot]) {
+            pushNew(state, i, TYPE_UNKNOWN, i);
+        } else {
+            pushResult(state, i, state->stack[slot].value, i);
+        }
+        break;
+    }
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP: {
+        const int slot = operands[0];
+        const StackEntry* top = peekEntry(state, 0);
+        if (top == NULL || slot >= state->depth - 1) {
+            ir->failed = true;
+            break;
+        }
+        state->stack[slot].value = top->value;
+        if (instruction->opcode == OP_SET_LOCAL_POP) popOperands(state, 1, i);
+        break;
+    }
+    case OP_GET_GLOBAL: pushLoad(state, i, nameKey(ir, i), NONE, i);
+        break;
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_CONSTANT:
+        popOperands(state, 1, i);
+        killAvailable(state, OP_GET_GLOBAL, false, nameKey(ir, i));
+        break;
+    case OP_SET_GLOBAL: killAvailable(state, OP_GET_GLOBAL, false, nameKey(ir, i));
+        break;
+    case OP_GET_UPVALUE: pushLoad(state, i, operands[0], NONE, i);
+        break;
+    case OP_SET_UPVALUE: killAvailable(state, OP_GET_UPVALUE, false, operands[0]);
+        break;
+    case OP_STATIC_FIELD:
+        popOperands(state, 1, i);
+        killAvailable(state, OP_GET_PROPERTY, false, nameKey(ir, i));
+        break;
+    case OP_GET_PROPERTY: {
+        const StackEntry* object = peekEntry(state, 0);
+        if (object == NULL) break;
+        const int value = object->value;
+        if (state->final) instruction->operand = object->producer;
+        const int spanStart = popOperands(state, 1, i);
+        pushLoad(state, i, nameKey(ir, i), value, spanStart);
+        break;
+    }
+    case OP_SET_PROPERTY:
+    case OP_SET_INDEX: {
+        // The stored value is what is left on the stack
+        const StackEntry* stored = peekEntry(state, 0);
+        if (stored == NULL) break;
+        const int value = stored->value;
+        const int spanStart = popOperands(state, instruction->opcode == OP_SET_PROPERTY ? 2 : 3, i);
+        pushResult(state, i, value, spanStart);
+        if (instruction->opcode == OP_SET_PROPERTY) {
+            killAvailable(state, OP_GET_PROPERTY, false, nameKey(ir, i));
+        }
+        break;
+    }
+    // Falling through to the stack code, the operand is dropped. The
+    // skip to after it is seen to by simulateBlock
+    case OP_UPDATE_PROPERTY:
+        popOperands(state, 1, i);
+        killAvailable(state, OP_GET_PROPERTY, false, nameKey(ir, i));
+        break;
+    case OP_UPDATE_INDEX: popOperands(state, 1, i);
+        break;
+    case OP_UPDATE_GLOBAL:
+        popOperands(state, 1, i);
+        killAvailable(state, OP_GET_GLOBAL, false, nameKey(ir, i));
+        break;
+    case OP_UPDATE_UPVALUE:
+        popOperands(state, 1, i);
+        killAvailable(state, OP_GET_UPVALUE, false, operands[0]);
+        break;
+    // Only the jump to the body changes the counter, which simulateBlock
+    // sees to
+    case OP_FOR_PREP:
+    case OP_FOR_LOOP: {
+        const int counter = operands[0];
+        const int limit = operands[1] & FOR_LIMIT_CONSTANT ? counter : operands[2];
+        if (counter >= state->depth || limit >= state->depth) ir->failed = true;
+        if (instruction->opcode == OP_FOR_LOOP) ir->values[i].type = TYPE_NUMBER;
+        break;
+    }
+    case OP_GET_INDEX:
+    case OP_GET_SUPER: pushNew(state, i, TYPE_UNKNOWN, popOperands(state, 2, i));
+        break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS: pushNew(state, i, TYPE_BOOL, popOperands(state, 2, i));
+        break;
+    case OP_ADD: {
+        const StackEntry* b = peekEntry(state, 0);
+        const StackEntry* a = peekEntry(state, 1);
+        if (a == NULL || b == NULL) break;
+        // Anything added to a string that doesn't fail makes a string
+        IrType type = TYPE_UNKNOWN;
+        if (typeOf(state, a) == TYPE_STRING || typeOf(state, b) == TYPE_STRING) {
+            type = TYPE_STRING;
+        } else if (typeOf(state, a) == TYPE_NUMBER && typeOf(state, b) == TYPE_NUMBER) {
+            type = TYPE_NUMBER;
+        }
+        pushNew(state, i, type, popOperands(state, 2, i));
+        break;
+    }
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULUS:
+    case OP_EXPONENT: pushNew(state, i, TYPE_NUMBER, popOperands(state, 2, i));
+        break;
+    case OP_NOT: pushNew(state, i, TYPE_BOOL, popOperands(state, 1, i));
+        break;
+    case OP_NEGATE: pushNew(state, i, TYPE_NUMBER, popOperands(state, 1, i));
+        break;
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE: {
+        // The receiver or callee and the arguments, and the superclass
+        int count = 1 + operands[instruction->opcode == OP_CALL ? 0 : 1];
+        if (instruction->opcode == OP_SUPER_INVOKE) count++;
+        const StackEntry* callee = peekEntry(state, count - 1);
+        if (callee == NULL) break;
+        if (state->final) {
+            instruction->operand = callee->producer;
+            instruction->base = state->depth - count;
+        }
+        pushNew(state, i, TYPE_UNKNOWN, popOperands(state, count, i));
+        killAvailable(state, OP_LAST, true, 0);
+        break;
+    }
+    case OP_ARRAY:
+        pushNew(state, i, TYPE_UNKNOWN, popOperands(state, readShort(ir->chunk, instruction->offset + 1), i));
+        break;
+    case OP_CLOSURE:
+    case OP_CLASS: pushNew(state, i, TYPE_UNKNOWN, i);
+        break;
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_STATIC_METHOD:
+        popOperands(state, 1, i);
+        killAvailable(state, OP_GET_PROPERTY, true, 0);
+        break;
+    case OP_PUSH_EXCEPTION_HANDLER:
+        if (instruction->handler != NONE) {
+            enterHandler(ir, ir->blockOf[instruction->handler], state->depth + 1);
+        }
+        if (instruction->finally != NONE) {
+            // The exception and the flag telling the finally clause to rethrow
+            enterHandler(ir, ir->blockOf[instruction->finally], state->depth + 2);
+        }
+        break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP:
+    case OP_RETURN:
+    case OP_THROW:
+    case OP_POP_EXCEPTION_HANDLER:
+    case OP_PROPAGATE_EXCEPTION: break;
+    default: ir->failed = true;
+    }
+}
+
+static void simulateBlock(IrFunction* ir, const int b, const bool final) {
+    const IrBlock* block = &ir->blocks[b];
+    BlockState state = {.ir = ir, .final = final};
+    for (int slot = 0; slot < block->depth; slot++) {
+        pushEntry(&state, block->entry[slot], NONE, NONE);
+    }
+
+    for (int i = block->start; i < block->end && !ir->failed; i++) {
+        simulateInstruction(&state, i);
+    }
+
+    if (!ir->failed) {
+        const IrInstruction* last = &ir->instructions[block->end - 1];
+        if (!endsFlow(last->opcode) && block->end < ir->count) {
+            mergeInto(ir, b + 1, state.stack, state.depth);
+        }
+        if (isJump(last->opcode)) mergeInto(ir, ir->blockOf[last->target], state.stack, state.depth);
+        if (isUpdate(last->opcode)) {
+            // Done in place, the result takes the place of the values
+            // locating the target
+            const int targetDepth = updateTargetDepth(last->opcode);
+            if (state.depth < targetDepth) {
+                ir->failed = true;
+            } else {
+                state.depth -= targetDepth;
+                pushEntry(&state, block->end - 1, NONE, NONE);
+                mergeInto(ir, ir->blockOf[last->target], state.stack, state.depth);
+            }
+        }
+        if (isCountingLoop(last->opcode)) {
+            // The counter the body gets is the one OP_FOR_LOOP stepped
+            if (last->opcode == OP_FOR_LOOP) {
+                state.stack[ir->chunk->code[last->offset + 1]].value = block->end - 1;
+            }
+            mergeInto(ir, ir->blockOf[last->target], state.stack, state.depth);
+        }
+    }
+
+    FREE_ARRAY(StackEntry, state.stack, state.capacity);
+    FREE_ARRAY(Available, state.available, state.availableCapacity);
+}
+
+// Propagates the stack contents through the blocks until they settle.
+// A slot only ever goes from a single value to a phi, so this ends
+static bool analyze(IrFunction* ir) {
+    IrBlock* entry = &ir->blocks[0];
+    setEntry(ir, entry, ir->function->arity + 1);
+    for (int slot = 0; slot < entry->depth; slot++) {
+        entry->entry[slot] = newValue(ir, NONE, TYPE_UNKNOWN);
+    }
+
+    while (ir->changed && !ir->failed) {
+        ir->changed = false;
+        for (int b = 0; b < ir->blockCount && !ir->failed; b++) {
+            if (ir->blocks[b].depth != NONE) simulateBlock(ir, b, false);
+        }
+    }
+
+    for (int b = 0; b < ir->blockCount && !ir->failed; b++) {
+        if (ir->blocks[b].depth != NONE) simulateBlock(ir, b, true);
+    }
+    return !ir->failed;
+}
+
+// Code whose only effect is pushing a value, given it ran without an
+// error once before
+static bool isPureSpan(const IrFunction* ir, const int start, const int end) {
+    for (int i = start; i <= end; i++) {
+        switch (ir->instructions[i].opcode) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_ZERO:
+        case OP_CONSTANT_ONE:
+        case OP_CONSTANT_TWO:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_DUP:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_GLOBAL:
+        case OP_GET_PROPERTY: break;
+        default: return false;
+        }
+    }
+    return true;
+}
+
+// Replaces property loads repeated within a block by a load of a hidden
+// slot the first one is kept in. Returns the hidden slots any block needs
+static int eliminateRepeatedLoads(IrFunction* ir) {
+    int slots = 0;
+    for (int b = 0; b < ir->blockCount; b++) {
+        const IrBlock* block = &ir->blocks[b];
+        if (block->depth == NONE) continue;
+
+        int used = 0;
+        for (int i = block->start; i < block->end; i++) {
+            IrInstruction* load = &ir->instructions[i];
+            if (!load->repeated || load->opcode != OP_GET_PROPERTY || load->spanStart == NONE) continue;
+
+            // An enclosing repeated load takes this one along
+            if (load->consumer != NONE) {
+                const IrInstruction* consumer = &ir->instructions[load->consumer];
+                if (consumer->repeated && consumer->opcode == OP_GET_PROPERTY) continue;
+            }
+            if (!isPureSpan(ir, load->spanStart, i)) continue;
+
+            IrInstruction* first = &ir->instructions[load->result];
+            if (first->storeSlot == NONE) first->storeSlot = used++;
+            load->loadSlot = first->storeSlot;
+            for (int dropped = load->spanStart; dropped < i; dropped++) {
+                ir->instructions[dropped].dropped = true;
+            }
+        }
+        if (used > slots) slots = used;
+    }
+    return slots;
+}
+
+static void buildPredecessors(const IrFunction* ir, int* predecessorStart, int* predecessors) {
+    for (int b = 0; b <= ir->blockCount; b++) predecessorStart[b] = 0;
+    for (int b = 0; b < ir->blockCount; b++) {
+        const IrBlock* block = &ir->blocks[b];
+        if (block->depth == NONE) continue;
+        for (int s = 0; s < block->successorCount; s++) predecessorStart[block->successors[s] + 1]++;
+    }
+    for (int b = 0; b < ir->blockCount; b++) predecessorStart[b + 1] += predecessorStart[b];
+
+    int* filled = ALLOCATE(int, ir->blockCount);
+    for (int b = 0; b < ir->blockCount; b++) filled[b] = predecessorStart[b];
+    for (int b = 0; b < ir->blockCount; b++) {
+        const IrBlock* block = &ir->blocks[b];
+        if (block->depth == NONE) continue;
+        for (int s = 0; s < block->successorCount; s++) {
+            predecessors[filled[block->successors[s]]++] = b;
+        }
+    }
+    FREE_ARRAY(int, filled, ir->blockCount);
+}
+
+// Marks the blocks of the natural loop with the given header, if there
+// is one. The walk back from the jumps to the header must not get to the
+// function entry without passing the header
+static bool findLoop(const IrFunction* ir, const int header, const int* predecessorStart,
+                     const int* predecessors, bool* loop, int* worklist) {
+    for (int b = 0; b < ir->blockCount; b++) loop[b] = false;
+    loop[header] = true;
+
+    int pending = 0;
+    for (int b = header; b < ir->blockCount; b++) {
+        const IrBlock* block = &ir->blocks[b];
+        if (block->depth == NONE) continue;
+        for (int s = 0; s < block->successorCount; s++) {
+            if (block->successors[s] == header && !loop[b]) {
+                loop[b] = true;
+                worklist[pending++] = b;
+            }
+        }
+    }
+    const bool backEdge = pending > 0 || loop[header];
+    if (pending == 0) return false;
+
+    while (pending > 0) {
+        const int b = worklist[--pending];
+        for (int p = predecessorStart[b]; p < predecessorStart[b + 1]; p++) {
+            const int predecessor = predecessors[p];
+            if (!loop[predecessor]) {
+                loop[predecessor] = true;
+                worklist[pending++] = predecessor;
+            }
+        }
+    }
+    return backEdge && (header == 0 || !loop[0]);
+}
+
+static void addWritten(LoopEffects* effects, const uint8_t opcode, const uintptr_t key) {
+    if (effects->writtenCapacity < effects->writtenCount + 1) {
+        const int oldCapacity = effects->writtenCapacity;
+        effects->writtenCapacity = GROW_CAPACITY(oldCapacity);
+        effects->written = GROW_ARRAY(Available, effects->written, oldCapacity, effects->writtenCapacity);
+    }
+    effects->written[effects->writtenCount++] = (Available){.opcode = opcode, .key = key};
+}
+
+static bool isWritten(const LoopEffects* effects, const uint8_t opcode, const uintptr_t key) {
+    for (int i = 0; i < effects->writtenCount; i++) {
+        if (effects->written[i].opcode == opcode && effects->written[i].key == key) return true;
+    }
+    return false;
+}
+
+static void findLoopEffects(const IrFunction* ir, const bool* loop, LoopEffects* effects) {
+    for (int b = 0; b < ir->blockCount; b++) {
+        if (!loop[b]) continue;
+        const IrBlock* block = &ir->blocks[b];
+        for (int i = block->start; i < block->end; i++) {
+            const IrInstruction* instruction = &ir->instructions[i];
+            switch (instruction->opcode) {
+            case OP_CALL:
+            case OP_INVOKE:
+            case OP_SUPER_INVOKE: effects->calls = true;
+                break;
+            case OP_INHERIT:
+            case OP_METHOD:
+            case OP_STATIC_METHOD: effects->classes = true;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_CONSTANT:
+            case OP_SET_GLOBAL:
+            case OP_UPDATE_GLOBAL: addWritten(effects, OP_GET_GLOBAL, nameKey(ir, i));
+                break;
+            case OP_SET_UPVALUE:
+            case OP_UPDATE_UPVALUE:
+                addWritten(effects, OP_GET_UPVALUE, ir->chunk->code[instruction->offset + 1]);
+                break;
+            case OP_SET_PROPERTY:
+            case OP_UPDATE_PROPERTY:
+            case OP_STATIC_FIELD: addWritten(effects, OP_GET_PROPERTY, nameKey(ir, i));
+                break;
+            default: ;
+            }
+        }
+    }
+}
+
+static bool isInvariant(const IrFunction* ir, const int i, const bool* loop,
+                        const LoopEffects* effects, const bool* invariant) {
+    const IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->dropped || instruction->loadSlot != NONE || instruction->storeSlot != NONE) {
+        return false;
+    }
+
+    switch (instruction->opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_ZERO:
+    case OP_CONSTANT_ONE:
+    case OP_CONSTANT_TWO:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE: return true;
+    case OP_GET_LOCAL: {
+        const int block = ir->values[instruction->result].block;
+        return block == NONE || !loop[block];
+    }
+    case OP_GET_GLOBAL:
+        return !effects->calls && !isWritten(effects, OP_GET_GLOBAL, nameKey(ir, i));
+    case OP_GET_UPVALUE:
+        return !effects->calls
+               && !isWritten(effects, OP_GET_UPVALUE, ir->chunk->code[instruction->offset + 1]);
+    case OP_GET_PROPERTY: {
+        const int operand = instruction->operand;
+        if (operand == NONE || !invariant[operand]) return false;
+        if (ir->values[ir->instructions[operand].result].type == TYPE_STRING) return true;
+        return !effects->calls && !effects->classes
+               && !isWritten(effects, OP_GET_PROPERTY, nameKey(ir, i));
+    }
+    default: return false;
+    }
+}
+
+// Code in the header that may run after the hoisted loads without
+// changing what they see or whether they fail
+static bool isSafeBefore(const IrInstruction* instruction) {
+    if (instruction->dropped || instruction->loadSlot != NONE) return true;
+    switch (instruction->opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_ZERO:
+    case OP_CONSTANT_ONE:
+    case OP_CONSTANT_TWO:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+    case OP_GET_UPVALUE: return true;
+    default: return false;
+    }
+}
+
+// Only the header runs on every iteration before anything else in the
+// loop, so loads that can fail are hoisted from there alone. Returns
+// the hidden slots taken, starting from the given one
+static int hoistFromHeader(IrFunction* ir, const int header, const bool* loop,
+                           const LoopEffects* effects, const int firstSlot) {
+    const IrBlock* block = &ir->blocks[header];
+    bool* invariant = ALLOCATE(bool, ir->count);
+    for (int i = block->start; i < block->end; i++) invariant[i] = false;
+
+    int hoisted = 0;
+    for (int i = block->start; i < block->end; i++) {
+        IrInstruction* instruction = &ir->instructions[i];
+        invariant[i] = isInvariant(ir, i, loop, effects, invariant);
+        if (!invariant[i]) {
+            if (isSafeBefore(instruction)) continue;
+            break;
+        }
+
+        const bool load = instruction->opcode == OP_GET_GLOBAL || instruction->opcode == OP_GET_PROPERTY;
+        const bool outermost = instruction->consumer == NONE
+                               || !isInvariant(ir, instruction->consumer, loop, effects, invariant);
+        if (!load || !outermost || instruction->spanStart == NONE) continue;
+
+        instruction->hoisted = true;
+        instruction->loadSlot = firstSlot + hoisted++;
+        for (int dropped = instruction->spanStart; dropped < i; dropped++) {
+            ir->instructions[dropped].dropped = true;
+        }
+    }
+
+    FREE_ARRAY(bool, invariant, ir->count);
+    return hoisted;
+}
+
+static bool fallsThrough(const IrFunction* ir, const int b) {
+    const IrBlock* block = &ir->blocks[b];
+    return block->depth != NONE && !endsFlow(ir->instructions[block->end - 1].opcode);
+}
+
+// Moves loop invariant global and property loads in front of the loops.
+// Returns the hidden slots the values are kept in
+static int hoistLoopInvariants(IrFunction* ir, const int firstSlot) {
+    const int blockCount = ir->blockCount;
+    int* predecessorStart = ALLOCATE(int, blockCount + 1);
+    int* predecessors = ALLOCATE(int, blockCount * 4);
+    int* worklist = ALLOCATE(int, blockCount);
+    bool* loop = ALLOCATE(bool, blockCount);
+    buildPredecessors(ir, predecessorStart, predecessors);
+
+    int hoisted = 0;
+    for (int header = 0; header < blockCount; header++) {
+        IrBlock* block = &ir->blocks[header];
+        if (block->depth == NONE || block->handler) continue;
+        if (!findLoop(ir, header, predecessorStart, predecessors, loop, worklist)) continue;
+        // The hoisted code goes right in front of the header, so the
+        // block falling into it must be outside the loop
+        if (header > 0 && loop[header - 1] && fallsThrough(ir, header - 1)) continue;
+
+        LoopEffects effects = {0};
+        findLoopEffects(ir, loop, &effects);
+        const int count = hoistFromHeader(ir, header, loop, &effects, firstSlot + hoisted);
+        FREE_ARRAY(Available, effects.written, effects.writtenCapacity);
+        if (count == 0) continue;
+
+        hoisted += count;
+        block->loop = ALLOCATE(bool, blockCount);
+        for (int b = 0; b < blockCount; b++) block->loop[b] = loop[b];
+    }
+
+    FREE_ARRAY(int, predecessorStart, blockCount + 1);
+    FREE_ARRAY(int, predecessors, blockCount * 4);
+    FREE_ARRAY(int, worklist, blockCount);
+    FREE_ARRAY(bool, loop, blockCount);
+    return hoisted;
+}
+
+typedef struct {
+    const IrFunction* ir;
+    // NULL while only measuring the code
+    Chunk* code;
+    int offset;
+    int* blockStart;
+    // Where the code hoisted in front of a loop header starts
+    int* loopEntry;
+    int block;
+    bool overflow;
+} Lowering;
+
+static void emit(Lowering* lowering, const uint8_t byte, const int line) {
+    if (lowering->code != NULL) writeChunk(lowering->code, byte, line);
+    lowering->offset++;
+}
+
+static void emitShort(Lowering* lowering, const int value, const int line) {
+    if (lowering->code != NULL && (value < 0 || value > MAX_JUMP)) lowering->overflow = true;
+    emit(lowering, (value >> 8) & 0xFF, line);
+    emit(lowering, value & 0xFF, line);
+}
+
+// The hidden slots go right after the parameters, the locals move up
+static int hiddenSlot(const IrFunction* ir, const int index) {
+    return ir->function->arity + 1 + index;
+}
+
+static int shiftSlot(const IrFunction* ir, const int slot) {
+    return slot > ir->function->arity ? slot + ir->hiddenSlots : slot;
+}
+
+static void emitSlotInstruction(Lowering* lowering, const uint8_t opcode, const int index, const int line) {
+    emit(lowering, opcode, line);
+    emit(lowering, hiddenSlot(lowering->ir, index), line);
+}
+
+static int jumpLabel(const Lowering* lowering, const int target) {
+    const int b = lowering->ir->blockOf[target];
+    const IrBlock* block = &lowering->ir->blocks[b];
+    // Entering a loop from outside runs the hoisted code first
+    if (block->loop != NULL && !block->loop[lowering->block]) return lowering->loopEntry[b];
+    return lowering->blockStart[b];
+}
+
+static void emitHandlerAddress(Lowering* lowering, const int target, const int line) {
+    if (target == NONE) {
+        emitShort(lowering, NO_ADDRESS, line);
+        return;
+    }
+    const int address = lowering->blockStart[lowering->ir->blockOf[target]];
+    if (lowering->code != NULL && address >= NO_ADDRESS) lowering->overflow = true;
+    emitShort(lowering, address, line);
+}
+
+// Adds the constant to the chunk unless it is there already. False when
+// there's no room left for it
+static bool ensureConstant(Chunk* chunk, const Value value) {
+    if (findConstant(chunk, value) != NONE) return true;
+    if (chunk->constants.count > UINT8_MAX) return false;
+    addConstant(chunk, value);
+    return true;
+}
+
+static bool hasConstantOperand(const uint8_t opcode) {
+    return opcode == OP_CONSTANT || opcode == OP_GET_GLOBAL || opcode == OP_SET_GLOBAL
+           || opcode == OP_GET_PROPERTY || opcode == OP_SET_PROPERTY;
+}
+
+// The guard checking the callee, the callee's code working on the slots
+// of the call and the return dropping them. The call itself follows as
+// the fallback. Inlining runs in a round of its own, without hidden slots
+static void emitInlined(Lowering* lowering, const IrInstruction* instruction) {
+    const IrFunction* ir = lowering->ir;
+    const InlineCandidate* inlined = instruction->inlined;
+    Chunk* callee = &inlined->function->chunk;
+    const uint8_t* code = &ir->chunk->code[instruction->offset];
+    const int line = instruction->line;
+
+    if (instruction->opcode == OP_INVOKE) {
+        emit(lowering, OP_INLINE_INVOKE, line);
+        emit(lowering, code[1], line);
+    } else {
+        emit(lowering, OP_INLINE_CALL, line);
+    }
+    emit(lowering, findConstant(ir->chunk, OBJ_VAL(inlined->function)), line);
+    emit(lowering, code[instruction->length - 1], line);
+    emitShort(lowering, inlined->length + INLINE_RETURN_LENGTH, line);
+
+    for (int offset = 0; offset < inlined->length; offset += instructionLength(callee, offset)) {
+        const uint8_t opcode = callee->code[offset];
+        const int calleeLine = getLine(callee, offset);
+        emit(lowering, opcode, calleeLine);
+        if (isLocalAccess(opcode)) {
+            emit(lowering, instruction->base + callee->code[offset + 1], calleeLine);
+        } else if (hasConstantOperand(opcode)) {
+            const Value constant = callee->constants.values[callee->code[offset + 1]];
+            emit(lowering, findConstant(ir->chunk, constant), calleeLine);
+        }
+    }
+
+    emit(lowering, OP_INLINE_RETURN, line);
+    emit(lowering, inlined->depth - 1, line);
+    emitShort(lowering, instruction->length, line);
+}
+
+static void emitInstruction(Lowering* lowering, const int i) {
+    const IrFunction* ir = lowering->ir;
+    const IrInstruction* instruction = &ir->instructions[i];
+    const uint8_t* code = &ir->chunk->code[instruction->offset];
+    const int line = instruction->line;
+
+    switch (instruction->opcode) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_LOOP: {
+        const int target = jumpLabel(lowering, instruction->target);
+        const int next = lowering->offset + 3;
+        if (target >= next || lowering->code == NULL) {
+            emit(lowering, instruction->opcode == OP_LOOP ? OP_JUMP : instruction->opcode, line);
+            emitShort(lowering, target - next, line);
+        } else {
+            // Only unconditional jumps go backwards
+            if (instruction->opcode != OP_JUMP && instruction->opcode != OP_LOOP) lowering->overflow = true;
+            emit(lowering, OP_LOOP, line);
+            emitShort(lowering, next - target, line);
+        }
+        break;
+    }
+    case OP_PUSH_EXCEPTION_HANDLER:
+        emit(lowering, code[0], line);
+        emit(lowering, code[1], line);
+        emitHandlerAddress(lowering, instruction->handler, line);
+        emitHandlerAddress(lowering, instruction->finally, line);
+        break;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+        emit(lowering, code[0], line);
+        emit(lowering, shiftSlot(ir, code[1]), line);
+        break;
+    case OP_CLOSURE:
+        emit(lowering, code[0], line);
+        emit(lowering, code[1], line);
+        for (int operand = 2; operand < instruction->length; operand += 2) {
+            const uint8_t isLocal = code[operand];
+            emit(lowering, isLocal, line);
+            emit(lowering, isLocal ? shiftSlot(ir, code[operand + 1]) : code[operand + 1], line);
+        }
+        break;
+    case OP_UPDATE_PROPERTY:
+    case OP_UPDATE_INDEX:
+    case OP_UPDATE_GLOBAL:
+    case OP_UPDATE_UPVALUE: {
+        for (int byte = 0; byte < instruction->length - 2; byte++) emit(lowering, code[byte], line);
+        const int next = lowering->offset + 2;
+        emitShort(lowering, jumpLabel(lowering, instruction->target) - next, line);
+        break;
+    }
+    case OP_FOR_PREP:
+    case OP_FOR_LOOP: {
+        emit(lowering, code[0], line);
+        emit(lowering, shiftSlot(ir, code[1]), line);
+        emit(lowering, code[2], line);
+        emit(lowering, code[2] & FOR_LIMIT_CONSTANT ? code[3] : shiftSlot(ir, code[3]), line);
+        if (instruction->opcode == OP_FOR_LOOP) emit(lowering, code[4], line);
+        const int next = lowering->offset + 2;
+        emitShort(lowering, jumpLabel(lowering, instruction->target) - next, line);
+        break;
+    }
+    case OP_CALL:
+    case OP_INVOKE:
+        if (instruction->inlined != NULL) emitInlined(lowering, instruction);
+        for (int byte = 0; byte < instruction->length; byte++) emit(lowering, code[byte], line);
+        break;
+    default:
+        for (int byte = 0; byte < instruction->length; byte++) emit(lowering, code[byte], line);
+    }
+}
+
+static void lowerCode(Lowering* lowering) {
+    const IrFunction* ir = lowering->ir;
+    lowering->offset = 0;
+
+    // Reserve the hidden slots, to be filled in before they are read
+    for (int slot = 0; slot < ir->hiddenSlots; slot++) {
+        emit(lowering, OP_NIL, ir->instructions[0].line);
+    }
+
+    for (int b = 0; b < ir->blockCount; b++) {
+        const IrBlock* block = &ir->blocks[b];
+        lowering->block = b;
+
+        if (block->loop != NULL) {
+            lowering->loopEntry[b] = lowering->offset;
+            for (int i = block->start; i < block->end; i++) {
+                const IrInstruction* instruction = &ir->instructions[i];
+                if (!instruction->hoisted) continue;
+                for (int k = instruction->spanStart; k <= i; k++) emitInstruction(lowering, k);
+                emitSlotInstruction(lowering, OP_SET_LOCAL_POP, instruction->loadSlot, instruction->line);
+            }
+        }
+
+        lowering->blockStart[b] = lowering->offset;
+        for (int i = block->start; i < block->end; i++) {
+            const IrInstruction* instruction = &ir->instructions[i];
+            if (instruction->dropped) continue;
+            if (instruction->loadSlot != NONE) {
+                emitSlotInstruction(lowering, OP_GET_LOCAL, instruction->loadSlot, instruction->line);
+            } else {
+                emitInstruction(lowering, i);
+            }
+            if (instruction->storeSlot != NONE) {
+                emitSlotInstruction(lowering, OP_SET_LOCAL, instruction->storeSlot, instruction->line);
+            }
+        }
+    }
+}
+
+// Writes the rewritten code over the chunk, unless some jump or slot no
+// longer fits its operand
+static void lower(IrFunction* ir) {
+    if (ir->maxSlot + ir->hiddenSlots > MAX_SLOT) return;
+
+    Lowering lowering = {
+        .ir = ir,
+        .blockStart = ALLOCATE(int, ir->blockCount),
+        .loopEntry = ALLOCATE(int, ir->blockCount),
+    };
+    // Instruction sizes don't depend on jump distances, so one round of
+    // measuring gives all the labels
+    lowerCode(&lowering);
+
+    Chunk code;
+    initChunk(&code);
+    lowering.code = &code;
+    lowerCode(&lowering);
+
+    FREE_ARRAY(int, lowering.blockStart, ir->blockCount);
+    FREE_ARRAY(int, lowering.loopEntry, ir->blockCount);
+
+    if (lowering.overflow) {
+        freeChunk(&code);
+        return;
+    }
+
+    Chunk* chunk = ir->chunk;
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->code = code.code;
+    chunk->count = code.count;
+    chunk->capacity = code.capacity;
+    chunk->lines = code.lines;
+    chunk->lineCount = code.lineCount;
+    chunk->lineCapacity = code.lineCapacity;
+}
+
+static void freeIr(IrFunction* ir) {
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (block->depth != NONE) {
+            FREE_ARRAY(int, block->entry, block->depth);
+            FREE_ARRAY(int, block->phis, block->depth);
+        }
+        if (block->loop != NULL) FREE_ARRAY(bool, block->loop, ir->blockCount);
+    }
+    FREE_ARRAY(IrBlock, ir->blocks, ir->blockCount);
+    FREE_ARRAY(int, ir->blockOf, ir->blocks != NULL ? ir->count : 0);
+    FREE_ARRAY(IrInstruction, ir->instructions, ir->count);
+    FREE_ARRAY(IrValue, ir->values, ir->valueCapacity);
+}
+
+// Only global and property loads are taken out or hoisted, so code
+// without any is left as it is, and isn't even analyzed
+static bool hasLoads(const Chunk* chunk) {
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        const uint8_t opcode = chunk->code[offset];
+        if (opcode == OP_GET_GLOBAL || opcode == OP_GET_PROPERTY) return true;
+    }
+    return false;
+}
+
+void optimizeIR(ObjFunction* function) {
+    if (!hasLoads(&function->chunk)) return;
+
+    IrFunction ir = {.function = function, .chunk = &function->chunk};
+    if (decode(&ir)) {
+        findBlocks(&ir);
+        if (analyze(&ir)) {
+            const int repeated = eliminateRepeatedLoads(&ir);
+            const int hoisted = hoistLoopInvariants(&ir, repeated);
+            ir.hiddenSlots = repeated + hoisted;
+            if (ir.hiddenSlots > 0) lower(&ir);
+        }
+    }
+    freeIr(&ir);
+}
+
+static InlineCandidate* findCandidate(const Inliner* inliner, const ObjString* name, const bool method) {
+    for (int i = 0; i < inliner->count; i++) {
+        InlineCandidate* candidate = &inliner->candidates[i];
+        if (candidate->name == name && candidate->method == method) return candidate;
+    }
+    return NULL;
+}
+
+static void addCandidate(Inliner* inliner, ObjString* name, ObjFunction* function, const bool method) {
+    InlineCandidate* existing = findCandidate(inliner, name, method);
+    if (existing != NULL) {
+        existing->ambiguous = true;
+        return;
+    }
+
+    if (inliner->capacity < inliner->count + 1) {
+        const int oldCapacity = inliner->capacity;
+        inliner->capacity = GROW_CAPACITY(oldCapacity);
+        inliner->candidates = GROW_ARRAY(InlineCandidate, inliner->candidates, oldCapacity, inliner->capacity);
+    }
+    inliner->candidates[inliner->count++] = (InlineCandidate){
+        .name = name,
+        .function = function,
+        .method = method,
+        .ambiguous = function == NULL,
+    };
+}
+
+// Records the functions defined as globals or methods right from a
+// constant, and the names defined from anything else
+static void collectCandidates(Inliner* inliner, ObjFunction* function) {
+    const Chunk* chunk = &function->chunk;
+    int previous = NONE;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        const uint8_t opcode = chunk->code[offset];
+        if (opcode == OP_DEFINE_GLOBAL || opcode == OP_DEFINE_CONSTANT || opcode == OP_METHOD) {
+            ObjString* name = AS_STRING(chunk->constants.values[chunk->code[offset + 1]]);
+            ObjFunction* defined = NULL;
+            if (previous != NONE && chunk->code[previous] == OP_CONSTANT) {
+                const Value value = chunk->constants.values[chunk->code[previous + 1]];
+                if (IS_FUNCTION(value)) defined = AS_FUNCTION(value);
+            }
+            addCandidate(inliner, name, defined, opcode == OP_METHOD);
+        }
+        previous = offset;
+    }
+
+    const ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) collectCandidates(inliner, AS_FUNCTION(constants->values[i]));
+    }
+}
+
+// Stack effect of the instructions inlined code may consist of, false
+// for any other
+static bool inlineEffect(const uint8_t opcode, int* effect) {
+    switch (opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_ZERO:
+    case OP_CONSTANT_ONE:
+    case OP_CONSTANT_TWO:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL: *effect = 1;
+        return true;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_NOT:
+    case OP_NEGATE: *effect = 0;
+        return true;
+    case OP_POP:
+    case OP_SET_LOCAL_POP:
+    case OP_GET_INDEX:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULUS:
+    case OP_EXPONENT:
+    case OP_SET_PROPERTY: *effect = -1;
+        return true;
+    case OP_SET_INDEX: *effect = -2;
+        return true;
+    default: return false;
+    }
+}
+
+// Small code that runs straight into its return without calling or
+// capturing anything, so it can run in the caller's frame. Code after
+// the return can't be reached without jumps
+static bool inlineableBody(InlineCandidate* candidate) {
+    Chunk* chunk = &candidate->function->chunk;
+    if (candidate->function->upvalueCount > 0) return false;
+
+    int depth = candidate->function->arity + 1;
+    int maxDepth = depth;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        const uint8_t opcode = chunk->code[offset];
+        if (opcode == OP_RETURN) {
+            candidate->length = offset;
+            candidate->depth = depth;
+            candidate->maxDepth = maxDepth;
+            return offset <= MAX_INLINE_LENGTH;
+        }
+
+        int effect;
+        if (!inlineEffect(opcode, &effect)) return false;
+        if (isLocalAccess(opcode) && chunk->code[offset + 1] >= depth - (opcode == OP_GET_LOCAL ? 0 : 1)) {
+            return false;
+        }
+        depth += effect;
+        if (depth <= 0) return false;
+        if (depth > maxDepth) maxDepth = depth;
+    }
+    return false;
+}
+
+// Marks the calls whose callee is a candidate to be inlined when it
+// turns out to be the expected function. Returns whether any was
+static bool markInlinedCalls(IrFunction* ir, const Inliner* inliner) {
+    bool marked = false;
+    for (int i = 0; i < ir->count; i++) {
+        IrInstruction* instruction = &ir->instructions[i];
+        if (instruction->base == NONE) continue;
+
+        const uint8_t* code = &ir->chunk->code[instruction->offset];
+        const InlineCandidate* candidate = NULL;
+        if (instruction->opcode == OP_CALL && instruction->operand != NONE) {
+            const IrInstruction* callee = &ir->instructions[instruction->operand];
+            if (callee->opcode != OP_GET_GLOBAL) continue;
+            candidate = findCandidate(inliner, (ObjString*) nameKey(ir, instruction->operand), false);
+        } else if (instruction->opcode == OP_INVOKE) {
+            candidate = findCandidate(inliner, (ObjString*) nameKey(ir, i), true);
+        }
+
+        if (candidate == NULL || !candidate->inlineable) continue;
+        if (candidate->function->arity != code[instruction->length - 1]) continue;
+        if (instruction->base + candidate->maxDepth > MAX_SLOT) continue;
+
+        // The constants the code uses go among the caller's, the callee
+        // too for the guard
+        bool fits = ensureConstant(ir->chunk, OBJ_VAL(candidate->function));
+        const Chunk* body = &candidate->function->chunk;
+        for (int offset = 0; fits && offset < candidate->length; offset += instructionLength(body, offset)) {
+            if (hasConstantOperand(body->code[offset])) {
+                fits = ensureConstant(ir->chunk, body->constants.values[body->code[offset + 1]]);
+            }
+        }
+        if (!fits) continue;
+
+        instruction->inlined = candidate;
+        marked = true;
+    }
+    return marked;
+}
+
+static void inlineInto(ObjFunction* function, const Inliner* inliner) {
+    // Functions only among the constants for the guards need no visit
+    const int constantCount = function->chunk.constants.count;
+    if (function->chunk.count > 0) {
+        IrFunction ir = {.function = function, .chunk = &function->chunk};
+        if (decode(&ir)) {
+            findBlocks(&ir);
+            if (analyze(&ir) && markInlinedCalls(&ir, inliner)) lower(&ir);
+        }
+        freeIr(&ir);
+    }
+
+    for (int i = 0; i < constantCount; i++) {
+        const Value constant = function->chunk.constants.values[i];
+        if (IS_FUNCTION(constant)) inlineInto(AS_FUNCTION(constant), inliner);
+    }
+}
+
+void inlineCalls(ObjFunction* script) {
+    Inliner inliner = {0};
+    collectCandidates(&inliner, script);
+
+    bool any = false;
+    for (int i = 0; i < inliner.count; i++) {
+        InlineCandidate* candidate = &inliner.candidates[i];
+        candidate->inlineable = !candidate->ambiguous && inlineableBody(candidate);
+        any |= candidate->inlineable;
+    }
+    if (any) inlineInto(script, &inliner);
+
+    FREE_ARRAY(InlineCandidate, inliner.candidates, inliner.capacity);
+}
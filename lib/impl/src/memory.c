@@ -1,38 +1,60 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <clox/vm.h>
 
 #include <impl/common.h>
+#include <impl/heap.h>
 #include <impl/memory.h>
+#include <impl/object.h>
 #include <impl/vm.h>
 #include <impl/compiler.h>
 
-#if defined(DEBUG_STRESS_GC) || defined(DEBUG_LOG_GC)
-
-#include <stdio.h>
-
-#endif
+#include <common/util.h>
 
+#define GC_INITIAL_THRESHOLD ((size_t) 1024 * 1024)
 #define GC_HEAP_GROW_FACTOR 2
+// Bounds and step of the growth factor picked by the adaptive pacer
+#define GC_PACER_MAX_GROWTH 16
+#define GC_PACER_STEP 1.25
+// Object pages swept per allocation while a sweep is pending
+#define GC_SWEEP_STEP 1
 
-void* reallocate(void* previous, const size_t oldSize, const size_t newSize) {
+static void checkHeapLimit();
+
+static void trackAllocation(const size_t oldSize, const size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        if (vm.arena != ARENA_ALLOCATING) {
+            collectGarbage();
+        }
 #else
-        if (vm.bytesAllocated > vm.nextGC) {
+        if (vm.bytesAllocated > vm.nextGC && vm.arena != ARENA_ALLOCATING) {
             collectGarbage();
         }
 #endif
+        checkHeapLimit();
     }
+}
 
+void* reallocate(void* previous, const size_t oldSize, const size_t newSize) {
+    trackAllocation(oldSize, newSize);
 
+#ifdef SLAB_ALLOCATOR
+    void* result = heapReallocate(previous, oldSize, newSize);
+    if (newSize == 0) return NULL;
+#else
     if (newSize == 0) {
         free(previous);
         return NULL;
     }
     void* result = realloc(previous, newSize);
+#endif
     if (result == NULL) {
         runtimeError("Failed to allocate memory");
         terminate(1);
@@ -40,16 +62,126 @@ void* reallocate(void* previous, const size_t oldSize, const size_t newSize) {
     return result;
 }
 
+static void appendObject(ObjList* list, Obj* object) {
+    if (list->capacity < list->count + 1) {
+        const int capacity = GROW_CAPACITY(list->capacity);
+        Obj** objects = (Obj**) realloc(list->objects, sizeof(Obj*) * capacity);
+        if (objects == NULL) {
+            runtimeError("Failed to allocate memory");
+            terminate(1);
+        }
+        list->objects = objects;
+        list->capacity = capacity;
+    }
+    list->objects[list->count++] = object;
+}
+
+// Immortal objects are only freed right after being allocated, when an
+// interned copy already exists, or by freeVM from the back of the list
+static void forgetImmortal(const Obj* object) {
+    for (int i = vm.immortals.count - 1; i >= 0; i--) {
+        if (vm.immortals.objects[i] != object) continue;
+
+        // Order is kept, an open section is a suffix of the list
+        memmove(&vm.immortals.objects[i], &vm.immortals.objects[i + 1],
+                sizeof(Obj*) * (vm.immortals.count - i - 1));
+        vm.immortals.count--;
+        return;
+    }
+}
+
+static void* allocateObjectMemory(const size_t size) {
+    if (vm.immortalSection >= 0) {
+        void* object = heapAllocateImmortal(size);
+        if (object != NULL) {
+            appendObject(&vm.immortals, object);
+        }
+        return object;
+    }
+
+    if (vm.arena == ARENA_ALLOCATING) {
+        void* object = heapAllocateArena(size, vm.gc.arenaBudget);
+        if (object != NULL) return object;
+        // Over budget, objects are collected as usual from here on
+        vm.arena = ARENA_SPENT;
+    }
+    return heapAllocateObject(size);
+}
+
+void* reallocateObject(void* previous, const size_t oldSize, const size_t newSize) {
+    trackAllocation(oldSize, newSize);
+
+    if (newSize == 0) {
+        if (heapIsImmortal(previous)) {
+            forgetImmortal(previous);
+        } else if (heapIsArena(previous)) {
+            // Arena memory is only reclaimed in order, walks skip the block
+            ((Obj*) previous)->type = OBJ_NONE;
+        }
+        heapFreeObject(previous, oldSize);
+        return NULL;
+    }
+
+    void* result = allocateObjectMemory(newSize);
+    if (result == NULL) {
+        runtimeError("Failed to allocate memory");
+        terminate(1);
+    }
+    return result;
+}
+
+void beginImmortal() {
+    massert(vm.immortalSection < 0, "Immortal sections do not nest");
+    vm.immortalSection = vm.immortals.count;
+}
+
+static bool isMortalValue(const Value value) {
+    return IS_OBJ(value) && !heapIsImmortal(AS_OBJ(value));
+}
+
+// Strings and natives hold no references, functions are not changed
+// once loaded. Anything else may be pointed at collectable objects later.
+static bool mayReferenceMortal(Obj* object) {
+    switch (object->type) {
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+        return false;
+    case OBJ_FUNCTION: {
+        const ObjFunction* function = (ObjFunction*) object;
+        const ObjString* name = DEREF(ObjString, function->name);
+        if (name != NULL && !heapIsImmortal(name)) return true;
+
+        for (int i = 0; i < function->chunk.constants.count; i++) {
+            if (isMortalValue(function->chunk.constants.values[i])) return true;
+        }
+        return false;
+    }
+    default:
+        return true;
+    }
+}
+
+void endImmortal() {
+    massert(vm.immortalSection >= 0, "No immortal section is open");
+    for (int i = vm.immortalSection; i < vm.immortals.count; i++) {
+        Obj* object = vm.immortals.objects[i];
+        if (mayReferenceMortal(object)) {
+            appendObject(&vm.rememberedImmortals, object);
+        }
+    }
+    vm.immortalSection = -1;
+}
+
 void markObject(Obj* object) {
     if (object == NULL) return;
-    if (object->isMarked) return;
+    if (heapIsMarked(object)) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void *) object);
     printValue(stdout, OBJ_VAL(object));
     printf("\n");
 #endif
-    object->isMarked = true;
+    heapMark(object);
 
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -84,7 +216,7 @@ static void blackenObject(Obj* object) {
     printValue(stdout, OBJ_VAL(object));
     printf("\n");
 #endif
-    object->vtp->blacken(object);
+    OBJ_VT(object)->blacken(object);
 }
 
 static void freeObject(Obj* object) {
@@ -95,15 +227,103 @@ static void freeObject(Obj* object) {
         (void*) object, object->type, objTypeStr
     );
 #endif
-    object->vtp->free(object);
+    OBJ_VT(object)->free(object);
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
+#ifdef DEBUG_LOG_GC
+// Bytes freed by the sweep of the last collection so far
+static size_t sweptBytes;
+#endif
+
+static void freeObjectBlock(void* block) {
+#ifdef DEBUG_LOG_GC
+    const size_t before = vm.bytesAllocated;
+    freeObject((Obj*) block);
+    sweptBytes += before - vm.bytesAllocated;
+#else
+    freeObject((Obj*) block);
+#endif
+}
+
+// Sweeps at most pageCount object pages, returns true once the sweep is
+// done. What a collection freed is only known by then
+static bool sweepObjects(const size_t pageCount) {
+#ifdef DEBUG_LOG_GC
+    const bool sweeping = heapSweeping();
+    const bool done = heapSweepObjects(pageCount, freeObjectBlock);
+    if (sweeping && done) {
+        printf("-- sweep end\n");
+        printf("   collected %zu bytes, %zu still allocated\n", sweptBytes, vm.bytesAllocated);
+    }
+    return done;
+#else
+    return heapSweepObjects(pageCount, freeObjectBlock);
+#endif
+}
+
+void beginArena() {
+    if (vm.gc.arenaBudget == 0 || vm.arena != ARENA_OFF) return;
+    vm.arena = ARENA_ALLOCATING;
+}
+
+static bool isImmortalValue(const Value value) {
+    return !IS_OBJ(value) || heapIsImmortal(AS_OBJ(value));
+}
+
+static bool isDefinedByRun(ObjString* key, const Value value) {
+    return !heapIsImmortal(key) || !isImmortalValue(value);
+}
+
+static bool isArenaString(ObjString* key, [[maybe_unused]] const Value value) {
+    return heapIsArena(key);
+}
+
+static void freeArenaBlock(void* block) {
+    Obj* object = block;
+    if (object->type != OBJ_NONE) {
         freeObject(object);
-        object = next;
+    }
+}
+
+void releaseArena() {
+    if (vm.arena == ARENA_OFF) return;
+
+    // Collectable objects may point into the arena as well, so everything
+    // the run left reachable goes, only builtins are kept
+    tableRemoveIf(&vm.globals, isDefinedByRun);
+    tableRemoveIf(&vm.constantGlobals, isDefinedByRun);
+    for (int i = 0; i < vm.rememberedImmortals.count; i++) {
+        Obj* object = vm.rememberedImmortals.objects[i];
+        if (object->type == OBJ_CLASS) {
+            tableRemoveIf(&((ObjClass*) object)->fields, isDefinedByRun);
+        }
+    }
+    tableRemoveIf(&vm.strings, isArenaString);
+
+    // Objects holding memory of their own still need their free functions
+    heapWalkArena(freeArenaBlock);
+    heapResetArena();
+    vm.arena = ARENA_OFF;
+}
+
+void freeObjects() {
+    releaseArena();
+    heapFreeObjects(freeObjectBlock);
+
+    // Freeing the last object takes it off the list
+    while (vm.immortals.count > 0) {
+        freeObject(vm.immortals.objects[vm.immortals.count - 1]);
+    }
+    free(vm.immortals.objects);
+    free(vm.rememberedImmortals.objects);
+    vm.immortals = (ObjList){NULL, 0, 0};
+    vm.rememberedImmortals = (ObjList){NULL, 0, 0};
+}
+
+static void blackenArenaBlock(void* block) {
+    Obj* object = block;
+    if (object->type != OBJ_NONE) {
+        blackenObject(object);
     }
 }
 
@@ -118,16 +338,33 @@ static void markRoots() {
     }
 
     markTable(&vm.globals);
+    markTable(&vm.constantGlobals);
 
     for (ObjUpvalue* upvalue = vm.openUpvalues;
          upvalue != NULL;
-         upvalue = upvalue->next) {
+         upvalue = DEREF(ObjUpvalue, upvalue->next)) {
         markObject((Obj*) upvalue);
     }
 
     markCompilerRoots();
     markObject((Obj*) vm.initString);
 
+    // Immortal objects count as marked, so the ones that may point to
+    // collectable objects are traced here instead. Until a section is
+    // closed, all of its objects are.
+    for (int i = 0; i < vm.rememberedImmortals.count; i++) {
+        blackenObject(vm.rememberedImmortals.objects[i]);
+    }
+    if (vm.immortalSection >= 0) {
+        for (int i = vm.immortalSection; i < vm.immortals.count; i++) {
+            blackenObject(vm.immortals.objects[i]);
+        }
+    }
+    // Arena objects are never marked either and are traced the same way
+    if (vm.arena != ARENA_OFF) {
+        heapWalkArena(blackenArenaBlock);
+    }
+
     for(int i = 0; i < nativeState.nativeRcNext; i++) {
         markValue(nativeState.nativeRc[i]);
     }
@@ -140,48 +377,132 @@ static void traceReferences() {
     }
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+static double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
 
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-            continue;
-        }
+static void scheduleNextGC() {
+    size_t next = (size_t) ((double) vm.bytesAllocated * vm.gcGrowth);
+    if (vm.gc.maxHeap != 0 && next > vm.gc.maxHeap) {
+        next = vm.gc.maxHeap;
+    }
+    vm.nextGC = next;
+}
 
-        Obj* unreached = object;
-        object = object->next;
-        if (previous != NULL) {
-            previous->next = object;
-        } else {
-            vm.objects = object;
-        }
+// Grows the heap faster while collections take more than their share of
+// the run time, and falls back to the configured factor once they don't.
+static void updatePacer(const double pause, const double mutator) {
+    if (vm.gc.targetGCFraction <= 0) return;
+
+    const double fraction = pause / (pause + mutator);
+    if (fraction > vm.gc.targetGCFraction) {
+        vm.gcGrowth = fmin(vm.gcGrowth * GC_PACER_STEP, GC_PACER_MAX_GROWTH);
+    } else if (fraction < vm.gc.targetGCFraction / 2) {
+        vm.gcGrowth = fmax(vm.gcGrowth / GC_PACER_STEP, vm.gc.growthFactor);
+    }
+}
+
+void sweepStep() {
+    if (heapSweeping() && sweepObjects(GC_SWEEP_STEP)) {
+        scheduleNextGC();
+    }
+}
+
+// Collects and sweeps everything unreachable, returns whether the heap
+// is still over its limit
+static bool overHeapLimit() {
+    // Garbage waiting for the lazy sweep still counts against the limit
+    collectGarbage();
+    sweepObjects(SIZE_MAX);
+    scheduleNextGC();
+    return vm.bytesAllocated > vm.gc.maxHeap;
+}
+
+static void checkHeapLimit() {
+    if (vm.gc.maxHeap == 0 || vm.heapExhausted) return;
+    if (vm.bytesAllocated <= vm.gc.maxHeap) return;
+
+    // Raised as an exception at the next safepoint of the interpreter
+    vm.heapExhausted = overHeapLimit();
+}
 
-        freeObject(unreached);
+bool heapStillExhausted() {
+    vm.heapExhausted = overHeapLimit();
+    return vm.heapExhausted;
+}
 
+static void readSizeVariable(const char* name, size_t* size) {
+    const char* text = getenv(name);
+    if (text != NULL && !parseByteSize(text, size)) {
+        fprintf(stderr, "Ignoring invalid %s value '%s'\n", name, text);
     }
 }
 
+static void readFractionVariable(const char* name, double* value, const double min) {
+    const char* text = getenv(name);
+    if (text == NULL) return;
+
+    char* end;
+    const double parsed = strtod(text, &end);
+    if (end == text || *end != '\0' || parsed < min) {
+        fprintf(stderr, "Ignoring invalid %s value '%s'\n", name, text);
+        return;
+    }
+    *value = parsed;
+}
+
+GCConfig defaultGCConfig() {
+    GCConfig config = {
+        .initialThreshold = GC_INITIAL_THRESHOLD,
+        .growthFactor = GC_HEAP_GROW_FACTOR,
+        .maxHeap = 0,
+        .targetGCFraction = 0,
+        .arenaBudget = 0,
+    };
+
+    readSizeVariable("CLOX_GC_INITIAL", &config.initialThreshold);
+    readFractionVariable("CLOX_GC_GROWTH", &config.growthFactor, 1);
+    readSizeVariable("CLOX_GC_MAX_HEAP", &config.maxHeap);
+    readFractionVariable("CLOX_GC_TARGET", &config.targetGCFraction, 0);
+    readSizeVariable("CLOX_ARENA", &config.arenaBudget);
+    return config;
+}
+
+void configureGC(const GCConfig* config) {
+    vm.gc = *config;
+    vm.gcConfigured = true;
+    vm.gcGrowth = config->growthFactor;
+    vm.nextGC = config->initialThreshold;
+}
+
 void collectGarbage() {
+    const double start = monotonicSeconds();
+
+    // Marks left by the previous cycle must be cleared before marking again
+    sweepObjects(SIZE_MAX);
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+    sweptBytes = 0;
 #endif
 
     markRoots();
     traceReferences();
     tableRemoveWhite(&vm.strings);
-    sweep();
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    // Only marking happens in the pause, freeing is spread over allocations
+    heapStartSweep(freeObjectBlock);
+
+    const double end = monotonicSeconds();
+    updatePacer(end - start, start - vm.gcLastEnd);
+    vm.gcLastEnd = end;
+    scheduleNextGC();
 
 #ifdef DEBUG_LOG_GC
+    // The bytes collected are reported once the lazy sweep is done
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated,
-           vm.nextGC);
+    printf("   marking done with %zu bytes allocated, next at %zu\n",
+           vm.bytesAllocated, vm.nextGC);
 #endif
 }
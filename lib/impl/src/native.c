@@ -11,6 +11,13 @@
 #include <impl/object.h>
 #include <impl/vm.h>
 
+// The key has to stay on the stack, growing the table may trigger a collection
+static void setField(ObjInstance* instance, const char* name, const int length, const Value value) {
+    push(OBJ_VAL(copyString(name, length)));
+    tableSet(&instance->fields, AS_STRING(vm.stackTop[-1]), value);
+    pop();
+}
+
 bool initExceptionNative(int argCount, Value* implicit, Value* args) {
     if (argCount > 1) {
         *implicit = NATIVE_ERROR("Exit takes either 0 arguments or one a string.");
@@ -22,9 +29,9 @@ bool initExceptionNative(int argCount, Value* implicit, Value* args) {
             *implicit = NATIVE_ERROR("Expected a string as an argument");
             return false;
         }
-        tableSet(&exception->fields, copyString("message", 7), args[0]);
+        setField(exception, "message", 7, args[0]);
     } else {
-        tableSet(&exception->fields, copyString("message", 7), NIL_VAL);
+        setField(exception, "message", 7, NIL_VAL);
     }
     *implicit = OBJ_VAL(exception);
     return true;
@@ -88,7 +95,7 @@ bool initNumberNative(int argCount, Value* implicit, Value* args) {
             *implicit = NATIVE_ERROR("Invalid number literal.");
             return false;
         }
-        instance->this_ = NUMBER_VAL(val);
+        instance->this_ = canonicalNumber(val);
         return true;
     }
 
@@ -209,7 +216,7 @@ bool initStringNative(int argCount, Value* implicit, Value* args) {
         snprintf(chars, len + 1, "%g", x);
 
         instance->this_ = OBJ_VAL(takeString(chars, len));
-        tableSet(&instance->fields, copyString("length", 6), NUMBER_VAL(len));
+        setField(instance, "length", 6, INT_VAL(len));
 
         return true;
     }
@@ -223,7 +230,7 @@ bool initStringNative(int argCount, Value* implicit, Value* args) {
         const char* str = b ? "true" : "false";
         const int len = b ? 4 : 5;
         instance->this_ = OBJ_VAL(copyString(str, len));
-        tableSet(&instance->fields, copyString("length", 6), NUMBER_VAL(len));
+        setField(instance, "length", 6, INT_VAL(len));
         return true;
     }
 
@@ -234,7 +241,7 @@ bool initStringNative(int argCount, Value* implicit, Value* args) {
             : AS_INSTANCE(value)->this_);
 
         instance->this_ = OBJ_VAL(str);
-        tableSet(&instance->fields, copyString("length", 6), NUMBER_VAL(str->length));
+        setField(instance, "length", 6, INT_VAL(str->length));
         return true;
     }
 
@@ -274,7 +281,7 @@ bool initArrayNative(int argCount, Value* implicit, Value* args) {
         push(OBJ_VAL(array_));
         valueInitValueArray(&array_->array, NIL_VAL, len);
         instance->this_ = OBJ_VAL(array_);
-        tableSet(&instance->fields, copyString("length", 6), NUMBER_VAL(len));
+        setField(instance, "length", 6, INT_VAL(len));
         pop();
         return true;
     }
@@ -282,7 +289,7 @@ bool initArrayNative(int argCount, Value* implicit, Value* args) {
     if (IS_ARRAY(value)) {
         ObjArray* array_ = AS_ARRAY(value);
         instance->this_ = OBJ_VAL(array_);
-        tableSet(&instance->fields, copyString("length", 6), NUMBER_VAL(array_->array.count));
+        setField(instance, "length", 6, INT_VAL(array_->array.count));
         return true;
     }
 
@@ -13,14 +13,15 @@
 #include <impl/vm.h>
 
 
-#define IS_BUILTIN_OBJ_TYPE(objectType) (objectType > OBJ_NONE && objectType < OBJ_END)
+#define ALLOCATE_OBJ(type, objectType) \
+    (type*) allocateObject(sizeof(type), objectType)
 
-#define ALLOCATE_OBJ(type, objectType, ...) \
-    (type*) allocateObject(sizeof(type), objectType, \
-        __VA_OPT__(IS_BUILTIN_OBJ_TYPE(objectType)) \
-        __VA_OPT__(?)    &vtList[objectType] \
-        __VA_OPT__(: __VA_ARGS__) \
-    )
+// Objects ending in a flexible array member, sized for count elements
+#define ALLOCATE_FLEX_OBJ(type, objectType, elementType, count) \
+    (type*) allocateObject(FLEX_OBJ_SIZE(type, elementType, count), objectType)
+
+// One extra character for the terminator
+#define STRING_CHARS(length) ((size_t) (length) + 1)
 
 static bool callNonCallable(Obj*, int);
 static void blackenNoOp(Obj*);
@@ -60,7 +61,7 @@ static void blackenUpvalue(Obj* object);
 static void freeUpvalue(Obj* object);
 static void printUpvalue(Obj* obj, FILE* out);
 
-static ObjVT vtList[] = {
+ObjVT vtList[OBJ_LAST] = {
     [OBJ_ARRAY] = {
         .call = callNonCallable,
         .blacken = blackenArray,
@@ -117,18 +118,15 @@ static ObjVT vtList[] = {
     },
 };
 
-static Obj* allocateObject(const size_t size, const ObjType type, ObjVT* vtp) {
-    Obj* object = reallocate(NULL, 0, size);
+static Obj* allocateObject(const size_t size, const ObjType type) {
+    sweepStep();
+    Obj* object = reallocateObject(NULL, 0, size);
     object->type = type;
-    object->isMarked = false;
-    object->vtp = vtp;
-    object->next = vm.objects;
-    vm.objects = object;
     return object;
 }
 
 void printObject(FILE* out, const Value value) {
-    AS_OBJ(value)->vtp->print(AS_OBJ(value), out);
+    OBJ_VT(AS_OBJ(value))->print(AS_OBJ(value), out);
 }
 
 ObjArray* newArray() {
@@ -149,7 +147,7 @@ static void blackenArray(Obj* object) {
 static void freeArray(Obj* object) {
     ObjArray* array = (ObjArray*) object;
     freeValueArray(&array->array);
-    FREE(ObjArray, object);
+    FREE_OBJ(ObjArray, object);
 }
 
 static void printArray(Obj* object, FILE* out) {
@@ -174,31 +172,31 @@ static void printArray(Obj* object, FILE* out) {
 ObjBoundMethod* newBoundMethod(const Value receiver, Obj* method) {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
-    bound->method = method;
+    bound->method = MAKE_REF(method);
     return bound;
 }
 
 static void blackenBoundMethod(Obj* object) {
     const ObjBoundMethod* bound = (ObjBoundMethod*) object;
     markValue(bound->receiver);
-    markObject((Obj*) bound->method);
+    markObject(DEREF(Obj, bound->method));
 }
 
 static void freeBoundMethod(Obj* object) {
-    FREE(ObjBoundMethod, object);
+    FREE_OBJ(ObjBoundMethod, object);
 }
 
 static void printBoundMethod(Obj* obj, FILE* out) {
-    Obj* method = ((ObjBoundMethod*) obj)->method;
+    Obj* method = DEREF(Obj, ((ObjBoundMethod*) obj)->method);
     ObjFunction* fun = method->type == OBJ_FUNCTION
                            ? (ObjFunction*) method
-                           : ((ObjClosure*) method)->function;
+                           : DEREF(ObjFunction, ((ObjClosure*) method)->function);
     printFunctionImpl(fun, out);
 }
 
 ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
-    klass->name = name;
+    klass->name = MAKE_REF(name);
     klass->initializer = NIL_VAL;
     initTable(&klass->fields);
     initTable(&klass->methods);
@@ -208,73 +206,72 @@ ObjClass* newClass(ObjString* name) {
 
 static void blackenClass(Obj* object) {
     ObjClass* klass = (ObjClass*) object;
-    markObject((Obj*) klass->name);
+    markObject(DEREF(Obj, klass->name));
+    markTable(&klass->fields);
     markTable(&klass->methods);
     markTable(&klass->staticMethods);
 }
 
 static void freeClass(Obj* object) {
     ObjClass* class = (ObjClass*) object;
+    freeTable(&class->fields);
     freeTable(&class->methods);
     freeTable(&class->staticMethods);
-    FREE(ObjClass, object);
+    FREE_OBJ(ObjClass, object);
 }
 
 static void printClass(Obj* obj, FILE* out) {
-    fprintf(out, "<class %s>", ((ObjClass*) obj)->name->chars);
+    fprintf(out, "<class %s>", DEREF(ObjString, ((ObjClass*) obj)->name)->chars);
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-
+    ObjClosure* closure = ALLOCATE_FLEX_OBJ(
+        ObjClosure, OBJ_CLOSURE,
+        Value, function->upvalueCount);
+    closure->function = MAKE_REF(function);
+    closure->upvalueCount = function->upvalueCount;
     for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = NIL_VAL;
     }
-
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
 static void blackenClosure(Obj* object) {
     const ObjClosure* closure = (ObjClosure*) object;
-    markObject((Obj*) closure->function);
+    markObject(DEREF(Obj, closure->function));
     for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*) closure->upvalues[i]);
+        markValue(closure->upvalues[i]);
     }
 }
 
 static void freeClosure(Obj* object) {
     const ObjClosure* closure = (ObjClosure*) object;
-    FREE_ARRAY(ObjClosure*, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, object);
+    FREE_FLEX_OBJ(ObjClosure, Value, closure->upvalueCount, object);
 }
 
 static void printClosure(Obj* obj, FILE* out) {
-    printFunctionImpl(((ObjClosure*) obj)->function, out);
+    printFunctionImpl(DEREF(ObjFunction, ((ObjClosure*) obj)->function), out);
 }
 
 ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
-    function->name = NULL;
+    function->name = NULL_REF;
     initChunk(&function->chunk);
     return function;
 }
 
 static void blackenFunction(Obj* object) {
     ObjFunction* function = (ObjFunction*) object;
-    markObject((Obj*) function->name);
+    markObject(DEREF(Obj, function->name));
     markArray(&function->chunk.constants);
 }
 
 static void freeFunction(Obj* object) {
     ObjFunction* function = (ObjFunction*) object;
     freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+    FREE_OBJ(ObjFunction, object);
 }
 
 static void printFunction(Obj* obj, FILE* out) {
@@ -283,7 +280,7 @@ static void printFunction(Obj* obj, FILE* out) {
 
 ObjInstance* newInstance(ObjClass* klass) {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-    instance->klass = klass;
+    instance->klass = MAKE_REF(klass);
     instance->this_ = OBJ_VAL(instance);
     initTable(&instance->fields);
     return instance;
@@ -292,20 +289,21 @@ ObjInstance* newInstance(ObjClass* klass) {
 static void blackenInstance(Obj* object) {
     ObjInstance* instance = (ObjInstance*) object;
     markValue(instance->this_);
-    markObject((Obj*) instance->klass);
+    markObject(DEREF(Obj, instance->klass));
     markTable(&instance->fields);
 }
 
 static void freeInstance(Obj* object) {
     ObjInstance* instance = (ObjInstance*) (object);
     freeTable(&instance->fields);
-    FREE(ObjInstance, object);
+    FREE_OBJ(ObjInstance, object);
 }
 
 static void printInstance(Obj* obj, FILE* out) {
     const ObjInstance* instance = (ObjInstance*) obj;
     if (IS_INSTANCE(instance->this_)) {
-        fprintf(out, "<instance %s>", instance->klass->name->chars);
+        const ObjClass* klass = DEREF(ObjClass, instance->klass);
+        fprintf(out, "<instance %s>", DEREF(ObjString, klass->name)->chars);
     } else {
         printValue(out, instance->this_);
     }
@@ -320,7 +318,7 @@ ObjNative* newNative(const char* name, const NativeFn function, const int arity)
 }
 
 static void freeNative(Obj* object) {
-    FREE(ObjNative, object);
+    FREE_OBJ(ObjNative, object);
 }
 
 static void printNative([[maybe_unused]] Obj* obj, FILE* out) {
@@ -330,15 +328,22 @@ static void printNative([[maybe_unused]] Obj* obj, FILE* out) {
 ObjInstance* newPrimitive(const Value value, ObjClass* klass) {
     ObjInstance* primitive = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     primitive->this_ = value;
-    primitive->klass = klass;
+    primitive->klass = MAKE_REF(klass);
     initTable(&primitive->fields);
     return primitive;
 }
 
-static ObjString* allocateString(char* chars, const int length, const uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjString* allocateString(const int length) {
+    ObjString* string = ALLOCATE_FLEX_OBJ(
+        ObjString, OBJ_STRING,
+        char, STRING_CHARS(length));
     string->length = length;
-    string->chars = chars;
+    string->hash = 0;
+    string->chars[length] = '\0';
+    return string;
+}
+
+static ObjString* addString(ObjString* string, const uint32_t hash) {
     string->hash = hash;
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
@@ -346,13 +351,111 @@ static ObjString* allocateString(char* chars, const int length, const uint32_t h
     return string;
 }
 
+static void freeUninternedString(ObjString* string) {
+    FREE_FLEX_OBJ(ObjString, char, STRING_CHARS(string->length), string);
+}
+
+ObjString* internString(ObjString* string) {
+    const uint32_t hash = hashString(string->chars, string->length);
+    ObjString* interned = tableFindString(
+        &vm.strings, string->chars, string->length,
+        hash);
+    if (interned != NULL) {
+        freeUninternedString(string);
+        return interned;
+    }
+
+    return addString(string, hash);
+}
+
+static ObjString* newString(const char* chars, const int length, const uint32_t hash) {
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    return addString(string, hash);
+}
+
+// String hashing follows wyhash: the input is read a word at a time and
+// mixed with full 64x64->128 bit multiplies, the final hash folded to 32 bits
+static const uint64_t hashSecret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static inline void multiply128(uint64_t* a, uint64_t* b) {
+    const __uint128_t product = (__uint128_t) *a * *b;
+    *a = (uint64_t) product;
+    *b = (uint64_t) (product >> 64);
+}
+
+static inline uint64_t mix64(uint64_t a, uint64_t b) {
+    multiply128(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t read64(const uint8_t* bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static inline uint64_t read32(const uint8_t* bytes) {
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// Strings of up to 3 bytes, reads the first, middle and last one
+static inline uint64_t read3(const uint8_t* bytes, const size_t length) {
+    return (uint64_t) bytes[0] << 16 | (uint64_t) bytes[length >> 1] << 8 | bytes[length - 1];
+}
+
 uint32_t hashString(const char* chars, const int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t) chars[i];
-        hash *= 16777619;
+    const uint8_t* bytes = (const uint8_t*) chars;
+    const size_t size = (size_t) length;
+    uint64_t seed = hashSecret[0];
+    uint64_t a, b;
+
+    if (size <= 16) {
+        // Identifiers mostly end up here, read as two overlapping pairs of words
+        if (size >= 4) {
+            const size_t middle = (size >> 3) << 2;
+            a = read32(bytes) << 32 | read32(bytes + middle);
+            b = read32(bytes + size - 4) << 32 | read32(bytes + size - 4 - middle);
+        } else if (size > 0) {
+            a = read3(bytes, size);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t left = size;
+        if (left > 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = mix64(read64(bytes) ^ hashSecret[1], read64(bytes + 8) ^ seed);
+                seed1 = mix64(read64(bytes + 16) ^ hashSecret[2], read64(bytes + 24) ^ seed1);
+                seed2 = mix64(read64(bytes + 32) ^ hashSecret[3], read64(bytes + 40) ^ seed2);
+                bytes += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (left > 16) {
+            seed = mix64(read64(bytes) ^ hashSecret[1], read64(bytes + 8) ^ seed);
+            bytes += 16;
+            left -= 16;
+        }
+        // The last 16 bytes, overlapping what was already mixed in
+        a = read64(bytes + left - 16);
+        b = read64(bytes + left - 8);
     }
-    return hash;
+
+    a ^= hashSecret[1];
+    b ^= seed;
+    multiply128(&a, &b);
+    const uint64_t hash = mix64(a ^ hashSecret[0] ^ size, b ^ hashSecret[1]);
+    return (uint32_t) (hash ^ hash >> 32);
 }
 
 ObjString* takeString(char* chars, const int length) {
@@ -360,16 +463,18 @@ ObjString* takeString(char* chars, const int length) {
     ObjString* interned = tableFindString(
         &vm.strings, chars, length,
         hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, (size_t) length + 1);
-        return interned;
+    if (interned == NULL) {
+        interned = newString(chars, length, hash);
     }
 
-    return allocateString(chars, length, hash);
+    FREE_ARRAY(char, chars, (size_t) length + 1);
+    return interned;
 }
 
 ObjString* escapedString(const char* chars, int length) {
-    char* buffer = ALLOCATE(char, (size_t) length + 1);
+    // Escapes only ever shorten the text, the length is an upper bound
+    ObjString* string = allocateString(length);
+    char* buffer = string->chars;
     int write = 0;
     int read = 0;
     while(read < length) {
@@ -418,8 +523,16 @@ ObjString* escapedString(const char* chars, int length) {
         }  
     }
     buffer[write] = 0;
-    
-    return takeString(buffer, write);
+    if (write == length) {
+        return internString(string);
+    }
+
+    // The object is sized by its length, so a shorter result needs a copy
+    push(OBJ_VAL(string));
+    ObjString* result = copyString(buffer, write);
+    pop();
+    freeUninternedString(string);
+    return result;
 }
 
 ObjString* copyString(const char* chars, const int length) {
@@ -429,16 +542,11 @@ ObjString* copyString(const char* chars, const int length) {
         hash);
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, (size_t) length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return newString(chars, length, hash);
 }
 
 static void freeString(Obj* object) {
-    const ObjString* string = (ObjString*) object;
-    FREE_ARRAY(char, string->chars, (size_t) string->length + 1);
-    FREE(ObjString, object);
+    freeUninternedString((ObjString*) object);
 }
 
 static void printString(Obj* obj, FILE* out) {
@@ -448,7 +556,7 @@ static void printString(Obj* obj, FILE* out) {
 ObjUpvalue* newUpvalue(Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
-    upvalue->next = NULL;
+    upvalue->next = NULL_REF;
     upvalue->closed = NIL_VAL;
     return upvalue;
 }
@@ -458,7 +566,7 @@ static void blackenUpvalue(Obj* object) {
 }
 
 static void freeUpvalue(Obj* object) {
-    FREE(ObjUpvalue, object);
+    FREE_OBJ(ObjUpvalue, object);
 }
 
 static void printUpvalue(Obj* obj, FILE* out) {
@@ -469,11 +577,11 @@ static void printUpvalue(Obj* obj, FILE* out) {
 }
 
 static void printFunctionImpl(const ObjFunction* function, FILE* out) {
-    if (function->name == NULL) {
+    if (function->name == NULL_REF) {
         fprintf(out, "<script>");
         return;
     }
-    fprintf(out, "<fn %s>", function->name->chars);
+    fprintf(out, "<fn %s>", DEREF(ObjString, function->name)->chars);
 }
 
 static bool callNonCallable([[maybe_unused]] Obj* obj, [[maybe_unused]] int argCount) {
@@ -0,0 +1,590 @@
+#include <impl/ir.h>
+#include <impl/memory.h>
+#include <impl/optimizer.h>
+#include <impl/vm.h>
+
+// Exception handler address of a try without that clause
+#define NO_ADDRESS 0xFFFF
+
+#define NO_TARGET (-1)
+
+// Each pass can open up new opportunities for the others
+#define MAX_PASSES 8
+
+typedef struct {
+    uint8_t opcode;
+    int offset;
+    int length;
+    int line;
+    // Index of the instruction a jump goes to, which may be one past the
+    // last. A removed target stands for the next instruction still kept
+    int target;
+    int handler;
+    int finally;
+    // Entries of a switch table, as a range of the program's cases
+    int firstCase;
+    int caseCount;
+    bool removed;
+    // Operands of an instruction rewritten into register form, which
+    // replace the ones in the chunk
+    bool rewritten;
+    uint8_t operands[REGISTER_STORE_LENGTH - 1];
+} Instruction;
+
+typedef struct {
+    Chunk* chunk;
+    Instruction* instructions;
+    int count;
+    // Index of the instruction each entry of a switch table leads to,
+    // NO_TARGET where no case matches
+    int* cases;
+    int caseCount;
+    // Whether a jump or an exception handler leads to the instruction
+    bool* targeted;
+} Program;
+
+static uint16_t readShort(const Chunk* chunk, const int offset) {
+    return (uint16_t) (chunk->code[offset] << 8 | chunk->code[offset + 1]);
+}
+
+static bool isJump(const uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_LOOP
+           || opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_TRUE;
+}
+
+static bool isConditionalJump(const uint8_t opcode) {
+    return opcode == OP_JUMP_IF_FALSE || opcode == OP_JUMP_IF_TRUE;
+}
+
+// Where the forward jump of an inline guard or return, an in-place
+// update or a counting loop is among its operands, 0 for any other
+// instruction
+static int forwardJumpOperand(const uint8_t opcode) {
+    switch (opcode) {
+    case OP_INLINE_CALL: return INLINE_CALL_LENGTH - 2;
+    case OP_INLINE_INVOKE: return INLINE_INVOKE_LENGTH - 2;
+    case OP_INLINE_RETURN: return INLINE_RETURN_LENGTH - 2;
+    case OP_UPDATE_PROPERTY:
+    case OP_UPDATE_GLOBAL:
+    case OP_UPDATE_UPVALUE: return UPDATE_LENGTH - 2;
+    case OP_UPDATE_INDEX: return UPDATE_INDEX_LENGTH - 2;
+    case OP_FOR_PREP: return FOR_PREP_LENGTH - 2;
+    case OP_FOR_LOOP: return FOR_LOOP_LENGTH - 2;
+    default: return 0;
+    }
+}
+
+static bool isSwitch(const uint8_t opcode) {
+    return opcode == OP_SWITCH_DENSE || opcode == OP_SWITCH_HASHED;
+}
+
+static int switchHeader(const uint8_t opcode) {
+    return opcode == OP_SWITCH_DENSE ? SWITCH_DENSE_HEADER : SWITCH_HASHED_HEADER;
+}
+
+static int switchEntry(const uint8_t opcode) {
+    return opcode == OP_SWITCH_DENSE ? SWITCH_DENSE_ENTRY : SWITCH_HASHED_ENTRY;
+}
+
+// Execution never continues with the next instruction
+static bool endsFlow(const uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_LOOP
+           || opcode == OP_RETURN || opcode == OP_THROW || opcode == OP_INLINE_RETURN;
+}
+
+// Pushes a value without any other effect, so popping it right away
+// is the same as never pushing it
+static bool isPurePush(const uint8_t opcode) {
+    switch (opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_ZERO:
+    case OP_CONSTANT_ONE:
+    case OP_CONSTANT_TWO:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE: return true;
+    default: return false;
+    }
+}
+
+static void decode(Program* program) {
+    const Chunk* chunk = program->chunk;
+
+    int count = 0;
+    int caseCount = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (isSwitch(chunk->code[offset])) {
+            caseCount += readShort(chunk, offset + switchHeader(chunk->code[offset]) - 2);
+        }
+        count++;
+    }
+
+    int* indexAt = ALLOCATE(int, chunk->count + 1);
+    program->instructions = ALLOCATE(Instruction, count);
+    program->targeted = ALLOCATE(bool, count + 1);
+    program->count = count;
+    program->cases = ALLOCATE(int, caseCount);
+    program->caseCount = caseCount;
+
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        instruction->opcode = chunk->code[offset];
+        instruction->offset = offset;
+        instruction->length = instructionLength(chunk, offset);
+        instruction->line = getLine(program->chunk, offset);
+        instruction->removed = false;
+        instruction->rewritten = false;
+        indexAt[offset] = i;
+        offset += instruction->length;
+    }
+    indexAt[chunk->count] = count;
+
+    caseCount = 0;
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        const int next = instruction->offset + instruction->length;
+        instruction->target = NO_TARGET;
+        instruction->handler = NO_TARGET;
+        instruction->finally = NO_TARGET;
+        instruction->firstCase = 0;
+        instruction->caseCount = 0;
+
+        if (instruction->opcode == OP_LOOP) {
+            instruction->target = indexAt[next - readShort(chunk, instruction->offset + 1)];
+        } else if (isJump(instruction->opcode)) {
+            instruction->target = indexAt[next + readShort(chunk, instruction->offset + 1)];
+        } else if (forwardJumpOperand(instruction->opcode)) {
+            const int operand = instruction->offset + forwardJumpOperand(instruction->opcode);
+            instruction->target = indexAt[next + readShort(chunk, operand)];
+        } else if (instruction->opcode == OP_PUSH_EXCEPTION_HANDLER) {
+            const uint16_t handler = readShort(chunk, instruction->offset + 2);
+            const uint16_t finally = readShort(chunk, instruction->offset + 4);
+            if (handler != NO_ADDRESS) instruction->handler = indexAt[handler];
+            if (finally != NO_ADDRESS) instruction->finally = indexAt[finally];
+        } else if (isSwitch(instruction->opcode)) {
+            const int header = switchHeader(instruction->opcode);
+            const int entryLength = switchEntry(instruction->opcode);
+            instruction->firstCase = caseCount;
+            instruction->caseCount = readShort(chunk, instruction->offset + header - 2);
+            for (int entry = 0; entry < instruction->caseCount; entry++) {
+                const int at = instruction->offset + header + entry * entryLength;
+                const uint16_t address = readShort(chunk, at + entryLength - 2);
+                program->cases[caseCount++] = address != NO_CASE ? indexAt[address] : NO_TARGET;
+            }
+        }
+    }
+
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+}
+
+// The first instruction still kept from index on
+static int liveAt(const Program* program, int index) {
+    while (index < program->count && program->instructions[index].removed) index++;
+    return index;
+}
+
+static int nextLive(const Program* program, const int index) {
+    return liveAt(program, index + 1);
+}
+
+static uint8_t opcodeAt(const Program* program, const int index) {
+    // Past the end of the code nothing matches
+    return index < program->count ? program->instructions[index].opcode : OP_LAST;
+}
+
+static void findTargets(const Program* program) {
+    for (int i = 0; i <= program->count; i++) {
+        program->targeted[i] = false;
+    }
+    for (int i = 0; i < program->count; i++) {
+        const Instruction* instruction = &program->instructions[i];
+        if (instruction->removed) continue;
+        if (instruction->target != NO_TARGET) {
+            program->targeted[liveAt(program, instruction->target)] = true;
+        }
+        if (instruction->handler != NO_TARGET) {
+            program->targeted[liveAt(program, instruction->handler)] = true;
+        }
+        if (instruction->finally != NO_TARGET) {
+            program->targeted[liveAt(program, instruction->finally)] = true;
+        }
+        for (int entry = 0; entry < instruction->caseCount; entry++) {
+            const int target = program->cases[instruction->firstCase + entry];
+            if (target != NO_TARGET) program->targeted[liveAt(program, target)] = true;
+        }
+    }
+}
+
+// A jump to an unconditional jump can go straight to where that one
+// leads, as can a conditional jump to the same kind of conditional jump,
+// which tests the very same value
+static bool threadJumps(const Program* program) {
+    bool changed = false;
+    for (int i = 0; i < program->count; i++) {
+        Instruction* jump = &program->instructions[i];
+        if (jump->removed || !isJump(jump->opcode)) continue;
+
+        const int start = liveAt(program, jump->target);
+        int target = start;
+        for (int hops = 0; hops < program->count; hops++) {
+            const uint8_t opcode = opcodeAt(program, target);
+            if (opcode != OP_JUMP && opcode != OP_LOOP
+                && !(isConditionalJump(jump->opcode) && opcode == jump->opcode)) {
+                break;
+            }
+            target = liveAt(program, program->instructions[target].target);
+        }
+
+        // Conditional jumps can only be encoded forwards
+        if (target == start || (isConditionalJump(jump->opcode) && target <= i)) continue;
+        jump->target = target;
+        changed = true;
+    }
+    return changed;
+}
+
+static bool removeDeadCode(const Program* program) {
+    bool changed = false;
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (instruction->removed) continue;
+
+        // A jump to the next instruction does nothing
+        if (isJump(instruction->opcode) && instruction->opcode != OP_LOOP
+            && liveAt(program, instruction->target) == nextLive(program, i)) {
+            instruction->removed = true;
+            changed = true;
+            continue;
+        }
+
+        if (!endsFlow(instruction->opcode)) continue;
+        for (int j = i + 1; j < program->count && !program->targeted[j]; j++) {
+            if (!program->instructions[j].removed) {
+                program->instructions[j].removed = true;
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+static bool combinePairs(const Program* program) {
+    bool changed = false;
+    for (int i = 0; i < program->count; i++) {
+        Instruction* first = &program->instructions[i];
+        if (first->removed) continue;
+
+        const int next = nextLive(program, i);
+        // Anything jumping between the two still needs the second one
+        if (next == program->count || program->targeted[next]) continue;
+        Instruction* second = &program->instructions[next];
+
+        if (second->opcode == OP_POP && isPurePush(first->opcode)) {
+            first->removed = true;
+            second->removed = true;
+            changed = true;
+        } else if (second->opcode == OP_POP && first->opcode == OP_SET_LOCAL) {
+            first->opcode = OP_SET_LOCAL_POP;
+            second->removed = true;
+            changed = true;
+        } else if (first->opcode == OP_NOT && isConditionalJump(second->opcode)
+                   && opcodeAt(program, nextLive(program, next)) == OP_POP
+                   && opcodeAt(program, liveAt(program, second->target)) == OP_POP) {
+            // Both ways the tested value is popped right away, so it
+            // doesn't matter that it is left un-negated
+            first->removed = true;
+            second->opcode = second->opcode == OP_JUMP_IF_FALSE
+                                 ? OP_JUMP_IF_TRUE
+                                 : OP_JUMP_IF_FALSE;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void writeShort(Chunk* chunk, const int value, const int line) {
+    writeChunk(chunk, (value >> 8) & 0xFF, line);
+    writeChunk(chunk, value & 0xFF, line);
+}
+
+static void encode(Program* program) {
+    Chunk* chunk = program->chunk;
+    const int count = program->count;
+
+    // Removed instructions take the offset of the next one kept
+    int* newOffset = ALLOCATE(int, count + 1);
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+        newOffset[i] = offset;
+        if (!program->instructions[i].removed) offset += program->instructions[i].length;
+    }
+    newOffset[count] = offset;
+
+    Chunk code;
+    initChunk(&code);
+    for (int i = 0; i < count; i++) {
+        const Instruction* instruction = &program->instructions[i];
+        if (instruction->removed) continue;
+        const int line = instruction->line;
+        const int next = newOffset[i] + instruction->length;
+
+        if (isJump(instruction->opcode)) {
+            const int target = newOffset[instruction->target];
+            if (target >= next) {
+                writeChunk(&code, instruction->opcode == OP_LOOP ? OP_JUMP : instruction->opcode, line);
+                writeShort(&code, target - next, line);
+            } else {
+                writeChunk(&code, OP_LOOP, line);
+                writeShort(&code, next - target, line);
+            }
+        } else if (instruction->opcode == OP_PUSH_EXCEPTION_HANDLER) {
+            writeChunk(&code, instruction->opcode, line);
+            writeChunk(&code, chunk->code[instruction->offset + 1], line);
+            writeShort(&code, instruction->handler != NO_TARGET
+                                  ? newOffset[instruction->handler]
+                                  : NO_ADDRESS, line);
+            writeShort(&code, instruction->finally != NO_TARGET
+                                  ? newOffset[instruction->finally]
+                                  : NO_ADDRESS, line);
+        } else if (isSwitch(instruction->opcode)) {
+            const int header = switchHeader(instruction->opcode);
+            const int entryLength = switchEntry(instruction->opcode);
+            for (int byte = 0; byte < header; byte++) {
+                writeChunk(&code, chunk->code[instruction->offset + byte], line);
+            }
+            for (int entry = 0; entry < instruction->caseCount; entry++) {
+                const int at = instruction->offset + header + entry * entryLength;
+                for (int byte = 0; byte < entryLength - 2; byte++) {
+                    writeChunk(&code, chunk->code[at + byte], line);
+                }
+                const int target = program->cases[instruction->firstCase + entry];
+                writeShort(&code, target != NO_TARGET ? newOffset[target] : NO_CASE, line);
+            }
+        } else if (forwardJumpOperand(instruction->opcode)) {
+            const int operand = forwardJumpOperand(instruction->opcode);
+            for (int byte = 0; byte < operand; byte++) {
+                writeChunk(&code, chunk->code[instruction->offset + byte], line);
+            }
+            writeShort(&code, newOffset[instruction->target] - next, line);
+        } else if (instruction->rewritten) {
+            writeChunk(&code, instruction->opcode, line);
+            for (int byte = 1; byte < instruction->length; byte++) {
+                writeChunk(&code, instruction->operands[byte - 1], line);
+            }
+        } else {
+            writeChunk(&code, instruction->opcode, line);
+            for (int byte = 1; byte < instruction->length; byte++) {
+                writeChunk(&code, chunk->code[instruction->offset + byte], line);
+            }
+        }
+    }
+    FREE_ARRAY(int, newOffset, count + 1);
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->code = code.code;
+    chunk->count = code.count;
+    chunk->capacity = code.capacity;
+    chunk->lines = code.lines;
+    chunk->lineCount = code.lineCount;
+    chunk->lineCapacity = code.lineCapacity;
+}
+
+static void freeProgram(const Program* program) {
+    FREE_ARRAY(Instruction, program->instructions, program->count);
+    FREE_ARRAY(int, program->cases, program->caseCount);
+    FREE_ARRAY(bool, program->targeted, program->count + 1);
+}
+
+void optimizeChunk(Chunk* chunk) {
+    if (chunk->count == 0) return;
+
+    Program program = {.chunk = chunk};
+    decode(&program);
+
+    bool changed = false;
+    for (int pass = 0; pass < MAX_PASSES; pass++) {
+        bool passChanged = threadJumps(&program);
+        findTargets(&program);
+        passChanged |= removeDeadCode(&program);
+        findTargets(&program);
+        passChanged |= combinePairs(&program);
+        if (!passChanged) break;
+        changed = true;
+    }
+
+    if (changed) encode(&program);
+
+    freeProgram(&program);
+}
+
+// Runs the pass over the function and every function among its constants
+static void forEachFunction(ObjFunction* function, void (*pass)(ObjFunction*)) {
+    pass(function);
+
+    const ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            forEachFunction(AS_FUNCTION(constants->values[i]), pass);
+        }
+    }
+}
+
+static void optimizeOne(ObjFunction* function) {
+    optimizeIR(function);
+    optimizeChunk(&function->chunk);
+}
+
+void optimizeFunction(ObjFunction* function) {
+    // The passes allocate, and nothing else keeps the code alive yet
+    push(OBJ_VAL(function));
+    forEachFunction(function, optimizeOne);
+    inlineCalls(function);
+    pop();
+}
+
+#ifdef REGISTER_VM
+// Register form of a stack arithmetic or comparison instruction, either
+// storing the result to a local or pushing it. OP_LAST if there is none
+static uint8_t registerOpcode(const uint8_t opcode, const bool constant, const bool store) {
+    static const uint8_t forms[][4] = {
+        [OP_ADD] = {OP_REG_PUSH_ADD, OP_REG_PUSH_ADD_CONSTANT, OP_REG_ADD, OP_REG_ADD_CONSTANT},
+        [OP_SUBTRACT] = {
+            OP_REG_PUSH_SUBTRACT, OP_REG_PUSH_SUBTRACT_CONSTANT, OP_REG_SUBTRACT, OP_REG_SUBTRACT_CONSTANT
+        },
+        [OP_MULTIPLY] = {
+            OP_REG_PUSH_MULTIPLY, OP_REG_PUSH_MULTIPLY_CONSTANT, OP_REG_MULTIPLY, OP_REG_MULTIPLY_CONSTANT
+        },
+        [OP_DIVIDE] = {OP_REG_PUSH_DIVIDE, OP_REG_PUSH_DIVIDE_CONSTANT, OP_REG_DIVIDE, OP_REG_DIVIDE_CONSTANT},
+        [OP_MODULUS] = {
+            OP_REG_PUSH_MODULUS, OP_REG_PUSH_MODULUS_CONSTANT, OP_REG_MODULUS, OP_REG_MODULUS_CONSTANT
+        },
+        [OP_EQUAL] = {OP_REG_PUSH_EQUAL, OP_REG_PUSH_EQUAL_CONSTANT, OP_LAST, OP_LAST},
+        [OP_GREATER] = {OP_REG_PUSH_GREATER, OP_REG_PUSH_GREATER_CONSTANT, OP_LAST, OP_LAST},
+        [OP_LESS] = {OP_REG_PUSH_LESS, OP_REG_PUSH_LESS_CONSTANT, OP_LAST, OP_LAST},
+    };
+    if (opcode >= sizeof(forms) / sizeof(forms[0]) || forms[opcode][0] == 0) return OP_LAST;
+    return forms[opcode][(store ? 2 : 0) + (constant ? 1 : 0)];
+}
+
+static bool isConstantPush(const uint8_t opcode) {
+    return opcode == OP_CONSTANT || opcode == OP_CONSTANT_ZERO
+           || opcode == OP_CONSTANT_ONE || opcode == OP_CONSTANT_TWO;
+}
+
+// Constant table index of the value a constant instruction pushes, which
+// for the small ints has to be added first. -1 once the table is full
+static int constantOperand(const Program* program, const Instruction* instruction) {
+    Chunk* chunk = program->chunk;
+    if (instruction->opcode == OP_CONSTANT) return chunk->code[instruction->offset + 1];
+
+    const int32_t value = instruction->opcode - OP_CONSTANT_ZERO;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        const Value constant = chunk->constants.values[i];
+        if (IS_INT(constant) && AS_INT(constant) == value) return i;
+    }
+    if (chunk->constants.count > UINT8_MAX) return -1;
+    return addConstant(chunk, INT_VAL(value));
+}
+
+static uint8_t operandOf(const Program* program, const Instruction* instruction) {
+    return program->chunk->code[instruction->offset + 1];
+}
+
+static void rewrite(Instruction* instruction, const uint8_t opcode, const int length, const uint8_t* operands) {
+    instruction->opcode = opcode;
+    instruction->length = length;
+    instruction->rewritten = true;
+    for (int i = 0; i < length - 1; i++) instruction->operands[i] = operands[i];
+}
+
+// The instruction following index, unless something jumps to it
+static int nextUntargeted(const Program* program, const int index) {
+    const int next = nextLive(program, index);
+    return next < program->count && !program->targeted[next] ? next : program->count;
+}
+
+// Replaces loads of locals and constants feeding an arithmetic or
+// comparison instruction, and the store of the result to a local, by
+// one register instruction
+static bool fuseRegisterInstructions(const Program* program) {
+    bool changed = false;
+    for (int i = 0; i < program->count; i++) {
+        Instruction* first = &program->instructions[i];
+        if (first->removed) continue;
+
+        const int next = nextUntargeted(program, i);
+        const uint8_t nextOpcode = opcodeAt(program, next);
+        if (nextOpcode == OP_SET_LOCAL_POP
+            && (first->opcode == OP_GET_LOCAL || isConstantPush(first->opcode))) {
+            const uint8_t target = operandOf(program, &program->instructions[next]);
+            if (first->opcode == OP_GET_LOCAL) {
+                rewrite(first, OP_REG_MOVE, 3, (uint8_t[]){target, operandOf(program, first)});
+            } else {
+                const int constant = constantOperand(program, first);
+                if (constant < 0) continue;
+                rewrite(first, OP_REG_LOAD_CONSTANT, 3, (uint8_t[]){target, constant});
+            }
+            program->instructions[next].removed = true;
+            changed = true;
+            continue;
+        }
+
+        if (first->opcode != OP_GET_LOCAL) continue;
+        const bool constant = isConstantPush(nextOpcode);
+        if (nextOpcode != OP_GET_LOCAL && !constant) continue;
+
+        const int operation = nextUntargeted(program, next);
+        const int store = nextUntargeted(program, operation);
+        const uint8_t stackOpcode = opcodeAt(program, operation);
+        // Comparisons only come in the pushing form
+        const bool stored = opcodeAt(program, store) == OP_SET_LOCAL_POP
+                            && registerOpcode(stackOpcode, constant, true) != OP_LAST;
+        const uint8_t opcode = registerOpcode(stackOpcode, constant, stored);
+        if (opcode == OP_LAST) continue;
+
+        const int second = constant
+                               ? constantOperand(program, &program->instructions[next])
+                               : operandOf(program, &program->instructions[next]);
+        if (second < 0) continue;
+
+        if (stored) {
+            rewrite(first, opcode, REGISTER_STORE_LENGTH, (uint8_t[]){
+                        operandOf(program, first), second, stackOpcode,
+                        OP_SET_LOCAL_POP, operandOf(program, &program->instructions[store])
+                    });
+            program->instructions[store].removed = true;
+        } else {
+            rewrite(first, opcode, REGISTER_PUSH_LENGTH, (uint8_t[]){operandOf(program, first), second, stackOpcode});
+        }
+        // Errors in the fallback report the line of the operation
+        first->line = program->instructions[operation].line;
+        program->instructions[next].removed = true;
+        program->instructions[operation].removed = true;
+        changed = true;
+    }
+    return changed;
+}
+
+static void lowerOne(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    if (chunk->count == 0) return;
+
+    Program program = {.chunk = chunk};
+    decode(&program);
+    findTargets(&program);
+    if (fuseRegisterInstructions(&program)) encode(&program);
+
+    freeProgram(&program);
+}
+
+void lowerToRegisters(ObjFunction* function) {
+    push(OBJ_VAL(function));
+    forEachFunction(function, lowerOne);
+    pop();
+}
+#endif
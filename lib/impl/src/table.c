@@ -1,76 +1,432 @@
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <clox/table.h>
 #include <clox/value.h>
 
+#include <impl/heap.h>
 #include <impl/memory.h>
 #include <impl/object.h>
 
 #include <common/util.h>
 
+// Slots are probed in groups of this many control bytes
+#define GROUP_WIDTH 16
+
+// Tables smaller than a group repeat their control bytes to fill one
+#define TABLE_MIN_CAPACITY 8
+
+// Tables at least this large are resized incrementally
+#define TABLE_INCREMENTAL_MIN 1024
+
+// Slots of the previous storage moved by every insert or delete
+#define TABLE_MIGRATE_STEP 64
+
+// Full slots hold the low 7 bits of the hash, free slots have the top bit set
+#define CTRL_EMPTY ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xFE)
+
+#define IS_FULL(control) ((control) < 0x80)
+
+#define HASH_H1(hash) ((hash) >> 7)
+#define HASH_H2(hash) ((uint8_t) ((hash) & 0x7F))
+
+// One bit per slot of a group
+typedef uint32_t GroupMask;
+
+#ifdef __SSE2__
+
+static inline GroupMask matchByte(const uint8_t* group, const uint8_t byte) {
+    const __m128i control = _mm_loadu_si128((const __m128i*) group);
+    return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char) byte)));
+}
+
+static inline GroupMask matchFree(const uint8_t* group) {
+    return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+}
+
+#else
+
+static inline GroupMask matchByte(const uint8_t* group, const uint8_t byte) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        mask |= (GroupMask) (group[i] == byte) << i;
+    }
+    return mask;
+}
+
+static inline GroupMask matchFree(const uint8_t* group) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        mask |= (GroupMask) !IS_FULL(group[i]) << i;
+    }
+    return mask;
+}
+
+#endif
+
+static inline GroupMask matchEmpty(const uint8_t* group) {
+    return matchByte(group, CTRL_EMPTY);
+}
+
+#define IS_INLINE(table) ((table)->capacity == 0)
+#define IS_MIGRATING(table) (!IS_INLINE(table) && (table)->oldEntries != NULL)
+
+// One bit per inline slot whose key is the given one
+#ifdef __SSE2__
+
+static inline GroupMask matchInlineKey(const Table* table, const REF(ObjString) ref) {
+    REF(ObjString) const* keys = table->small.keys;
+    GroupMask mask = 0;
+#ifdef COMPRESSED_REFS
+    const __m128i needle = _mm_set1_epi32((int) ref);
+    for (int i = 0; i < TABLE_INLINE_CAPACITY; i += 4) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*) (keys + i));
+        const __m128i equal = _mm_cmpeq_epi32(chunk, needle);
+        mask |= (GroupMask) _mm_movemask_ps(_mm_castsi128_ps(equal)) << i;
+    }
+#else
+    const __m128i needle = _mm_set1_epi64x((long long) (uintptr_t) ref);
+    for (int i = 0; i < TABLE_INLINE_CAPACITY; i += 2) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*) (keys + i));
+        const __m128i equal = _mm_cmpeq_epi32(chunk, needle);
+        // Both halves of a pointer have to match
+        const int halves = _mm_movemask_ps(_mm_castsi128_ps(equal));
+        const int both = halves & (halves >> 1);
+        mask |= (GroupMask) ((both & 1) | ((both >> 1) & 2)) << i;
+    }
+#endif
+    return mask & (((GroupMask) 1 << table->count) - 1);
+}
+
+#else
+
+static inline GroupMask matchInlineKey(const Table* table, const REF(ObjString) ref) {
+    GroupMask mask = 0;
+    for (int i = 0; i < table->count; i++) {
+        mask |= (GroupMask) (table->small.keys[i] == ref) << i;
+    }
+    return mask;
+}
+
+#endif
+
+static int findInline(const Table* table, const ObjString* key) {
+    const GroupMask match = matchInlineKey(table, MAKE_REF(key));
+    return match != 0 ? __builtin_ctz(match) : -1;
+}
+
+// Keeps the taken slots at the front by moving the last one into the hole
+static void removeInline(Table* table, const int index) {
+    const int last = --table->count;
+    table->small.keys[index] = table->small.keys[last];
+    table->small.values[index] = table->small.values[last];
+    table->small.keys[last] = NULL_REF;
+}
+
+static int maxLoad(const int capacity) {
+    return (int) (capacity * TABLE_MAX_LOAD);
+}
+
+// Smallest capacity that holds count entries without a rehash
+static int capacityFor(const int count) {
+    int capacity = TABLE_MIN_CAPACITY;
+    while (maxLoad(capacity) < count) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
 void initTable(Table* table) {
     table->count = 0;
     table->capacity = 0;
-    table->entries = NULL;
+    for (int i = 0; i < TABLE_INLINE_CAPACITY; i++) {
+        table->small.keys[i] = NULL_REF;
+    }
+}
+
+// Entries and control bytes share one allocation, the control bytes
+// following the entries
+static size_t tableBytes(const int capacity) {
+    return capacity * sizeof(Entry) + (size_t) capacity + GROUP_WIDTH;
+}
+
+static void freeStorage(Entry* entries, const int capacity) {
+    if (entries == NULL) return;
+    reallocate(entries, tableBytes(capacity), 0);
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (!IS_INLINE(table)) {
+        freeStorage(table->entries, table->capacity);
+        freeStorage(table->oldEntries, table->oldCapacity);
+    }
     initTable(table);
 }
 
+// Hashed entries of a table, either the current or the previous ones
+typedef struct {
+    Entry* entries;
+    uint8_t* control;
+    int capacity;
+} Storage;
 
-static Entry* findEntry(Entry* entries, const int capacity, const ObjString* key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
-    while (true) {
-        Entry* entry = &entries[index];
+static Storage currentStorage(const Table* table) {
+    return (Storage){table->entries, table->control, table->capacity};
+}
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            }
-            if (tombstone == NULL) {
-                tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key
-            return entry;
+static Storage previousStorage(const Table* table) {
+    return (Storage){table->oldEntries, table->oldControl, table->oldCapacity};
+}
+
+static bool inStorage(const Storage storage, const Entry* entry) {
+    return entry >= storage.entries && entry < storage.entries + storage.capacity;
+}
+
+// The control bytes are repeated past the end, so a group can be loaded
+// from any slot without wrapping around
+static void setControl(const Storage storage, const int index, const uint8_t control) {
+    storage.control[index] = control;
+    for (int copy = index + storage.capacity;
+         copy < storage.capacity + GROUP_WIDTH;
+         copy += storage.capacity) {
+        storage.control[copy] = control;
+    }
+}
+
+// Slots of a group that are distinct, a small table shows up in a group repeatedly
+static GroupMask groupWindow(const Storage storage) {
+    return storage.capacity < GROUP_WIDTH
+               ? ((GroupMask) 1 << storage.capacity) - 1
+               : ((GroupMask) 1 << GROUP_WIDTH) - 1;
+}
+
+static Entry* findInStorage(const Storage storage, const ObjString* key) {
+    const REF(ObjString) ref = MAKE_REF(key);
+    const int mask = storage.capacity - 1;
+    const uint8_t h2 = HASH_H2(key->hash);
+    const GroupMask window = groupWindow(storage);
+    int position = (int) (HASH_H1(key->hash) & (uint32_t) mask);
+
+    for (int step = GROUP_WIDTH; ; step += GROUP_WIDTH) {
+        const uint8_t* group = storage.control + position;
+        for (GroupMask match = matchByte(group, h2) & window; match != 0; match &= match - 1) {
+            Entry* entry = &storage.entries[(position + __builtin_ctz(match)) & mask];
+            if (entry->key == ref) return entry;
         }
+        // The key would have been placed in the first group with room
+        if (matchEmpty(group) != 0) return NULL;
+        position = (position + step) & mask;
+    }
+}
 
-        index = (index + 1) & (capacity - 1);
+// Until a resize is done, a key is in one of the two storages
+static Entry* findEntry(const Table* table, const ObjString* key) {
+    Entry* entry = findInStorage(currentStorage(table), key);
+    if (entry == NULL && IS_MIGRATING(table)) {
+        entry = findInStorage(previousStorage(table), key);
     }
+    return entry;
 }
 
+static int findFreeSlot(const Storage storage, const uint32_t hash) {
+    const int mask = storage.capacity - 1;
+    int position = (int) (HASH_H1(hash) & (uint32_t) mask);
 
-static void adjustCapacity(Table* table, const int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    for (int step = GROUP_WIDTH; ; step += GROUP_WIDTH) {
+        const GroupMask free = matchFree(storage.control + position);
+        if (free != 0) {
+            return (position + __builtin_ctz(free)) & mask;
+        }
+        position = (position + step) & mask;
+    }
+}
 
-    for (int i = 0; i < capacity; i++) {
-        entries[i] = (Entry){NULL, NIL_VAL};
+static void placeEntry(Table* table, REF(ObjString) key, const Value value) {
+    const Storage storage = currentStorage(table);
+    const uint32_t hash = DEREF(ObjString, key)->hash;
+    const int index = findFreeSlot(storage, hash);
+    if (storage.control[index] == CTRL_EMPTY) {
+        table->growthLeft--;
     }
+    setControl(storage, index, HASH_H2(hash));
+    storage.entries[index] = (Entry){key, value};
+}
+
+static void placeStorage(Table* table, const Storage storage, const int from) {
+    for (int i = from; i < storage.capacity; i++) {
+        if (!IS_FULL(storage.control[i])) continue;
+        placeEntry(table, storage.entries[i].key, storage.entries[i].value);
+    }
+}
+
+static void finishMigration(Table* table) {
+    freeStorage(table->oldEntries, table->oldCapacity);
+    table->oldEntries = NULL;
+    table->oldControl = NULL;
+    table->oldCapacity = 0;
+    table->migrated = 0;
+}
+
+// Moves the next slots of the previous storage over
+static void migrate(Table* table, const int slots) {
+    if (!IS_MIGRATING(table)) return;
+
+    const Storage previous = previousStorage(table);
+    const int end = previous.capacity - table->migrated > slots
+                        ? table->migrated + slots
+                        : previous.capacity;
+    for (int i = table->migrated; i < end; i++) {
+        if (!IS_FULL(previous.control[i])) continue;
+        placeEntry(table, previous.entries[i].key, previous.entries[i].value);
+        // Lookups must not find it here once it is gone from the new storage
+        setControl(previous, i, CTRL_DELETED);
+    }
+    table->migrated = end;
+
+    if (end == previous.capacity) {
+        finishMigration(table);
+    }
+}
 
+// Large tables keep their previous storage around and move it over a
+// few slots at a time, so no single insert pays for the whole rehash.
+// That takes one step per insert at most, the new storage has to have
+// room for as many inserts.
+static bool resizeIncrementally(const Table* old, const int capacity) {
+    if (IS_INLINE(old) || old->capacity < TABLE_INCREMENTAL_MIN) return false;
+
+    const int steps = (old->capacity + TABLE_MIGRATE_STEP - 1) / TABLE_MIGRATE_STEP;
+    return maxLoad(capacity) - old->count > steps;
+}
+
+static void resize(Table* table, const int capacity) {
+    Entry* newEntries = reallocate(NULL, 0, tableBytes(capacity));
+    uint8_t* newControl = (uint8_t*) (newEntries + capacity);
+    memset(newControl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+
+    // Allocating may have run a collection that pruned the table,
+    // so it is only read from here on
+    const Table old = *table;
+
+    table->entries = newEntries;
+    table->control = newControl;
+    table->capacity = capacity;
+    table->growthLeft = maxLoad(capacity);
+    table->migrated = 0;
+    table->oldEntries = NULL;
+    table->oldControl = NULL;
+    table->oldCapacity = 0;
+
+    if (IS_INLINE(&old)) {
+        for (int i = 0; i < old.count; i++) {
+            placeEntry(table, old.small.keys[i], old.small.values[i]);
+        }
+        return;
+    }
+
+    // Whatever an unfinished resize did not move yet comes along
+    if (IS_MIGRATING(&old)) {
+        placeStorage(table, previousStorage(&old), old.migrated);
+        freeStorage(old.oldEntries, old.oldCapacity);
+    }
+
+    if (resizeIncrementally(&old, capacity)) {
+        table->oldEntries = old.entries;
+        table->oldControl = old.control;
+        table->oldCapacity = old.capacity;
+    } else {
+        placeStorage(table, currentStorage(&old), 0);
+        freeStorage(old.entries, old.capacity);
+    }
+}
+
+static void moveInline(Table* table) {
+    const Table old = *table;
+
+    table->capacity = 0;
     table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        const Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+    for (int i = 0; i < old.capacity; i++) {
+        if (!IS_FULL(old.control[i])) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        table->small.keys[table->count] = old.entries[i].key;
+        table->small.values[table->count] = old.entries[i].value;
         table->count++;
     }
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    for (int i = table->count; i < TABLE_INLINE_CAPACITY; i++) {
+        table->small.keys[i] = NULL_REF;
+    }
+    freeStorage(old.entries, old.capacity);
+}
 
-    table->entries = entries;
-    table->capacity = capacity;
+// Out of empty slots, either because the table is full or because
+// deletes left tombstones behind. The latter only needs a cleanup,
+// at a smaller size if most of the table is gone. Otherwise it doubles,
+// a same sized rehash of a nearly full table would soon be needed again.
+static void rehashForInsert(Table* table) {
+    if (table->count < maxLoad(table->capacity) / 2) {
+        resize(table, capacityFor(table->count * 2));
+    } else {
+        resize(table, table->capacity * 2);
+    }
+}
+
+static void shrinkIfSparse(Table* table) {
+    if (IS_MIGRATING(table)) return;
+
+    if (table->count <= TABLE_INLINE_CAPACITY / 2) {
+        moveInline(table);
+    } else if (table->capacity > TABLE_MIN_CAPACITY &&
+               table->count < maxLoad(table->capacity) / 4) {
+        resize(table, capacityFor(table->count * 2));
+    }
+}
+
+// A slot only becomes empty again if no probe could have passed over it,
+// that is if the run of taken slots around it is shorter than a group.
+// The previous storage only gets tombstones, nothing is added to it.
+static void eraseEntry(Table* table, Entry* entry) {
+    const Storage current = currentStorage(table);
+    if (!inStorage(current, entry)) {
+        const Storage previous = previousStorage(table);
+        setControl(previous, (int) (entry - previous.entries), CTRL_DELETED);
+    } else {
+        const int mask = current.capacity - 1;
+        const int index = (int) (entry - current.entries);
+        const GroupMask emptyBefore = matchEmpty(current.control + ((index - GROUP_WIDTH) & mask));
+        const GroupMask emptyAfter = matchEmpty(current.control + index);
+        const bool wasNeverFull = emptyBefore != 0 && emptyAfter != 0 &&
+            __builtin_ctz(emptyAfter) + (__builtin_clz(emptyBefore) - 16) < GROUP_WIDTH;
+
+        if (wasNeverFull) {
+            setControl(current, index, CTRL_EMPTY);
+            table->growthLeft++;
+        } else {
+            setControl(current, index, CTRL_DELETED);
+        }
+    }
+    entry->key = NULL_REF;
+    entry->value = NIL_VAL;
+    table->count--;
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    const Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (IS_INLINE(table)) {
+        const int index = findInline(table, key);
+        if (index < 0) return false;
+        if (value != NULL) {
+            *value = table->small.values[index];
+        }
+        return true;
+    }
+
+    const Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
     if (value != NULL) {
         *value = entry->value;
@@ -79,38 +435,91 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
+static bool setInline(Table* table, ObjString* key, const Value value) {
+    const int index = findInline(table, key);
+    if (index >= 0) {
+        table->small.values[index] = value;
+        return false;
+    }
+
+    table->small.keys[table->count] = MAKE_REF(key);
+    table->small.values[table->count] = value;
+    table->count++;
+    return true;
+}
+
 bool tableSet(Table* table, ObjString* key, const Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        const int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    if (IS_INLINE(table)) {
+        if (table->count < TABLE_INLINE_CAPACITY || findInline(table, key) >= 0) {
+            return setInline(table, key, value);
+        }
+        resize(table, capacityFor(table->count + 1));
+    } else {
+        migrate(table, TABLE_MIGRATE_STEP);
+        Entry* entry = findEntry(table, key);
+        if (entry != NULL) {
+            entry->value = value;
+            return false;
+        }
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    const bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    const int index = findFreeSlot(currentStorage(table), key->hash);
+    if (table->control[index] == CTRL_EMPTY && table->growthLeft == 0) {
+        rehashForInsert(table);
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    placeEntry(table, MAKE_REF(key), value);
+    table->count++;
+    return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (IS_INLINE(table)) {
+        const int index = findInline(table, key);
+        if (index < 0) return false;
+        removeInline(table, index);
+        return true;
+    }
 
-    entry->key = NULL;
-    entry->value = BOOL_VAL(false);
+    migrate(table, TABLE_MIGRATE_STEP);
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
+
+    eraseEntry(table, entry);
+    shrinkIfSparse(table);
     return true;
 }
 
 void tableAddAll(Table* from, Table* to) {
-    for (int i = 0; i < from->capacity; i++) {
-        const Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+    for (TableIterator it = newTableIterator(from); !it.done; advanceTableIterator(&it)) {
+        tableSet(to, getKeyTableIterator(&it), getValueTableIterator(&it));
+    }
+}
+
+static ObjString* findStringInStorage(
+    const Storage storage, const char* chars,
+    const int length, const uint32_t hash
+) {
+    const int mask = storage.capacity - 1;
+    const uint8_t h2 = HASH_H2(hash);
+    const GroupMask window = groupWindow(storage);
+    int position = (int) (HASH_H1(hash) & (uint32_t) mask);
+
+    for (int step = GROUP_WIDTH; ; step += GROUP_WIDTH) {
+        const uint8_t* group = storage.control + position;
+        for (GroupMask match = matchByte(group, h2) & window; match != 0; match &= match - 1) {
+            const Entry* entry = &storage.entries[(position + __builtin_ctz(match)) & mask];
+            ObjString* key = DEREF(ObjString, entry->key);
+            if (key->length == length &&
+                key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
+        if (matchEmpty(group) != 0) return NULL;
+        position = (position + step) & mask;
     }
 }
 
@@ -120,21 +529,23 @@ ObjString* tableFindString(
 ) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    while (true) {
-        const Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find non-empty tombstone
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-
-            return entry->key;
+    if (IS_INLINE(table)) {
+        for (int i = 0; i < table->count; i++) {
+            ObjString* key = DEREF(ObjString, table->small.keys[i]);
+            if (key->length == length &&
+                key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
+        return NULL;
+    }
 
-        index = (index + 1) & (table->capacity - 1);
+    ObjString* string = findStringInStorage(currentStorage(table), chars, length, hash);
+    if (string == NULL && IS_MIGRATING(table)) {
+        string = findStringInStorage(previousStorage(table), chars, length, hash);
     }
+    return string;
 }
 
 ObjString* tableFindOrAddString(
@@ -148,54 +559,143 @@ ObjString* tableFindOrAddString(
     return string;
 }
 
-void tableRemoveWhite(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        const Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+static void removeFromStorage(Table* table, const Storage storage, const TableEntryPredicate remove) {
+    for (int i = 0; i < storage.capacity; i++) {
+        if (!IS_FULL(storage.control[i])) continue;
+
+        Entry* entry = &storage.entries[i];
+        if (remove(DEREF(ObjString, entry->key), entry->value)) {
+            eraseEntry(table, entry);
         }
     }
 }
 
-void markTable(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        const Entry* entry = &table->entries[i];
-        markObject((Obj*) entry->key);
+void tableRemoveIf(Table* table, const TableEntryPredicate remove) {
+    if (IS_INLINE(table)) {
+        for (int i = table->count - 1; i >= 0; i--) {
+            if (remove(DEREF(ObjString, table->small.keys[i]), table->small.values[i])) {
+                removeInline(table, i);
+            }
+        }
+        return;
+    }
+
+    removeFromStorage(table, currentStorage(table), remove);
+    if (IS_MIGRATING(table)) {
+        removeFromStorage(table, previousStorage(table), remove);
+    }
+    // Not shrunk here, resizing allocates and this runs during a collection.
+    // The tombstones go with the next rehash.
+}
+
+static bool isWhite(ObjString* key, [[maybe_unused]] const Value value) {
+    return !heapIsMarked(key);
+}
+
+void tableRemoveWhite(Table* table) {
+    tableRemoveIf(table, isWhite);
+}
+
+static void markStorage(const Storage storage) {
+    for (int i = 0; i < storage.capacity; i++) {
+        if (!IS_FULL(storage.control[i])) continue;
+
+        const Entry* entry = &storage.entries[i];
+        markObject(DEREF(Obj, entry->key));
         markValue(entry->value);
     }
 }
 
+void markTable(Table* table) {
+    if (IS_INLINE(table)) {
+        for (int i = 0; i < table->count; i++) {
+            markObject(DEREF(Obj, table->small.keys[i]));
+            markValue(table->small.values[i]);
+        }
+        return;
+    }
+
+    markStorage(currentStorage(table));
+    if (IS_MIGRATING(table)) {
+        markStorage(previousStorage(table));
+    }
+}
+
+// Iterator indices run over the inline slots, or over the current
+// storage followed by the previous one
+static int slotCount(const Table* table) {
+    if (IS_INLINE(table)) return table->count;
+    return table->capacity + (IS_MIGRATING(table) ? table->oldCapacity : 0);
+}
+
+static Entry* entryAt(const Table* table, const int index) {
+    return index < table->capacity
+               ? &table->entries[index]
+               : &table->oldEntries[index - table->capacity];
+}
+
+static bool isFullAt(const Table* table, const int index) {
+    return index < table->capacity
+               ? IS_FULL(table->control[index])
+               : IS_FULL(table->oldControl[index - table->capacity]);
+}
+
+static int nextFullSlot(const Table* table, int index) {
+    if (IS_INLINE(table)) return index;
+
+    const int slots = slotCount(table);
+    while (index < slots && !isFullAt(table, index)) {
+        index++;
+    }
+    return index;
+}
+
+// Slots are numbered like the iterator indices
+int tableFindSlot(Table* table, ObjString* key) {
+    if (table->count == 0) return -1;
+    if (IS_INLINE(table)) return findInline(table, key);
+
+    const Entry* entry = findEntry(table, key);
+    if (entry == NULL) return -1;
+    return inStorage(currentStorage(table), entry)
+               ? (int) (entry - table->entries)
+               : table->capacity + (int) (entry - table->oldEntries);
+}
+
+Value tableGetSlot(const Table* table, const int slot) {
+    return IS_INLINE(table) ? table->small.values[slot] : entryAt(table, slot)->value;
+}
+
+void tableSetSlot(Table* table, const int slot, const Value value) {
+    if (IS_INLINE(table)) {
+        table->small.values[slot] = value;
+    } else {
+        entryAt(table, slot)->value = value;
+    }
+}
+
 TableIterator newTableIterator(Table* table) {
+    const int index = nextFullSlot(table, 0);
     TableIterator it = {
         .table = table,
-        .index = 0,
-        .done = false
+        .index = index,
+        .done = index >= slotCount(table)
     };
-    while(table->entries[it.index].key == NULL) {
-        advanceTableIterator(&it);
-    }
     return it;
 }
 
 void advanceTableIterator(TableIterator* it) {
-    Entry* entries = it->table->entries;
-    int index = it->index + 1;
-    while (!it->done && index < it->table->capacity) {
-        Entry* entry = &entries[index];
-
-        if (entry->key != NULL) {
-            it->index = index;
-            return;
-        } 
-        index = (index + 1) & (it->table->capacity - 1);
-    }
+    if (it->done) return;
 
-    it->done = true;
+    it->index = nextFullSlot(it->table, it->index + 1);
+    it->done = it->index >= slotCount(it->table);
 }
 
 ObjString* getKeyTableIterator(TableIterator* it) {
-    Entry* entry = &it->table->entries[it->index];
-    ObjString* string = entry->key;
+    const Table* table = it->table;
+    ObjString* string = IS_INLINE(table)
+                            ? DEREF(ObjString, table->small.keys[it->index])
+                            : DEREF(ObjString, entryAt(table, it->index)->key);
     massert(string != NULL, "Tried to iterate over an empty slot");
     return string;
 }
@@ -203,5 +703,7 @@ ObjString* getKeyTableIterator(TableIterator* it) {
 Value getValueTableIterator(TableIterator* it) {
     [[maybe_unused]] ObjString* key = getKeyTableIterator(it);
     massert(key != NULL, "Tried to iterate over an empty slot");
-    return it->table->entries[it->index].value;
+    return IS_INLINE(it->table)
+               ? it->table->small.values[it->index]
+               : entryAt(it->table, it->index)->value;
 }
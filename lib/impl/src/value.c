@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -6,6 +7,14 @@
 
 #include <impl/memory.h>
 
+Value canonicalNumber(const double number) {
+    if (number >= INT32_MIN && number <= INT32_MAX
+        && (double) (int32_t) number == number && !(number == 0 && signbit(number))) {
+        return INT_VAL((int32_t) number);
+    }
+    return NUMBER_VAL(number);
+}
+
 bool valuesEqual(Value a, Value b) {
     if (IS_INSTANCE(a) && !IS_INSTANCE(AS_INSTANCE(a)->this_)) {
         a = AS_INSTANCE(a)->this_;
@@ -19,11 +28,13 @@ bool valuesEqual(Value a, Value b) {
     }
     return a == b;
 #else
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
     if (a.type != b.type) return false;
     switch (a.type) {
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL: return true;
-    case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
     default: return false; // Unreachable
     }
@@ -107,7 +118,8 @@ void printValue(FILE* out, const Value value) {
         break;
     case VAL_NIL: fprintf(out, "nil");
         break;
-    case VAL_NUMBER: fprintf(out, "%g", AS_NUMBER(value));
+    case VAL_NUMBER:
+    case VAL_INT: fprintf(out, "%g", AS_NUMBER(value));
         break;
     case VAL_OBJ: printObject(out, value);
         break;
@@ -11,9 +11,11 @@
 #include <clox/vm.h>
 
 #include <impl/compiler.h>
+#include <impl/heap.h>
 #include <impl/memory.h>
 #include <impl/native.h>
 #include <impl/object.h>
+#include <impl/optimizer.h>
 #include <impl/vm.h>
 
 
@@ -57,7 +59,31 @@ static inline ObjFunction* getFrameFunction(const CallFrame* frame) {
         return (ObjFunction*) frame->function;
     }
 
-    return ((ObjClosure*) frame->function)->function;
+    return DEREF(ObjFunction, ((ObjClosure*) frame->function)->function);
+}
+
+// Stack trace entries of a frame, innermost first. A frame running code
+// inlined from another function stands for that function's frame too
+static int traceFrame(const CallFrame* frame, int lines[2], const char* names[2]) {
+    ObjFunction* function = getFrameFunction(frame);
+    Chunk* chunk = &function->chunk;
+    const int instruction = (int) (frame->ip - chunk->code - 1);
+    int count = 0;
+
+    // The inlined code keeps the lines of the function it came from
+    lines[count] = getLine(chunk, instruction);
+    const int call = inlinedCallAt(chunk, instruction);
+    if (call != -1) {
+        const int constant = chunk->code[call + (chunk->code[call] == OP_INLINE_INVOKE ? 2 : 1)];
+        const ObjFunction* inlined = AS_FUNCTION(chunk->constants.values[constant]);
+        names[count++] = DEREF(ObjString, inlined->name)->chars;
+        lines[count] = getLine(chunk, call);
+    }
+
+    names[count++] = function->name != NULL_REF
+                         ? DEREF(ObjString, function->name)->chars
+                         : "script";
+    return count;
 }
 
 void runtimeError(const char* format, ...) {
@@ -68,13 +94,12 @@ void runtimeError(const char* format, ...) {
     fprintf(stderr, "\n");
 
     for (int i = vm.frameCount - 1; i >= 0; i--) {
-        const CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = getFrameFunction(frame);
-        const size_t instruction = frame->ip - function->chunk.code - 1;
-        const int line = getLine(&function->chunk, (int) instruction);
-
-        const char* name = function->name ? function->name->chars : "script";
-        fprintf(stderr, "[line %d] in %s\n", line, name);
+        int lines[2];
+        const char* names[2];
+        const int entries = traceFrame(&vm.frames[i], lines, names);
+        for (int entry = 0; entry < entries; entry++) {
+            fprintf(stderr, "[line %d] in %s\n", lines[entry], names[entry]);
+        }
     }
 
     resetStack();
@@ -235,7 +260,6 @@ static void initNative() {
 
 void initVM() {
     resetStack();
-    vm.objects = NULL;
     vm.exit_code = 0;
     vm.exit_state_ready = false;
 
@@ -249,18 +273,32 @@ void initVM() {
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.immortals = (ObjList){NULL, 0, 0};
+    vm.rememberedImmortals = (ObjList){NULL, 0, 0};
+    vm.immortalSection = -1;
+    vm.arena = ARENA_OFF;
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.heapExhausted = false;
+    if (!vm.gcConfigured) {
+        const GCConfig config = defaultGCConfig();
+        configureGC(&config);
+    }
+    vm.nextGC = vm.gc.initialThreshold;
 
     initTable(&vm.globals);
+    initTable(&vm.constantGlobals);
     initTable(&vm.strings);
 
     // Make sure initString is not null
     // because of GC
     vm.initString = NULL;
-    vm.initString = copyString("init", 4);
 
+    // Builtins live as long as the VM does
+    beginImmortal();
+    vm.initString = copyString("init", 4);
     initNative();
+    endImmortal();
+
     vm.exit_state_ready = false;
 }
 
@@ -270,16 +308,20 @@ void freeVM() {
         dlclose(nativeState.nativeLibHandles[i].handle);
     }
     free(nativeState.nativeLibHandles);
-    free(nativeState.nativeArgs);
+    FREE_ARRAY(Value, nativeState.nativeArgs, nativeState.nativeArgsCap);
     
     freeTable(&vm.globals);
+    freeTable(&vm.constantGlobals);
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeObjects();
     free(vm.grayStack);
 #ifdef DEBUG_LOG_GC
     printf("%td bytes still allocated by the VM.\n", vm.bytesAllocated);
+    printf("%zu bytes still mapped by the heap, %zu committed.\n",
+           heapMappedBytes(), heapCommittedBytes());
 #endif
+    freeHeap();
 }
 
 int vmExitCode() {
@@ -340,6 +382,99 @@ static void unpackPrimitive(const int distance) {
     }
 }
 
+// The result of int arithmetic, or the double it overflows into
+static inline Value intResult(const int64_t result) {
+    return result >= INT32_MIN && result <= INT32_MAX
+               ? INT_VAL((int32_t) result)
+               : NUMBER_VAL((double) result);
+}
+
+// As doubles, a zero product with a negative factor is -0
+static inline Value intProduct(const int64_t a, const int64_t b) {
+    return a * b == 0 && (a < 0 || b < 0) ? NUMBER_VAL(-0.0) : intResult(a * b);
+}
+
+// Only for a positive divisor. fmod keeps the sign of the dividend,
+// even on a zero remainder
+static inline Value intRemainder(const int32_t a, const int32_t b) {
+    const int32_t remainder = a % b;
+    return remainder == 0 && a < 0 ? NUMBER_VAL(-0.0) : INT_VAL(remainder);
+}
+
+// The value a switch compares with its cases, a primitive taken out of
+// the instance boxing it
+static Value switchValue(const Value value) {
+    if (IS_INSTANCE(value) && !IS_INSTANCE(AS_INSTANCE(value)->this_)) {
+        return AS_INSTANCE(value)->this_;
+    }
+    return value;
+}
+
+// The condition of a counting loop, for an int counter and limit
+static inline bool forCondition(const int32_t counter, const int32_t limit, const uint8_t flags) {
+    const bool holds = flags & FOR_GREATER ? counter > limit : counter < limit;
+    return flags & FOR_NEGATED ? !holds : holds;
+}
+
+// The arithmetic of an in-place update, as the stack instructions do it
+// for numbers. False when the values aren't both numbers, leaving them
+// to the stack instructions
+static bool updateArithmetic(const uint8_t operator, const Value a, const Value b, Value* result) {
+    if (IS_INT(a) && IS_INT(b)) {
+        const int64_t x = AS_INT(a);
+        const int64_t y = AS_INT(b);
+        switch (operator) {
+        case OP_ADD: *result = intResult(x + y);
+            return true;
+        case OP_SUBTRACT: *result = intResult(x - y);
+            return true;
+        case OP_MULTIPLY: *result = intProduct(x, y);
+            return true;
+        case OP_MODULUS:
+            if (y <= 0) break;
+            *result = intRemainder((int32_t) x, (int32_t) y);
+            return true;
+        default: break;
+        }
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    const double x = AS_NUMBER(a);
+    const double y = AS_NUMBER(b);
+    switch (operator) {
+    case OP_ADD: *result = NUMBER_VAL(x + y);
+        return true;
+    case OP_SUBTRACT: *result = NUMBER_VAL(x - y);
+        return true;
+    case OP_MULTIPLY: *result = NUMBER_VAL(x * y);
+        return true;
+    case OP_DIVIDE: *result = NUMBER_VAL(x / y);
+        return true;
+    case OP_MODULUS: *result = NUMBER_VAL(fmod(x, y));
+        return true;
+    default: return false;
+    }
+}
+
+// Raises base to a non-negative exponent by squaring, failing once the
+// result no longer fits an int32 and has to be left to pow
+static bool intPower(int64_t base, int32_t exponent, Value* result) {
+    int64_t power = 1;
+    while (exponent > 0) {
+        if (exponent & 1) {
+            power *= base;
+            if (power < INT32_MIN || power > INT32_MAX) return false;
+        }
+        exponent >>= 1;
+        if (exponent > 0) {
+            base *= base;
+            if (base > INT32_MAX) return false;
+        }
+    }
+    *result = INT_VAL((int32_t) power);
+    return true;
+}
+
 static bool promote(const int distance, ObjClass* klass) {
     const Value value = peek(distance);
     push(OBJ_VAL(newPrimitive(value, klass))); // This
@@ -370,18 +505,19 @@ static bool tryPromote(const int distance) {
 
 static Value getStackTrace(void) {
 #define MAX_LINE_LENGTH 512
-    const int maxStackTraceLength = vm.frameCount * MAX_LINE_LENGTH;
+    // Frames running inlined code take two entries
+    const int maxStackTraceLength = 2 * vm.frameCount * MAX_LINE_LENGTH;
     char* stackTrace = ALLOCATE(char, maxStackTraceLength);
     uint16_t index = 0;
     for (int i = vm.frameCount - 1; i >= 0; i--) {
-        const CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = getFrameFunction(frame);
-        const ptrdiff_t instruction = frame->ip - function->chunk.code - 1;
-        const uint32_t lineno = getLine(&function->chunk, (int) instruction);
-        index += snprintf(
-            &stackTrace[index], MAX_LINE_LENGTH,
-            "[line %d] in %s()\n", lineno,
-            function->name == NULL ? "script" : function->name->chars);
+        int lines[2];
+        const char* names[2];
+        const int entries = traceFrame(&vm.frames[i], lines, names);
+        for (int entry = 0; entry < entries; entry++) {
+            index += snprintf(
+                &stackTrace[index], MAX_LINE_LENGTH,
+                "[line %d] in %s()\n", lines[entry], names[entry]);
+        }
     }
     stackTrace = GROW_ARRAY(char, stackTrace, maxStackTraceLength, index + 1);
     return OBJ_VAL(takeString(stackTrace, index));
@@ -389,7 +525,7 @@ static Value getStackTrace(void) {
 }
 
 static bool instanceof(const ObjInstance* instance, const Value klass) {
-    return IS_CLASS(klass) && instance->klass == AS_CLASS(klass);
+    return IS_CLASS(klass) && DEREF(ObjClass, instance->klass) == AS_CLASS(klass);
 }
 
 static void closeUpvalues(const Value* last);
@@ -409,10 +545,14 @@ static bool propagateException(void) {
         CallFrame* frame = &vm.frames[vm.frameCount - 1];
         for (int numHandlers = frame->handlerCount; numHandlers > 0; numHandlers--) {
             const ExceptionHandler handler = frame->handlerStack[numHandlers - 1];
+            // Drop whatever the try block and the unwound calls left behind
+            closeUpvalues(handler.stackTop);
+            vm.stackTop = handler.stackTop;
+            push(OBJ_VAL(exception));
+
             if (instanceof(exception, handler.klass)) {
                 frame->handlerCount = numHandlers;
                 frame->ip = &getFrameFunction(frame)->chunk.code[handler.handlerAddress];
-                closeUpvalues(frame->slots);
                 return true;
             }
 
@@ -425,10 +565,11 @@ static bool propagateException(void) {
         }
         vm.frameCount--;
     }
-    fprintf(stderr, "Unhandled %s", exception->klass->name->chars);
+    const ObjClass* klass = DEREF(ObjClass, exception->klass);
+    fprintf(stderr, "Unhandled %s", DEREF(ObjString, klass->name)->chars);
     Value exceptionClass, message;
     if (tableGet(&vm.globals, copyString("Exception", 9), &exceptionClass) &&
-        exception->klass == AS_CLASS(exceptionClass) &&
+        klass == AS_CLASS(exceptionClass) &&
         tableGet(&exception->fields, copyString("message", 7), &message) &&
         IS_STRING(message)) {
         fprintf(stderr, ": \"%s\"", AS_STRING(message)->chars);
@@ -443,6 +584,43 @@ static bool propagateException(void) {
 #undef PLACEHOLDER_ADDRESS
 }
 
+static bool throwException() {
+    push(getStackTrace());
+    const Value value = peek(1);
+    if (IS_INSTANCE(value)) {
+        push(OBJ_VAL(copyString("stackTrace", 10)));
+        tableSet(&AS_INSTANCE(value)->fields, AS_STRING(peek(0)), peek(1));
+        pop();
+    }
+    pop();
+    return propagateException();
+}
+
+static bool throwOutOfMemory() {
+    vm.heapExhausted = false;
+
+    Value exceptionClass;
+    if (!tableGet(&vm.globals, copyString("Exception", 9), &exceptionClass) ||
+        !IS_CLASS(exceptionClass)) {
+        runtimeError("Out of memory, heap limit of %zu bytes exceeded", vm.gc.maxHeap);
+        return false;
+    }
+
+    ObjInstance* exception = newInstance(AS_CLASS(exceptionClass));
+    push(OBJ_VAL(exception));
+    push(OBJ_VAL(copyString("message", 7)));
+    push(OBJ_VAL(copyString("Out of memory", 13)));
+    tableSet(&exception->fields, AS_STRING(peek(1)), peek(0));
+    pop();
+    pop();
+    const bool caught = throwException();
+
+    // Building the exception may go over the limit again, that is checked
+    // anew once the handler has had a chance to drop references
+    vm.heapExhausted = false;
+    return caught;
+}
+
 static void pushExceptionHandler(
     const Value type, const uint16_t handlerAddress, const uint16_t finallyAddress
 ) {
@@ -455,6 +633,7 @@ static void pushExceptionHandler(
         .klass = type,
         .handlerAddress = handlerAddress,
         .finallyAddress = finallyAddress,
+        .stackTop = vm.stackTop,
     };
 }
 
@@ -480,7 +659,7 @@ static bool callFunctionLike(Obj* callee, const ObjFunction* function, const int
 }
 
 bool callClosure(Obj* callable, const int argCount) {
-    return callFunctionLike(callable, ((ObjClosure*) callable)->function, argCount);
+    return callFunctionLike(callable, DEREF(ObjFunction, ((ObjClosure*) callable)->function), argCount);
 }
 
 bool callFunction(Obj* callable, const int argCount) {
@@ -505,7 +684,8 @@ bool callClass(Obj* callable, const int argCount) {
 bool callBoundMethod(Obj* callable, const int argCount) {
     const ObjBoundMethod* bound = (ObjBoundMethod*) callable;
     vm.stackTop[-argCount - 1] = bound->receiver;
-    return bound->method->vtp->call(bound->method, argCount);
+    Obj* method = DEREF(Obj, bound->method);
+    return OBJ_VT(method)->call(method, argCount);
 }
 
 bool callNative(Obj* callable, const int argCount) {
@@ -577,7 +757,7 @@ static bool invoke(ObjString* name, const int argCount) {
         return invokeFromImpl(&((ObjClass*) object)->staticMethods, name, argCount);
     }
 
-    return invokeFromImpl(&((ObjInstance*) object)->klass->methods, name, argCount);
+    return invokeFromImpl(&DEREF(ObjClass, ((ObjInstance*) object)->klass)->methods, name, argCount);
 }
 
 static bool bindMethod(ObjClass* klass, ObjString* name) {
@@ -593,7 +773,7 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
     return true;
 }
 
-static ObjUpvalue* getUpvalue(const CallFrame* frame, const int slot) {
+static Value getUpvalue(const CallFrame* frame, const int slot) {
     return ((ObjClosure*) frame->function)->upvalues[slot];
 }
 
@@ -602,7 +782,7 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     ObjUpvalue* upvalue = vm.openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
-        upvalue = upvalue->next;
+        upvalue = DEREF(ObjUpvalue, upvalue->next);
     }
 
     if (upvalue != NULL && upvalue->location == local) {
@@ -610,12 +790,12 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     }
 
     ObjUpvalue* createdUpvalue = newUpvalue(local);
-    createdUpvalue->next = upvalue;
+    createdUpvalue->next = MAKE_REF(upvalue);
 
     if (prevUpvalue == NULL) {
         vm.openUpvalues = createdUpvalue;
     } else {
-        prevUpvalue->next = createdUpvalue;
+        prevUpvalue->next = MAKE_REF(createdUpvalue);
     }
 
     return createdUpvalue;
@@ -627,7 +807,7 @@ static void closeUpvalues(const Value* last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        vm.openUpvalues = DEREF(ObjUpvalue, upvalue->next);
     }
 }
 
@@ -658,11 +838,10 @@ static ObjString* concatenateImpl(
     char const* buffer1, const int length1,
     char const* buffer2, const int length2
 ) {
-    const int length = length1 + length2;
-    char* chars = ALLOCATE(char, (size_t) length + 1);
-    snprintf(chars, length + 1, "%s%s", buffer1, buffer2);
-    chars[length] = '\0';
-    return takeString(chars, length);
+    ObjString* result = allocateString(length1 + length2);
+    memcpy(result->chars, buffer1, length1);
+    memcpy(result->chars + length1, buffer2, length2);
+    return internString(result);
 }
 
 static void concatenate() {
@@ -730,6 +909,17 @@ static InterpretResult run() {
 #define READ_SHORT() (ip+=2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 #define READ_CONSTANT() (getFrameFunction(frame)->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+// Loops and calls are where an exceeded heap limit is raised, every
+// unbounded allocation has to go through one of them
+#define HEAP_SAFEPOINT() \
+    do { \
+        if (vm.heapExhausted && heapStillExhausted()) { \
+            frame->ip = ip; \
+            if (!throwOutOfMemory()) return INTERPRET_RUNTIME_ERROR; \
+            frame = &vm.frames[vm.frameCount - 1]; \
+            ip = frame->ip; \
+        } \
+    } while (false)
 #define BINARY_OP(valueType, op) \
     do {                         \
         unpackPrimitive(0); \
@@ -743,6 +933,53 @@ static InterpretResult run() {
         double a = AS_NUMBER(pop()); \
         push(valueType(a op b)); \
     } while(false)
+#define INT_BINARY_OP(intType, valueType, op) \
+    do { \
+        if (IS_INT(peek(0)) && IS_INT(peek(1))) { \
+            const int64_t b = AS_INT(pop()); \
+            const int64_t a = AS_INT(pop()); \
+            push(intType(a op b)); \
+        } else { \
+            BINARY_OP(valueType, op); \
+        } \
+    } while (false)
+#ifdef REGISTER_VM
+// Ints and numbers in the operand slots are handled in place, anything
+// else is pushed for the stack instructions following the register
+// instruction to deal with
+#define READ_SLOT() (frame->slots[READ_BYTE()])
+#define REGISTER_STORE(value) \
+    do { \
+        frame->slots[ip[2]] = (value); \
+        ip += 3; \
+    } while (false)
+#define REGISTER_PUSH(value) \
+    do { \
+        push(value); \
+        ip++; \
+    } while (false)
+#define REGISTER_OP(second, result, intCondition, intValue, numberValue) \
+    do { \
+        const Value a = READ_SLOT(); \
+        const Value b = second; \
+        if (IS_INT(a) && IS_INT(b) && (intCondition)) { \
+            result(intValue); \
+        } else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            result(numberValue); \
+        } else { \
+            push(a); \
+            push(b); \
+        } \
+    } while (false)
+#define REGISTER_ARITHMETIC(second, result, intCondition, intValue, op) \
+    REGISTER_OP(second, result, intCondition, intValue, NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)))
+#define REGISTER_MODULUS(second, result) \
+    REGISTER_OP(second, result, AS_INT(b) > 0, intRemainder(AS_INT(a), AS_INT(b)), \
+                NUMBER_VAL(fmod(AS_NUMBER(a), AS_NUMBER(b))))
+#define REGISTER_COMPARISON(second, op) \
+    REGISTER_OP(second, REGISTER_PUSH, true, BOOL_VAL(AS_INT(a) op AS_INT(b)), \
+                BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b)))
+#endif
 
 
     while (true) {
@@ -781,7 +1018,7 @@ static InterpretResult run() {
         case OP_CONSTANT_ZERO:
         case OP_CONSTANT_ONE:
         case OP_CONSTANT_TWO:
-            push(NUMBER_VAL(instruction - OP_CONSTANT_ZERO));
+            push(INT_VAL(instruction - OP_CONSTANT_ZERO));
             break;
         case OP_NIL: push(NIL_VAL);
             break;
@@ -803,6 +1040,11 @@ static InterpretResult run() {
             frame->slots[slot] = peek(0);
             break;
         }
+        case OP_SET_LOCAL_POP: {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = pop();
+            break;
+        }
         case OP_GET_GLOBAL: {
             ObjString* name = READ_STRING();
             Value value;
@@ -814,14 +1056,26 @@ static InterpretResult run() {
             push(value);
             break;
         }
-        case OP_DEFINE_GLOBAL: {
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_CONSTANT: {
             ObjString* name = READ_STRING();
+            if (tableGet(&vm.constantGlobals, name, NULL)) {
+                frame->ip = ip;
+                runtimeError("Already a constant named '%s'.", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
             tableSet(&vm.globals, name, peek(0));
+            if (instruction == OP_DEFINE_CONSTANT) tableSet(&vm.constantGlobals, name, NIL_VAL);
             pop();
             break;
         }
         case OP_SET_GLOBAL: {
             ObjString* name = READ_STRING();
+            if (tableGet(&vm.constantGlobals, name, NULL)) {
+                frame->ip = ip;
+                runtimeError("Can't assign to constant '%s'.", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
             if (tableSet(&vm.globals, name, peek(0))) {
                 tableDelete(&vm.globals, name);
                 frame->ip = ip;
@@ -832,12 +1086,14 @@ static InterpretResult run() {
         }
         case OP_GET_UPVALUE: {
             uint8_t slot = READ_BYTE();
-            push(*getUpvalue(frame, slot)->location);
+            const Value upvalue = getUpvalue(frame, slot);
+            push(IS_UPVALUE(upvalue) ? *AS_UPVALUE(upvalue)->location : upvalue);
             break;
         }
         case OP_SET_UPVALUE: {
             uint8_t slot = READ_BYTE();
-            *getUpvalue(frame, slot)->location = peek(0);
+            // Assigned variables are never captured by value
+            *AS_UPVALUE(getUpvalue(frame, slot))->location = peek(0);
             break;
         }
         case OP_STATIC_FIELD: {
@@ -866,7 +1122,8 @@ static InterpretResult run() {
                     push(value);
                     break;
                 }
-                if (!bindMethod(instance->klass, name)) {
+                frame->ip = ip;
+                if (!bindMethod(DEREF(ObjClass, instance->klass), name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
             } else {
@@ -883,7 +1140,7 @@ static InterpretResult run() {
                 frame->ip = ip;
                 runtimeError(
                     "No static member '%s' on class '%s'.",
-                    name->chars, klass->name->chars);
+                    name->chars, DEREF(ObjString, klass->name)->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
@@ -907,19 +1164,23 @@ static InterpretResult run() {
             break;
         }
         case OP_GET_INDEX: {
-            unpackPrimitive(0);
-            unpackPrimitive(1);
-            if (!IS_NUMBER(peek(0))) {
-                frame->ip = ip;
-                runtimeError("Index must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            if (!IS_ARRAY(peek(1))) {
-                frame->ip = ip;
-                runtimeError("Only arrays are indexable.");
-                return INTERPRET_RUNTIME_ERROR;
+            if (!IS_INT(peek(0)) || !IS_ARRAY(peek(1))) {
+                unpackPrimitive(0);
+                unpackPrimitive(1);
+                if (!IS_NUMBER(peek(0))) {
+                    frame->ip = ip;
+                    runtimeError("Index must be a number.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!IS_ARRAY(peek(1))) {
+                    frame->ip = ip;
+                    runtimeError("Only arrays are indexable.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
             }
-            ptrdiff_t index = (ptrdiff_t) AS_NUMBER(peek(0));
+            ptrdiff_t index = IS_INT(peek(0))
+                                  ? AS_INT(peek(0))
+                                  : (ptrdiff_t) AS_NUMBER(peek(0));
             ObjArray* array = AS_ARRAY(peek(1));
             if (index < 0 || index >= array->array.count) {
                 frame->ip = ip;
@@ -934,19 +1195,23 @@ static InterpretResult run() {
             break;
         }
         case OP_SET_INDEX: {
-            unpackPrimitive(1);
-            unpackPrimitive(2);
-            if (!IS_NUMBER(peek(1))) {
-                frame->ip = ip;
-                runtimeError("Index must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            if (!IS_ARRAY(peek(2))) {
-                frame->ip = ip;
-                runtimeError("Only arrays are indexable.");
-                return INTERPRET_RUNTIME_ERROR;
+            if (!IS_INT(peek(1)) || !IS_ARRAY(peek(2))) {
+                unpackPrimitive(1);
+                unpackPrimitive(2);
+                if (!IS_NUMBER(peek(1))) {
+                    frame->ip = ip;
+                    runtimeError("Index must be a number.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!IS_ARRAY(peek(2))) {
+                    frame->ip = ip;
+                    runtimeError("Only arrays are indexable.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
             }
-            ptrdiff_t index = (ptrdiff_t) AS_NUMBER(peek(1));
+            ptrdiff_t index = IS_INT(peek(1))
+                                  ? AS_INT(peek(1))
+                                  : (ptrdiff_t) AS_NUMBER(peek(1));
             ObjArray* array = AS_ARRAY(peek(2));
             if (index < 0 || index >= array->array.count) {
                 frame->ip = ip;
@@ -974,12 +1239,16 @@ static InterpretResult run() {
         case OP_EQUAL: {
             Value b = pop();
             Value a = pop();
+            if (IS_INT(a) && IS_INT(b)) {
+                push(BOOL_VAL(AS_INT(a) == AS_INT(b)));
+                break;
+            }
             push(BOOL_VAL(valuesEqual(a, b)));
             break;
         }
-        case OP_GREATER: BINARY_OP(BOOL_VAL, >);
+        case OP_GREATER: INT_BINARY_OP(BOOL_VAL, BOOL_VAL, >);
             break;
-        case OP_LESS: BINARY_OP(BOOL_VAL, <);
+        case OP_LESS: INT_BINARY_OP(BOOL_VAL, BOOL_VAL, <);
             break;
         case OP_ADD: {
             /**
@@ -988,6 +1257,12 @@ static InterpretResult run() {
              *  call a version of "toString" for a value, before concatenating
              *  it with a string
              **/
+            if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+                const int64_t b = AS_INT(pop());
+                const int64_t a = AS_INT(pop());
+                push(intResult(a + b));
+                break;
+            }
             unpackPrimitive(0);
             unpackPrimitive(1);
             if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
@@ -1007,11 +1282,27 @@ static InterpretResult run() {
             }
             break;
         }
-        case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -);
+        case OP_SUBTRACT: INT_BINARY_OP(intResult, NUMBER_VAL, -);
             break;
-        case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *);
+        case OP_MULTIPLY: {
+            if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+                const int64_t b = AS_INT(pop());
+                const int64_t a = AS_INT(pop());
+                push(intProduct(a, b));
+                break;
+            }
+            BINARY_OP(NUMBER_VAL, *);
             break;
+        }
         case OP_EXPONENT: {
+            Value power;
+            if (IS_INT(peek(0)) && IS_INT(peek(1)) && AS_INT(peek(0)) >= 0
+                && intPower(AS_INT(peek(1)), AS_INT(peek(0)), &power)) {
+                pop();
+                pop();
+                push(power);
+                break;
+            }
             unpackPrimitive(0);
             unpackPrimitive(1);
             if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
@@ -1028,6 +1319,12 @@ static InterpretResult run() {
         case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /);
             break;
         case OP_MODULUS: {
+            if (IS_INT(peek(0)) && IS_INT(peek(1)) && AS_INT(peek(0)) > 0) {
+                const int32_t b = AS_INT(pop());
+                const int32_t a = AS_INT(pop());
+                push(intRemainder(a, b));
+                break;
+            }
             unpackPrimitive(0);
             unpackPrimitive(1);
             if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
@@ -1044,6 +1341,11 @@ static InterpretResult run() {
         case OP_NOT: push(BOOL_VAL(isFalsy(pop())));
             break;
         case OP_NEGATE: {
+            // Negating 0 gives -0, and INT32_MIN has no int negation
+            if (IS_INT(peek(0)) && AS_INT(peek(0)) != 0 && AS_INT(peek(0)) != INT32_MIN) {
+                push(INT_VAL(-AS_INT(pop())));
+                break;
+            }
             unpackPrimitive(0);
             if (!IS_NUMBER(peek(0))) {
                 frame->ip = ip;
@@ -1058,6 +1360,95 @@ static InterpretResult run() {
             }
             break;
         }
+#ifdef REGISTER_VM
+        case OP_REG_MOVE: {
+            const uint8_t target = READ_BYTE();
+            frame->slots[target] = READ_SLOT();
+            break;
+        }
+        case OP_REG_LOAD_CONSTANT: {
+            const uint8_t target = READ_BYTE();
+            frame->slots[target] = READ_CONSTANT();
+            break;
+        }
+        case OP_REG_ADD:
+            REGISTER_ARITHMETIC(READ_SLOT(), REGISTER_STORE, true, intResult((int64_t) AS_INT(a) + AS_INT(b)), +);
+            break;
+        case OP_REG_ADD_CONSTANT:
+            REGISTER_ARITHMETIC(READ_CONSTANT(), REGISTER_STORE, true, intResult((int64_t) AS_INT(a) + AS_INT(b)), +);
+            break;
+        case OP_REG_SUBTRACT:
+            REGISTER_ARITHMETIC(READ_SLOT(), REGISTER_STORE, true, intResult((int64_t) AS_INT(a) - AS_INT(b)), -);
+            break;
+        case OP_REG_SUBTRACT_CONSTANT:
+            REGISTER_ARITHMETIC(READ_CONSTANT(), REGISTER_STORE, true, intResult((int64_t) AS_INT(a) - AS_INT(b)), -);
+            break;
+        case OP_REG_MULTIPLY:
+            REGISTER_ARITHMETIC(READ_SLOT(), REGISTER_STORE, true, intProduct(AS_INT(a), AS_INT(b)), *);
+            break;
+        case OP_REG_MULTIPLY_CONSTANT:
+            REGISTER_ARITHMETIC(READ_CONSTANT(), REGISTER_STORE, true, intProduct(AS_INT(a), AS_INT(b)), *);
+            break;
+        case OP_REG_DIVIDE:
+            REGISTER_ARITHMETIC(READ_SLOT(), REGISTER_STORE, false, NIL_VAL, /);
+            break;
+        case OP_REG_DIVIDE_CONSTANT:
+            REGISTER_ARITHMETIC(READ_CONSTANT(), REGISTER_STORE, false, NIL_VAL, /);
+            break;
+        case OP_REG_MODULUS: REGISTER_MODULUS(READ_SLOT(), REGISTER_STORE);
+            break;
+        case OP_REG_MODULUS_CONSTANT: REGISTER_MODULUS(READ_CONSTANT(), REGISTER_STORE);
+            break;
+        case OP_REG_PUSH_ADD:
+            REGISTER_ARITHMETIC(READ_SLOT(), REGISTER_PUSH, true, intResult((int64_t) AS_INT(a) + AS_INT(b)), +);
+            break;
+        case OP_REG_PUSH_ADD_CONSTANT:
+            REGISTER_ARITHMETIC(READ_CONSTANT(), REGISTER_PUSH, true, intResult((int64_t) AS_INT(a) + AS_INT(b)), +);
+            break;
+        case OP_REG_PUSH_SUBTRACT:
+            REGISTER_ARITHMETIC(READ_SLOT(), REGISTER_PUSH, true, intResult((int64_t) AS_INT(a) - AS_INT(b)), -);
+            break;
+        case OP_REG_PUSH_SUBTRACT_CONSTANT:
+            REGISTER_ARITHMETIC(READ_CONSTANT(), REGISTER_PUSH, true, intResult((int64_t) AS_INT(a) - AS_INT(b)), -);
+            break;
+        case OP_REG_PUSH_MULTIPLY:
+            REGISTER_ARITHMETIC(READ_SLOT(), REGISTER_PUSH, true, intProduct(AS_INT(a), AS_INT(b)), *);
+            break;
+        case OP_REG_PUSH_MULTIPLY_CONSTANT:
+            REGISTER_ARITHMETIC(READ_CONSTANT(), REGISTER_PUSH, true, intProduct(AS_INT(a), AS_INT(b)), *);
+            break;
+        case OP_REG_PUSH_DIVIDE:
+            REGISTER_ARITHMETIC(READ_SLOT(), REGISTER_PUSH, false, NIL_VAL, /);
+            break;
+        case OP_REG_PUSH_DIVIDE_CONSTANT:
+            REGISTER_ARITHMETIC(READ_CONSTANT(), REGISTER_PUSH, false, NIL_VAL, /);
+            break;
+        case OP_REG_PUSH_MODULUS: REGISTER_MODULUS(READ_SLOT(), REGISTER_PUSH);
+            break;
+        case OP_REG_PUSH_MODULUS_CONSTANT: REGISTER_MODULUS(READ_CONSTANT(), REGISTER_PUSH);
+            break;
+        case OP_REG_PUSH_EQUAL: {
+            // Equality never fails, the fallback is never needed
+            const Value a = READ_SLOT();
+            const Value b = READ_SLOT();
+            REGISTER_PUSH(BOOL_VAL(IS_INT(a) && IS_INT(b) ? AS_INT(a) == AS_INT(b) : valuesEqual(a, b)));
+            break;
+        }
+        case OP_REG_PUSH_EQUAL_CONSTANT: {
+            const Value a = READ_SLOT();
+            const Value b = READ_CONSTANT();
+            REGISTER_PUSH(BOOL_VAL(IS_INT(a) && IS_INT(b) ? AS_INT(a) == AS_INT(b) : valuesEqual(a, b)));
+            break;
+        }
+        case OP_REG_PUSH_GREATER: REGISTER_COMPARISON(READ_SLOT(), >);
+            break;
+        case OP_REG_PUSH_GREATER_CONSTANT: REGISTER_COMPARISON(READ_CONSTANT(), >);
+            break;
+        case OP_REG_PUSH_LESS: REGISTER_COMPARISON(READ_SLOT(), <);
+            break;
+        case OP_REG_PUSH_LESS_CONSTANT: REGISTER_COMPARISON(READ_CONSTANT(), <);
+            break;
+#endif
         case OP_JUMP: {
             uint16_t offset = READ_SHORT();
             ip += offset;
@@ -1068,9 +1459,15 @@ static InterpretResult run() {
             if (isFalsy(peek(0))) ip += offset;
             break;
         }
+        case OP_JUMP_IF_TRUE: {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsy(peek(0))) ip += offset;
+            break;
+        }
         case OP_LOOP: {
             uint16_t offset = READ_SHORT();
             ip -= offset;
+            HEAP_SAFEPOINT();
             break;
         }
         case OP_PRINT: printValue(stdout, pop());
@@ -1084,6 +1481,7 @@ static InterpretResult run() {
             }
             frame = &vm.frames[vm.frameCount - 1];
             ip = frame->ip;
+            HEAP_SAFEPOINT();
             break;
         }
         case OP_INVOKE: {
@@ -1096,6 +1494,7 @@ static InterpretResult run() {
             }
             frame = &vm.frames[vm.frameCount - 1];
             ip = frame->ip;
+            HEAP_SAFEPOINT();
             break;
         }
         case OP_SUPER_INVOKE: {
@@ -1108,6 +1507,7 @@ static InterpretResult run() {
             }
             frame = &vm.frames[vm.frameCount - 1];
             ip = frame->ip;
+            HEAP_SAFEPOINT();
             break;
         }
         case OP_CLOSURE: {
@@ -1115,14 +1515,196 @@ static InterpretResult run() {
             ObjClosure* closure = newClosure(function);
             push(OBJ_VAL(closure));
             for (int i = 0; i < closure->upvalueCount; i++) {
-                uint8_t isLocal = READ_BYTE();
+                uint8_t flags = READ_BYTE();
                 uint8_t index = READ_BYTE();
-                closure->upvalues[i] = isLocal
-                                           ? captureUpvalue(frame->slots + index)
-                                           : getUpvalue(frame, index);
+                if (flags & CAPTURE_VALUE) {
+                    closure->upvalues[i] = frame->slots[index];
+                } else if (flags & CAPTURE_LOCAL) {
+                    closure->upvalues[i] = OBJ_VAL(captureUpvalue(frame->slots + index));
+                } else {
+                    closure->upvalues[i] = getUpvalue(frame, index);
+                }
+            }
+            break;
+        }
+        case OP_INLINE_CALL: {
+            const Value function = READ_CONSTANT();
+            const uint8_t argCount = READ_BYTE();
+            const uint16_t fallback = READ_SHORT();
+            const Value callee = peek(argCount);
+            if (!IS_OBJ(callee) || AS_OBJ(callee) != AS_OBJ(function)) ip += fallback;
+            break;
+        }
+        case OP_INLINE_INVOKE: {
+            ObjString* name = READ_STRING();
+            const Value function = READ_CONSTANT();
+            const uint8_t argCount = READ_BYTE();
+            const uint16_t fallback = READ_SHORT();
+            // The lookups of OP_INVOKE, without the call
+            const Value receiver = peek(argCount);
+            Value method;
+            if (!IS_INSTANCE(receiver)
+                || tableGet(&AS_INSTANCE(receiver)->fields, name, &method)
+                || !tableGet(&DEREF(ObjClass, AS_INSTANCE(receiver)->klass)->methods, name, &method)
+                || AS_OBJ(method) != AS_OBJ(function)) {
+                ip += fallback;
             }
             break;
         }
+        case OP_INLINE_RETURN: {
+            const uint8_t depth = READ_BYTE();
+            const uint16_t skip = READ_SHORT();
+            vm.stackTop[-depth - 1] = peek(0);
+            vm.stackTop -= depth;
+            ip += skip;
+            break;
+        }
+        case OP_DUP_PAIR:
+            push(peek(1));
+            push(peek(1));
+            break;
+        case OP_UPDATE_PROPERTY: {
+            ObjString* name = READ_STRING();
+            const uint8_t operator = READ_BYTE();
+            const uint16_t skip = READ_SHORT();
+            // Only fields of instances are updated in place
+            if (IS_INSTANCE(peek(1))) {
+                Table* fields = &AS_INSTANCE(peek(1))->fields;
+                const int slot = tableFindSlot(fields, name);
+                Value result;
+                if (slot != -1 && updateArithmetic(operator, tableGetSlot(fields, slot), peek(0), &result)) {
+                    tableSetSlot(fields, slot, result);
+                    vm.stackTop[-2] = result;
+                    vm.stackTop--;
+                    ip += skip;
+                    break;
+                }
+            }
+            pop();
+            break;
+        }
+        case OP_UPDATE_INDEX: {
+            const uint8_t operator = READ_BYTE();
+            const uint16_t skip = READ_SHORT();
+            if (IS_ARRAY(peek(2)) && IS_INT(peek(1))) {
+                ValueArray* elements = &AS_ARRAY(peek(2))->array;
+                const int32_t index = AS_INT(peek(1));
+                Value result;
+                if (index >= 0 && index < elements->count
+                    && updateArithmetic(operator, elements->values[index], peek(0), &result)) {
+                    elements->values[index] = result;
+                    vm.stackTop[-3] = result;
+                    vm.stackTop -= 2;
+                    ip += skip;
+                    break;
+                }
+            }
+            pop();
+            break;
+        }
+        case OP_UPDATE_GLOBAL: {
+            ObjString* name = READ_STRING();
+            const uint8_t operator = READ_BYTE();
+            const uint16_t skip = READ_SHORT();
+            const int slot = tableFindSlot(&vm.globals, name);
+            Value result;
+            // A constant is left to the OP_SET_GLOBAL that follows to reject
+            if (slot != -1 && !tableGet(&vm.constantGlobals, name, NULL)
+                && updateArithmetic(operator, tableGetSlot(&vm.globals, slot), peek(0), &result)) {
+                tableSetSlot(&vm.globals, slot, result);
+                vm.stackTop[-1] = result;
+                ip += skip;
+                break;
+            }
+            pop();
+            break;
+        }
+        case OP_UPDATE_UPVALUE: {
+            const uint8_t slot = READ_BYTE();
+            const uint8_t operator = READ_BYTE();
+            const uint16_t skip = READ_SHORT();
+            // Assigned variables are never captured by value
+            Value* location = AS_UPVALUE(getUpvalue(frame, slot))->location;
+            Value result;
+            if (updateArithmetic(operator, *location, peek(0), &result)) {
+                *location = result;
+                vm.stackTop[-1] = result;
+                ip += skip;
+                break;
+            }
+            pop();
+            break;
+        }
+        case OP_SWITCH_DENSE: {
+            const int32_t low = AS_INT(READ_CONSTANT());
+            const uint16_t count = READ_SHORT();
+            const uint8_t* entries = ip;
+            ip += count * SWITCH_DENSE_ENTRY;
+            const Value value = switchValue(peek(0));
+            int64_t index = -1;
+            if (IS_INT(value)) {
+                index = (int64_t) AS_INT(value) - low;
+            } else if (IS_NUMBER(value)) {
+                const double number = AS_NUMBER(value) - low;
+                if (number >= 0 && number < count && number == (int64_t) number) index = (int64_t) number;
+            }
+            if (index < 0 || index >= count) break;
+            const uint8_t* entry = &entries[index * SWITCH_DENSE_ENTRY];
+            const uint16_t address = (uint16_t) (entry[0] << 8 | entry[1]);
+            if (address != NO_CASE) ip = &getFrameFunction(frame)->chunk.code[address];
+            break;
+        }
+        case OP_SWITCH_HASHED: {
+            const uint16_t capacity = READ_SHORT();
+            const uint8_t* entries = ip;
+            ip += capacity * SWITCH_HASHED_ENTRY;
+            const Value value = switchValue(peek(0));
+            // The cases are literals, which no other object equals
+            if (IS_OBJ(value) && !IS_STRING(value)) break;
+            const Chunk* chunk = &getFrameFunction(frame)->chunk;
+            for (uint32_t slot = switchHash(value) & (capacity - 1);; slot = (slot + 1) & (capacity - 1)) {
+                const uint8_t* entry = &entries[slot * SWITCH_HASHED_ENTRY];
+                const uint16_t address = (uint16_t) (entry[1] << 8 | entry[2]);
+                if (address == NO_CASE) break;
+                if (valuesEqual(chunk->constants.values[entry[0]], value)) {
+                    ip = &chunk->code[address];
+                    break;
+                }
+            }
+            break;
+        }
+        case OP_FOR_PREP: {
+            const uint8_t counter = READ_BYTE();
+            const uint8_t flags = READ_BYTE();
+            const uint8_t limitOperand = READ_BYTE();
+            const uint16_t body = READ_SHORT();
+            const Value value = frame->slots[counter];
+            const Value limit = flags & FOR_LIMIT_CONSTANT
+                                    ? getFrameFunction(frame)->chunk.constants.values[limitOperand]
+                                    : frame->slots[limitOperand];
+            if (IS_INT(value) && IS_INT(limit) && forCondition(AS_INT(value), AS_INT(limit), flags)) {
+                ip += body;
+            }
+            break;
+        }
+        case OP_FOR_LOOP: {
+            const uint8_t counter = READ_BYTE();
+            const uint8_t flags = READ_BYTE();
+            const uint8_t limitOperand = READ_BYTE();
+            const int8_t step = (int8_t) READ_BYTE();
+            const uint16_t body = READ_SHORT();
+            const Value value = frame->slots[counter];
+            const Value limit = flags & FOR_LIMIT_CONSTANT
+                                    ? getFrameFunction(frame)->chunk.constants.values[limitOperand]
+                                    : frame->slots[limitOperand];
+            if (!IS_INT(value) || !IS_INT(limit)) break;
+            // Past the end or overflowing, the generic code takes over
+            const int64_t next = (int64_t) AS_INT(value) + step;
+            if (next < INT32_MIN || next > INT32_MAX || !forCondition((int32_t) next, AS_INT(limit), flags)) break;
+            frame->slots[counter] = INT_VAL((int32_t) next);
+            ip += body;
+            break;
+        }
         case OP_CLOSE_UPVALUE: {
             closeUpvalues(vm.stackTop - 1);
             pop();
@@ -1172,15 +1754,7 @@ static InterpretResult run() {
         }
         case OP_THROW: {
             frame->ip = ip;
-            Value stacktrace = getStackTrace();
-            Value value = peek(0);
-            if (IS_INSTANCE(value)) {
-                tableSet(
-                    &AS_INSTANCE(value)->fields,
-                    copyString("stackTrace", 10),
-                    stacktrace);
-            }
-            if (propagateException()) {
+            if (throwException()) {
                 frame = &vm.frames[vm.frameCount - 1];
                 ip = frame->ip;
                 break;
@@ -1220,22 +1794,47 @@ static InterpretResult run() {
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef INT_BINARY_OP
+#undef HEAP_SAFEPOINT
+#ifdef REGISTER_VM
+#undef READ_SLOT
+#undef REGISTER_STORE
+#undef REGISTER_PUSH
+#undef REGISTER_OP
+#undef REGISTER_ARITHMETIC
+#undef REGISTER_MODULUS
+#undef REGISTER_COMPARISON
+#endif
+}
+
+// In arena mode everything the run allocated goes once it is over
+static InterpretResult endRun(const InterpretResult result) {
+    if (vm.arena != ARENA_OFF) {
+        resetStack();
+        releaseArena();
+    }
+    return result;
 }
 
 InterpretResult interpretCompiled(ObjFunction* function) {
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    if (function == NULL) return endRun(INTERPRET_COMPILE_ERROR);
+    beginArena();
     push(OBJ_VAL(function));
+#ifdef REGISTER_VM
+    lowerToRegisters(function);
+#endif
     callFunction((Obj*) function, 0);
 
     if (setjmp(vm.exit_state) == 0) {
         vm.exit_state_ready = true;
-        return run();
+        return endRun(run());
     }
 
-    return INTERPRET_EXIT;
+    return endRun(INTERPRET_EXIT);
 }
 
 InterpretResult interpret(InputFile source) {
+    beginArena();
     ObjFunction* function = compile(source);
     return interpretCompiled(function);
 }
@@ -0,0 +1,574 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UNIT_TESTING 1
+#include <cmocka.h>
+
+#include <clox/table.h>
+
+#include "vm_stubs.h"
+
+#define KEY_POOL_SIZE 2000
+
+// Slots table.c moves over from the previous storage on every change
+#define TABLE_MIGRATE_STEP 64
+
+#define TEST_CASE(testfn) cmocka_unit_test_setup_teardown(testfn, initTestTable, freeTestTable)
+
+static Table table;
+
+static int initTestTable(void**) {
+    resetKeys();
+    initTable(&table);
+    return 0;
+}
+
+static int freeTestTable(void**) {
+    freeTable(&table);
+    assert_uint_equal(tableBytesAllocated(), 0);
+    return 0;
+}
+
+static uint32_t hashChars(const char* chars, const int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t) chars[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// Keys are named after their number, hashMask leaves fewer hash bits to
+// force probe collisions
+static ObjString* makeKey(const int number, const uint32_t hashMask) {
+    char chars[16];
+    const int length = snprintf(chars, sizeof(chars), "k%d", number);
+    return newKey(chars, length, hashChars(chars, length) & hashMask);
+}
+
+static Value numberValue(const int number) {
+    return NUMBER_VAL((double) number);
+}
+
+static int asNumber(const Value value) {
+    return (int) AS_NUMBER(value);
+}
+
+static void assertHas(ObjString* key, const int expected) {
+    Value value;
+    assert_true(tableGet(&table, key, &value));
+    assert_int_equal(asNumber(value), expected);
+}
+
+static void assertMissing(ObjString* key) {
+    assert_false(tableGet(&table, key, NULL));
+    assert_int_equal(tableFindSlot(&table, key), -1);
+}
+
+// The keys a table should hold, and their values
+typedef struct {
+    ObjString* keys[KEY_POOL_SIZE];
+    bool present[KEY_POOL_SIZE];
+    int values[KEY_POOL_SIZE];
+    int size;
+    int count;
+    // Index of the first key among all keys made
+    int first;
+} Model;
+
+static void initModel(Model* model, const int size, const uint32_t hashMask) {
+    model->size = size;
+    model->count = 0;
+    for (int i = 0; i < size; i++) {
+        model->keys[i] = makeKey(i, hashMask);
+        model->present[i] = false;
+        model->values[i] = 0;
+    }
+    model->first = keyIndex(model->keys[0]);
+}
+
+static void modelSet(Model* model, const int index, const int value) {
+    const bool isNew = tableSet(&table, model->keys[index], numberValue(value));
+    assert_int_equal(isNew, !model->present[index]);
+    model->count += isNew;
+    model->present[index] = true;
+    model->values[index] = value;
+}
+
+static void modelDelete(Model* model, const int index) {
+    const bool deleted = tableDelete(&table, model->keys[index]);
+    assert_int_equal(deleted, model->present[index]);
+    model->count -= deleted;
+    model->present[index] = false;
+}
+
+static void verifyModel(const Model* model) {
+    assert_int_equal(table.count, model->count);
+
+    for (int i = 0; i < model->size; i++) {
+        ObjString* key = model->keys[i];
+        if (!model->present[i]) {
+            assertMissing(key);
+            assert_null(tableFindString(&table, key->chars, key->length, key->hash));
+            continue;
+        }
+
+        assertHas(key, model->values[i]);
+        const int slot = tableFindSlot(&table, key);
+        assert_true(slot >= 0);
+        assert_int_equal(asNumber(tableGetSlot(&table, slot)), model->values[i]);
+        assert_ptr_equal(tableFindString(&table, key->chars, key->length, key->hash), key);
+    }
+
+    bool seen[KEY_POOL_SIZE] = {false};
+    int iterated = 0;
+    for (TableIterator it = newTableIterator(&table); !it.done; advanceTableIterator(&it)) {
+        const int index = keyIndex(getKeyTableIterator(&it)) - model->first;
+        assert_true(index >= 0 && index < model->size);
+        assert_true(model->present[index]);
+        assert_false(seen[index]);
+        assert_int_equal(asNumber(getValueTableIterator(&it)), model->values[index]);
+        seen[index] = true;
+        iterated++;
+    }
+    assert_int_equal(iterated, model->count);
+}
+
+static uint32_t nextRandom(uint64_t* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return (uint32_t) (*seed >> 32);
+}
+
+// Marks a random share of the keys and collects the rest
+static void modelRemoveWhite(Model* model, uint64_t* seed) {
+    clearMarks();
+    for (int i = 0; i < model->size; i++) {
+        if (model->present[i] && nextRandom(seed) % 4 != 0) {
+            setMarked(model->keys[i], true);
+        }
+    }
+
+    tableRemoveWhite(&table);
+
+    for (int i = 0; i < model->size; i++) {
+        if (model->present[i] && !isMarked(model->keys[i])) {
+            model->present[i] = false;
+            model->count--;
+        }
+    }
+    clearMarks();
+}
+
+// Random sets, deletes, lookups and collections checked against the model.
+// Deletes are frequent enough for tables to shrink back as well as grow.
+static void runModel(Model* model, uint64_t seed, const int steps) {
+    for (int step = 1; step <= steps; step++) {
+        const uint32_t op = nextRandom(&seed) % 1000;
+        const int index = (int) (nextRandom(&seed) % (uint32_t) model->size);
+
+        if (op < 500) {
+            modelSet(model, index, (int) (nextRandom(&seed) % 100000));
+        } else if (op < 800) {
+            modelDelete(model, index);
+        } else if (op < 998) {
+            if (model->present[index]) {
+                assertHas(model->keys[index], model->values[index]);
+            } else {
+                assertMissing(model->keys[index]);
+            }
+        } else {
+            modelRemoveWhite(model, &seed);
+        }
+
+        if (step % 997 == 0) {
+            verifyModel(model);
+        }
+    }
+    verifyModel(model);
+}
+
+static void test_set_get_overwrite(void**) {
+    Model model;
+    initModel(&model, 200, UINT32_MAX);
+
+    for (int i = 0; i < model.size; i++) {
+        modelSet(&model, i, i);
+    }
+    verifyModel(&model);
+
+    for (int i = 0; i < model.size; i += 3) {
+        modelSet(&model, i, -i);
+    }
+    verifyModel(&model);
+    assert_int_equal(table.count, model.size);
+}
+
+static void test_delete(void**) {
+    Model model;
+    initModel(&model, 200, UINT32_MAX);
+    assert_false(tableDelete(&table, model.keys[0]));
+
+    for (int i = 0; i < model.size; i++) {
+        modelSet(&model, i, i);
+    }
+    for (int i = 0; i < model.size; i += 2) {
+        modelDelete(&model, i);
+    }
+    verifyModel(&model);
+
+    // Deleting twice finds nothing the second time
+    modelDelete(&model, 0);
+    for (int i = 1; i < model.size; i += 2) {
+        modelDelete(&model, i);
+    }
+    verifyModel(&model);
+    assert_int_equal(table.count, 0);
+}
+
+// Keys sharing the first probe position fill a run of slots, so one
+// deleted from the middle of it leaves a tombstone that probes pass
+// over, and the same key set again takes that slot back
+static void test_tombstone_reuse(void**) {
+    Model model;
+    initModel(&model, 40, UINT32_MAX);
+    for (int i = 0; i < model.size; i++) {
+        model.keys[i]->hash = (uint32_t) i;
+        modelSet(&model, i, i);
+    }
+
+    const int capacity = table.capacity;
+    const int growthLeft = table.growthLeft;
+
+    modelDelete(&model, 5);
+    assert_int_equal(table.growthLeft, growthLeft);
+    verifyModel(&model);
+
+    modelSet(&model, 5, 50);
+    assert_int_equal(table.growthLeft, growthLeft);
+    assert_int_equal(table.capacity, capacity);
+    verifyModel(&model);
+
+    // Replacing keys one by one at the same count rehashes to clean
+    // the tombstones up, the table does not keep growing
+    freeTable(&table);
+    Model churn;
+    initModel(&churn, KEY_POOL_SIZE, UINT32_MAX);
+    for (int i = 0; i < churn.size; i++) {
+        modelSet(&churn, i, i);
+        if (i >= model.size) {
+            modelDelete(&churn, i - model.size);
+        }
+        assert_true(table.capacity <= 2 * capacity);
+    }
+    verifyModel(&churn);
+}
+
+static void test_remove_white(void**) {
+    Model model;
+    initModel(&model, 100, UINT32_MAX);
+    for (int i = 0; i < model.size; i++) {
+        modelSet(&model, i, i);
+    }
+    const int capacity = table.capacity;
+
+    clearMarks();
+    for (int i = 0; i < model.size; i += 2) {
+        setMarked(model.keys[i], true);
+    }
+    tableRemoveWhite(&table);
+    for (int i = 1; i < model.size; i += 2) {
+        model.present[i] = false;
+        model.count--;
+    }
+    clearMarks();
+
+    // Nothing is allocated during a collection, the table keeps its size
+    assert_int_equal(table.capacity, capacity);
+    verifyModel(&model);
+
+    for (int i = 1; i < model.size; i += 2) {
+        modelSet(&model, i, i);
+    }
+    verifyModel(&model);
+}
+
+static void test_mark(void**) {
+    Model model;
+    initModel(&model, 100, UINT32_MAX);
+    for (int i = 0; i < model.size; i++) {
+        modelSet(&model, i, i);
+    }
+    for (int i = 0; i < model.size; i += 3) {
+        modelDelete(&model, i);
+    }
+
+    clearMarks();
+    markTable(&table);
+    for (int i = 0; i < model.size; i++) {
+        assert_int_equal(isMarked(model.keys[i]), model.present[i]);
+    }
+}
+
+static void test_find_or_add_string(void**) {
+    ObjString* added = tableFindOrAddString(&table, "name", 4, hashChars("name", 4));
+    assert_int_equal(table.count, 1);
+    assert_ptr_equal(tableFindOrAddString(&table, "name", 4, hashChars("name", 4)), added);
+    assert_int_equal(table.count, 1);
+    assert_null(tableFindString(&table, "nam", 3, hashChars("nam", 3)));
+}
+
+// Up to TABLE_INLINE_CAPACITY keys are kept inline, without storage
+// of their own. One more moves them all into hashed storage.
+static void test_inline_promotion(void**) {
+    Model model;
+    initModel(&model, TABLE_INLINE_CAPACITY + 1, UINT32_MAX);
+    for (int i = 0; i < TABLE_INLINE_CAPACITY; i++) {
+        modelSet(&model, i, i);
+        assert_int_equal(table.capacity, 0);
+    }
+    verifyModel(&model);
+
+    // A full inline table still takes new values for its keys
+    modelSet(&model, 3, 30);
+    assert_int_equal(table.capacity, 0);
+    assert_uint_equal(tableBytesAllocated(), 0);
+    verifyModel(&model);
+
+    modelSet(&model, TABLE_INLINE_CAPACITY, TABLE_INLINE_CAPACITY);
+    assert_true(table.capacity > 0);
+    assert_true(tableBytesAllocated() > 0);
+    verifyModel(&model);
+}
+
+// Deletes from inline keys move the last one into the hole
+static void test_inline_delete(void**) {
+    Model model;
+    initModel(&model, TABLE_INLINE_CAPACITY, UINT32_MAX);
+    for (int i = 0; i < model.size; i++) {
+        modelSet(&model, i, i);
+    }
+
+    modelDelete(&model, 0);
+    modelDelete(&model, 0);
+    modelDelete(&model, model.size - 1);
+    modelDelete(&model, 4);
+    verifyModel(&model);
+
+    modelSet(&model, 4, 40);
+    modelSet(&model, 0, 0);
+    assert_int_equal(table.capacity, 0);
+    verifyModel(&model);
+}
+
+// Once promoted the table stays hashed until deletes leave few enough
+// keys to move them inline again, which frees the storage
+static void test_delete_after_promotion(void**) {
+    Model model;
+    initModel(&model, 20, UINT32_MAX);
+    for (int i = 0; i < model.size; i++) {
+        modelSet(&model, i, i);
+    }
+    assert_true(table.capacity > 0);
+
+    int index = 0;
+    while (model.count > TABLE_INLINE_CAPACITY / 2 + 1) {
+        modelDelete(&model, index++);
+        assert_true(table.capacity > 0);
+        verifyModel(&model);
+    }
+
+    modelDelete(&model, index++);
+    assert_int_equal(table.capacity, 0);
+    assert_uint_equal(tableBytesAllocated(), 0);
+    verifyModel(&model);
+
+    // Deleted keys come back, and promote the table a second time
+    for (int i = 0; i < index; i++) {
+        modelSet(&model, i, -i);
+    }
+    assert_true(table.capacity > 0);
+    verifyModel(&model);
+}
+
+static void test_remove_white_inline(void**) {
+    Model model;
+    initModel(&model, TABLE_INLINE_CAPACITY, UINT32_MAX);
+    for (int i = 0; i < model.size; i++) {
+        modelSet(&model, i, i);
+    }
+
+    clearMarks();
+    setMarked(model.keys[1], true);
+    setMarked(model.keys[6], true);
+    tableRemoveWhite(&table);
+    for (int i = 0; i < model.size; i++) {
+        if (!isMarked(model.keys[i])) {
+            model.present[i] = false;
+            model.count--;
+        }
+    }
+    clearMarks();
+    verifyModel(&model);
+
+    markTable(&table);
+    for (int i = 0; i < model.size; i++) {
+        assert_int_equal(isMarked(model.keys[i]), model.present[i]);
+    }
+}
+
+static bool isMigrating() {
+    return table.capacity > 0 && table.oldEntries != NULL;
+}
+
+// Slots of the previous storage are numbered after the current ones
+static bool inPreviousStorage(ObjString* key) {
+    return tableFindSlot(&table, key) >= table.capacity;
+}
+
+// Sets keys in order until a large table starts to resize, the
+// previous storage then still holds everything but the latest key
+static int startMigration(Model* model) {
+    int index = 0;
+    while (!isMigrating()) {
+        assert_true(index < model->size);
+        modelSet(model, index, index);
+        index++;
+    }
+    assert_int_equal(table.migrated, 0);
+    assert_true(table.oldCapacity >= 1024);
+    return index;
+}
+
+// Lookups leave the migration where it is, and find keys in both
+// storages. The teardown frees a table still being resized.
+static void test_migration_lookups(void**) {
+    Model model;
+    initModel(&model, KEY_POOL_SIZE, UINT32_MAX);
+    startMigration(&model);
+
+    verifyModel(&model);
+    assert_true(isMigrating());
+    assert_int_equal(table.migrated, 0);
+
+    int inPrevious = 0;
+    for (int i = 0; i < model.size; i++) {
+        inPrevious += model.present[i] && inPreviousStorage(model.keys[i]);
+    }
+    assert_true(inPrevious > 0);
+
+    // Every change moves the next slots of the previous storage over
+    modelSet(&model, 0, -1);
+    assert_true(isMigrating());
+    assert_true(table.migrated > 0);
+    verifyModel(&model);
+}
+
+// Overwrites and deletes reach keys still in the previous storage, and
+// new keys only go to the current one. Every change moves as many slots
+// over, which is done before the new storage could run out of room.
+static void test_migration_changes(void**) {
+    Model model;
+    initModel(&model, KEY_POOL_SIZE, UINT32_MAX);
+    const int next = startMigration(&model);
+    const int steps = (table.oldCapacity + TABLE_MIGRATE_STEP - 1) / TABLE_MIGRATE_STEP;
+
+    int changes = 0;
+    int previousChanged = 0;
+    for (int i = next - 1; isMigrating(); i--) {
+        assert_true(i >= 0);
+        const bool previous = inPreviousStorage(model.keys[i]);
+        previousChanged += previous;
+
+        switch (i % 3) {
+            case 0: modelSet(&model, i, -i); break;
+            case 1: modelDelete(&model, i); break;
+            default:
+                modelSet(&model, next + changes, next + changes);
+                assert_false(inPreviousStorage(model.keys[next + changes]));
+                break;
+        }
+        changes++;
+        verifyModel(&model);
+    }
+
+    assert_int_equal(changes, steps);
+    assert_true(previousChanged > 0);
+}
+
+// Collections neither move slots over nor allocate, whichever storage the
+// keys are in. The migration carries on with the keys that are left.
+static void test_migration_collect(void**) {
+    Model model;
+    initModel(&model, KEY_POOL_SIZE, UINT32_MAX);
+    int next = startMigration(&model);
+    modelSet(&model, next, next);
+    next++;
+
+    const int migrated = table.migrated;
+    const size_t bytes = tableBytesAllocated();
+
+    clearMarks();
+    markTable(&table);
+    for (int i = 0; i < model.size; i++) {
+        assert_int_equal(isMarked(model.keys[i]), model.present[i]);
+    }
+
+    clearMarks();
+    for (int i = 0; i < next; i += 2) {
+        setMarked(model.keys[i], true);
+    }
+    tableRemoveWhite(&table);
+    for (int i = 1; i < next; i += 2) {
+        model.present[i] = false;
+        model.count--;
+    }
+    clearMarks();
+
+    assert_true(isMigrating());
+    assert_int_equal(table.migrated, migrated);
+    assert_uint_equal(tableBytesAllocated(), bytes);
+    verifyModel(&model);
+
+    while (isMigrating()) {
+        modelSet(&model, next, next);
+        next++;
+    }
+    verifyModel(&model);
+}
+
+static void test_random(void**) {
+    Model model;
+    initModel(&model, KEY_POOL_SIZE, UINT32_MAX);
+    runModel(&model, 0x9E3779B97F4A7C15u, 200000);
+}
+
+static void test_random_colliding(void**) {
+    Model model;
+    initModel(&model, KEY_POOL_SIZE, 0xFFF);
+    runModel(&model, 0xD1B54A32D192ED03u, 100000);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        TEST_CASE(test_set_get_overwrite),
+        TEST_CASE(test_delete),
+        TEST_CASE(test_tombstone_reuse),
+        TEST_CASE(test_remove_white),
+        TEST_CASE(test_mark),
+        TEST_CASE(test_find_or_add_string),
+        TEST_CASE(test_inline_promotion),
+        TEST_CASE(test_inline_delete),
+        TEST_CASE(test_delete_after_promotion),
+        TEST_CASE(test_remove_white_inline),
+        TEST_CASE(test_migration_lookups),
+        TEST_CASE(test_migration_changes),
+        TEST_CASE(test_migration_collect),
+        TEST_CASE(test_random),
+        TEST_CASE(test_random_colliding),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
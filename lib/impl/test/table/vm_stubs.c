@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <clox/object.h>
+
+#include <impl/heap.h>
+#include <impl/memory.h>
+#include <impl/object.h>
+
+#include "vm_stubs.h"
+
+// Room for a key of up to KEY_MAX_LENGTH characters
+#define KEY_MAX_LENGTH 23
+#define KEY_SIZE (sizeof(ObjString) + KEY_MAX_LENGTH + 1)
+#define KEY_STRIDE ((KEY_SIZE + 7) & ~(size_t) 7)
+
+// Offset zero stands for a NULL reference, so the keys start past it
+#define KEY_BASE 8
+
+alignas(8) static uint8_t keyMemory[KEY_BASE + MAX_TEST_KEYS * KEY_STRIDE];
+static bool marks[MAX_TEST_KEYS];
+static int keyCount = 0;
+static size_t bytesAllocated = 0;
+
+#ifdef COMPRESSED_REFS
+uint8_t* heapRegionBase = keyMemory;
+#endif
+
+ObjString* newKey(const char* chars, const int length, const uint32_t hash) {
+    if (keyCount == MAX_TEST_KEYS || length > KEY_MAX_LENGTH) abort();
+
+    ObjString* key = (ObjString*) (keyMemory + KEY_BASE + keyCount * KEY_STRIDE);
+    key->obj.type = OBJ_STRING;
+    key->length = length;
+    key->hash = hash;
+    memcpy(key->chars, chars, length);
+    key->chars[length] = '\0';
+    marks[keyCount++] = false;
+    return key;
+}
+
+int keyIndex(const ObjString* key) {
+    return (int) (((const uint8_t*) key - keyMemory - KEY_BASE) / KEY_STRIDE);
+}
+
+void resetKeys() {
+    keyCount = 0;
+    clearMarks();
+}
+
+void setMarked(const ObjString* key, const bool marked) {
+    marks[keyIndex(key)] = marked;
+}
+
+bool isMarked(const ObjString* key) {
+    return marks[keyIndex(key)];
+}
+
+void clearMarks() {
+    memset(marks, 0, sizeof(marks));
+}
+
+size_t tableBytesAllocated() {
+    return bytesAllocated;
+}
+
+void* reallocate(void* previous, const size_t oldSize, const size_t newSize) {
+    bytesAllocated += newSize - oldSize;
+    if (newSize == 0) {
+        free(previous);
+        return NULL;
+    }
+    void* result = realloc(previous, newSize);
+    if (result == NULL) abort();
+    return result;
+}
+
+bool heapIsMarked(const void* object) {
+    return isMarked(object);
+}
+
+void markObject(Obj* object) {
+    setMarked((ObjString*) object, true);
+}
+
+void markValue([[maybe_unused]] Value value) {
+}
+
+ObjString* copyString(const char* chars, const int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t) chars[i];
+        hash *= 16777619;
+    }
+    return newKey(chars, length, hash);
+}
@@ -0,0 +1,31 @@
+#ifndef __CLOX2_TEST_VM_STUBS_H__
+#define __CLOX2_TEST_VM_STUBS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <clox/object.h>
+
+// Keys are handed out from a fixed pool instead of the VM heap, which
+// lets references be compressed without it
+#define MAX_TEST_KEYS 4096
+
+ObjString* newKey(const char* chars, int length, uint32_t hash);
+
+// Index of the key in the order it was made
+int keyIndex(const ObjString* key);
+
+// Forgets every key and mark
+void resetKeys();
+
+void setMarked(const ObjString* key, bool marked);
+
+bool isMarked(const ObjString* key);
+
+void clearMarks();
+
+// Bytes the table holds through reallocate
+size_t tableBytesAllocated();
+
+#endif //__CLOX2_TEST_VM_STUBS_H__
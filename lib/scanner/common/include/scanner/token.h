@@ -20,12 +20,12 @@ typedef enum {
 
 	// Keyword tokens
 	TOKEN_AND, TOKEN_AS, TOKEN_BREAK, TOKEN_CASE, 
-	TOKEN_CATCH, TOKEN_CLASS, TOKEN_CONTINUE, TOKEN_DEFAULT, 
-	TOKEN_ELSE, TOKEN_FALSE, TOKEN_FOR, TOKEN_FUN, 
-	TOKEN_FINALLY, TOKEN_IF, TOKEN_NIL, TOKEN_OR, 
-	TOKEN_PRINT, TOKEN_RETURN, TOKEN_STATIC, TOKEN_SUPER, 
-	TOKEN_SWITCH, TOKEN_THIS, TOKEN_THROW, TOKEN_TRUE, 
-	TOKEN_TRY, TOKEN_VAR, TOKEN_WHILE,
+	TOKEN_CATCH, TOKEN_CLASS, TOKEN_CONST, TOKEN_CONTINUE, 
+	TOKEN_DEFAULT, TOKEN_ELSE, TOKEN_FALSE, TOKEN_FOR, 
+	TOKEN_FUN, TOKEN_FINALLY, TOKEN_IF, TOKEN_NIL, 
+	TOKEN_OR, TOKEN_PRINT, TOKEN_RETURN, TOKEN_STATIC, 
+	TOKEN_SUPER, TOKEN_SWITCH, TOKEN_THIS, TOKEN_THROW, 
+	TOKEN_TRUE, TOKEN_TRY, TOKEN_VAR, TOKEN_WHILE,
 
 	// Special tokens
 	TOKEN_ERROR, TOKEN_EOF
@@ -110,19 +110,19 @@ int main(void) {
         named_test("test_keywords", test_base_multiple_types,
             makeMultipleTypeData(
                 "and as break case catch "
-                "class continue default else false "
-                "for fun finally if nil "
-                "or print return static super "
-                "switch this throw true try "
-                "var while",
-                27,
+                "class const continue default else "
+                "false for fun finally if "
+                "nil or print return static "
+                "super switch this throw true "
+                "try var while",
+                28,
                 (TokenType*) &(TokenType[]) {
                     TOKEN_AND, TOKEN_AS, TOKEN_BREAK, TOKEN_CASE, TOKEN_CATCH,
-                    TOKEN_CLASS, TOKEN_CONTINUE, TOKEN_DEFAULT, TOKEN_ELSE, TOKEN_FALSE,
-                    TOKEN_FOR, TOKEN_FUN, TOKEN_FINALLY, TOKEN_IF, TOKEN_NIL,
-                    TOKEN_OR, TOKEN_PRINT, TOKEN_RETURN, TOKEN_STATIC, TOKEN_SUPER,
-                    TOKEN_SWITCH, TOKEN_THIS, TOKEN_THROW, TOKEN_TRUE, TOKEN_TRY,
-                    TOKEN_VAR, TOKEN_WHILE
+                    TOKEN_CLASS, TOKEN_CONST, TOKEN_CONTINUE, TOKEN_DEFAULT, TOKEN_ELSE,
+                    TOKEN_FALSE, TOKEN_FOR, TOKEN_FUN, TOKEN_FINALLY, TOKEN_IF,
+                    TOKEN_NIL, TOKEN_OR, TOKEN_PRINT, TOKEN_RETURN, TOKEN_STATIC,
+                    TOKEN_SUPER, TOKEN_SWITCH, TOKEN_THIS, TOKEN_THROW, TOKEN_TRUE,
+                    TOKEN_TRY, TOKEN_VAR, TOKEN_WHILE
                 }
             )
         ),
@@ -158,7 +158,7 @@ int main(void) {
 
         named_test(
             "test_non_keywords", test_base_single_type,
-            makeSingleTypeData("classic thorws asm quiro",TOKEN_IDENTIFIER)
+            makeSingleTypeData("classic thorws asm quiro cons constant",TOKEN_IDENTIFIER)
         ),
         // cmocka_unit_test(test_number),
         named_test(
@@ -161,7 +161,15 @@ static TokenType identifierType(Scanner* scanner) {
 				}
 				break;
 			case 'l': return checkKeyword(scanner, 2, 3, "ass", TOKEN_CLASS);
-			case 'o': return checkKeyword(scanner, 2, 6, "ntinue", TOKEN_CONTINUE);
+			case 'o':
+				if (scanner->current - scanner->start > 3 && scanner->start[2] == 'n') {
+					switch (scanner->start[3]) {
+					case 's': return checkKeyword(scanner, 4, 1, "t", TOKEN_CONST);
+					case 't': return checkKeyword(scanner, 4, 4, "inue", TOKEN_CONTINUE);
+					default: ;
+					}
+				}
+				break;
 			default: ;
 			}
 		}